@@ -34,6 +34,7 @@
 #include <malamute.h>
 #include <cxxtools/allocator.h>
 #include <magic.h>
+#include <openssl/ssl.h>
 #include <fty_log.h>
 #include <fty_common_mlm.h>
 #include <fty_common_translation.h>
@@ -36,14 +36,52 @@ extern "C" {
 //      verbose             1 turns verbose mode on, 0 off
 //      assets              path to state file for assets
 //      alerts              path to state file for alerts
+//      workers             number of threads delivering emails, default 2
+//      aging               waiting email gets one priority higher after (seconds),
+//                          default 30, 0 disables it
+//      spool               directory for journal of undelivered emails, replayed
+//                          on start, emails are not spooled if not set
+//      retry_initial       delay before the first retry of transient failure (seconds), default 30
+//      retry_max_interval  max delay between retries (seconds), default 600
+//      retry_max_age       give up retries after (seconds), default 3600, 0 disables retries
+//      interfaces          comma separated interfaces, IPv4 address of the first of them
+//                          is put to emails, default "eth0, LAN1"
 //  smtp
-//      server              address of smtp server
-//      port                port number
+//      server              address of smtp server, or comma separated list of relays
+//                          host[:port][=weight] in order of preference, new email goes
+//                          to the relay with the best latency and failure rate (divided
+//                          by weight), connection failure fails over to other relay
+//      port                default port number
 //      user                name of user for login
 //      password            password of user
 //      from                From: header of email
 //      encryption          encryption, can be (none|tls|starttls)
 //      msmtppath           path to msmtp command
+//      msmtp_timeout       kill msmtp which did not finish in (seconds), error code 11, default 60
+//      transport           how to talk to smtp server, can be (msmtp|native), default msmtp
+//      pool_size           native transport: max number of idle connections kept open by each worker, default 2
+//      idle_timeout        native transport: close idle connection after (seconds), default 60
+//      attachment_cache    memory for attachments already encoded for email (MB), the same
+//                          file sent again is not encoded again, default 16, 0 disables it
+//      breaker_threshold   stop sending to unreachable server after this number of
+//                          consecutive failures, default 5, 0 disables it
+//      breaker_cooldown    try unreachable server again after (seconds), default 60
+//      digest_window       alert emails for one contact coming within (seconds) are
+//                          sent as one digest, P1 alerts are sent at once,
+//                          default 0 disables digests
+//      recipient_rate      max alert emails (and SMS) to one address per minute,
+//                          default 0 disables the limit
+//      recipient_burst     max alert emails to one address sent at once, default 1
+//      domain_rate         max alert emails (and SMS) to one domain per minute,
+//                          default 0 disables the limit
+//      domain_burst        max alert emails to one domain sent at once, default 1
+//                          emails over the limit wait, or are added to digest
+//                          if digest_window is set
+//      dedup_window        alert notification same as the last one (state and severity)
+//                          within (seconds) is not sent, default 0 disables it
+//      supersede           waiting ACTIVE alert email is replaced by newer RESOLVED one,
+//                          (merge) RESOLVED email mentions it, (drop) neither is sent,
+//                          default merge
 //      smsgateway          email to sms gateway
 //      verify_ca           1 turns on CA verification, 0 off
 //  malamute
@@ -59,6 +97,18 @@ extern "C" {
 //
 //  LOAD    path            load and apply configuration from zpl file
 //                          see Configuration format section
+//  STATS                   reply with [name|value|name|value|...] of queue
+//                          metrics lane.$lane.(depth|enqueued|dequeued|wait_avg|wait_max)
+//                          for lanes P1 .. P5 and bulk, wait times are in ms,
+//                          and queue.superseded, dedup.suppressed, digest.(alerts|emails)
+//                          counters, limit.(recipient|domain).$key.(tokens|allowed|deferred)
+//                          state of each rate limit bucket,
+//                          relay.$host:$port.(latency|failures|sent|failed) health of relays,
+//                          mime.(extensions|hits|misses) attachment types told by extension,
+//                          found in cache and sniffed by libmagic, parts.(hits|misses|evictions|bytes)
+//                          attachments reused, encoded and dropped and size of their cache,
+//                          translation.(hits|misses) alert descriptions found translated and translated,
+//                          render.(hits|misses) alert emails reused for another contact and rendered
 //
 //  Malamute protocol (mailbox agent-smtp)
 //  ======================================
@@ -78,6 +128,35 @@ extern "C" {
 //  REP: subject=SENDMAIL-ERR [$uuid|$error code|$error message]
 //      if email wasn't sent, or there was improper number of arguments
 //      error message comes from msmtp stderr and is NOT normalized!
+//      transient errors (server unreachable, DNS failure) are retried
+//      with growing delay, the error is sent once retries are given up
+//
+//  REQ: subject=SENDMAIL_BATCH
+//
+//      [$batch_uuid|$count1|<email1>|$count2|<email2>|...]
+//      sends several emails at once, <email> are $count frames of SENDMAIL
+//      request starting with its $uuid, see fty_email_batch_new and
+//      fty_email_batch_add to build such message
+//  REP: subject=SENDMAIL_BATCH-OK [$batch_uuid|$uuid1|$code1|$message1|$uuid2|...]
+//      once all emails are delivered (or given up), in the order of request,
+//      $code and $message are the same as in SENDMAIL-OK or SENDMAIL-ERR
+//  REP: subject=SENDMAIL_BATCH-ERR [$batch_uuid|$error code|$error message]
+//      if the request is malformed, no email is sent
+//      emails replayed from the spool after restart are answered one by one
+//      by SENDMAIL-OK or SENDMAIL-ERR
+//
+//  REQ: subject=SENDMAIL_ALERT, SENDSMS_ALERT
+//
+//      [$uuid|$priority|$extname|$contact|$alert:fty_proto|$language]
+//      sends alert notification to $contact, email address or phone number
+//      converted by smtp/gwtemplate, $extname is the name of the asset
+//      $language (e.g. en_US) is optional, server/language is used without it
+//  REP: subject=SENDMAIL_ALERT, SENDSMS_ALERT [$uuid|OK] or [$uuid|ERROR|$error message]
+//
+//      Requests are queued and delivered by server/workers threads, the reply
+//      is sent once the delivery is finished, so replies for several requests
+//      may come in different order. Alerts are delivered before SENDMAIL
+//      requests by their priority and one worker never takes SENDMAIL.
 //
 //  args:
 //      "sendmail-only"      : ignore consumer/ part, connect as $(malamute/address)-sendmail-only
@@ -105,6 +184,16 @@ FTY_EMAIL_EXPORT zmsg_t *
         const char *body,
         ...);
 
+//  create empty SENDMAIL_BATCH message
+//  uuid - uuid of the batch
+FTY_EMAIL_EXPORT zmsg_t *
+    fty_email_batch_new (const char *uuid);
+
+//  add email encoded by fty_email_encode to the batch, email is destroyed
+//  return 0 if OK, -1 if email is not valid
+FTY_EMAIL_EXPORT int
+    fty_email_batch_add (zmsg_t *batch, zmsg_t **email_p);
+
 //  @end
 
 #ifdef __cplusplus
@@ -57,6 +57,7 @@ BuildRequires:  czmq-devel >= 3.0.2
 BuildRequires:  malamute-devel >= 1.0.0
 BuildRequires:  cxxtools-devel
 BuildRequires:  file-devel
+BuildRequires:  openssl-devel
 BuildRequires:  fty-common-logging-devel
 BuildRequires:  fty-common-mlm-devel
 BuildRequires:  fty-common-translation-devel
@@ -90,6 +91,7 @@ Requires:       czmq-devel >= 3.0.2
 Requires:       malamute-devel >= 1.0.0
 Requires:       cxxtools-devel
 Requires:       file-devel
+Requires:       openssl-devel
 Requires:       fty-common-logging-devel
 Requires:       fty-common-mlm-devel
 Requires:       fty-common-translation-devel
@@ -29,16 +29,638 @@
 #include "fty_email_classes.h"
 
 #include <sstream>
+#include <algorithm>
 #include <fstream>
 #include <ctime>
 #include <stdio.h>
+#include <poll.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <spawn.h>
+#include <sys/wait.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <netinet/tcp.h>
+
+#include <openssl/err.h>
+#include <openssl/evp.h>
+#include <openssl/hmac.h>
+#include <openssl/x509v3.h>
 
 // to ensure POSIX basename!!!
 // DO NOT REMOVE otherwise GNU basename can be used
 #include <libgen.h>
 
 #include <cxxtools/regex.h>
-#include <cxxtools/mime.h>
+
+// timeout for network operations of native transport [ms]
+#define SMTP_NATIVE_TIMEOUT 60000
+// size of chunks written in DATA phase
+#define SMTP_DATA_CHUNK 65536
+// max number of msmtp configs (one for each relay) kept in memory
+#define MSMTP_CONFIG_CACHE 8
+// descriptor msmtp reads its configuration from
+#define MSMTP_CONFIG_FD 3
+
+// ----------------------------------------------------------------------------
+// SmtpSession
+
+static std::string
+s_base64_encode (const std::string& data)
+{
+    std::string ret;
+    ret.resize (4 * ((data.size () + 2) / 3) + 1);
+    int len = EVP_EncodeBlock (
+            (unsigned char*) &ret [0],
+            (const unsigned char*) data.c_str (),
+            data.size ());
+    ret.resize (len);
+    return ret;
+}
+
+static std::string
+s_base64_decode (const std::string& data)
+{
+    std::string ret;
+    ret.resize (3 * ((data.size () + 3) / 4) + 1);
+    int len = EVP_DecodeBlock (
+            (unsigned char*) &ret [0],
+            (const unsigned char*) data.c_str (),
+            data.size ());
+    if (len < 0)
+        return "";
+    // EVP_DecodeBlock does not strip the padding
+    size_t pad = 0;
+    for (auto it = data.rbegin (); it != data.rend () && *it == '='; ++it)
+        pad++;
+    ret.resize (len - std::min<size_t> (pad, len));
+    return ret;
+}
+
+static const char*
+s_certificate_error (long code)
+{
+    switch (code) {
+        case X509_V_ERR_UNABLE_TO_GET_ISSUER_CERT:
+        case X509_V_ERR_UNABLE_TO_GET_ISSUER_CERT_LOCALLY:
+        case X509_V_ERR_DEPTH_ZERO_SELF_SIGNED_CERT:
+        case X509_V_ERR_SELF_SIGNED_CERT_IN_CHAIN:
+        case X509_V_ERR_UNABLE_TO_VERIFY_LEAF_SIGNATURE:
+            return "the certificate hasn't got a known issuer";
+        case X509_V_ERR_CERT_REVOKED:
+            return "the certificate has been revoked";
+        case X509_V_ERR_HOSTNAME_MISMATCH:
+            return "the certificate owner does not match hostname";
+        default:
+            return "the certificate is not trusted";
+    }
+}
+
+SmtpSession::SmtpSession (
+        const std::string& host,
+        const std::string& port,
+        Encryption encryption,
+        bool verify_ca,
+        int timeout,
+        int cancel):
+    _host {host},
+    _port {port},
+    _encryption {encryption},
+    _verify_ca {verify_ca},
+    _timeout {timeout},
+    _cancel {cancel},
+    _fd {-1},
+    _ctx {NULL},
+    _ssl {NULL},
+    _rbuf {},
+    _auth {},
+    _starttls {false},
+    _pipelining {false},
+    _dirty {false},
+    _committed {false},
+    _bol {true},
+    _prev {'\0'}
+{
+}
+
+SmtpSession::~SmtpSession ()
+{
+    close ();
+    if (_ctx)
+        SSL_CTX_free (_ctx);
+}
+
+void SmtpSession::close ()
+{
+    if (_ssl) {
+        SSL_free (_ssl);
+        _ssl = NULL;
+    }
+    if (_fd != -1) {
+        ::close (_fd);
+        _fd = -1;
+    }
+    _rbuf.clear ();
+    _auth.clear ();
+    _starttls = false;
+    _pipelining = false;
+}
+
+// network errors leave the connection in unknown state, so close it
+void SmtpSession::fail (const std::string& message)
+{
+    close ();
+    throw std::runtime_error (message);
+}
+
+void SmtpSession::wait_io (short events)
+{
+    struct pollfd pfd [2] = {{_fd, events, 0}, {_cancel, POLLIN, 0}};
+    int r;
+    do {
+        r = ::poll (pfd, 2, _timeout);
+    } while (r == -1 && errno == EINTR);
+    if (r == 0)
+        fail ("smtp: network operation with " + _host + " timed out");
+    if (r == -1)
+        fail ("smtp: poll failed: " + std::string (strerror (errno)));
+    if (pfd [1].revents != 0)
+        fail ("smtp: delivery cancelled");
+}
+
+void SmtpSession::connect ()
+{
+    struct addrinfo hints;
+    memset (&hints, 0, sizeof (hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+
+    struct addrinfo *res = NULL;
+    int r = getaddrinfo (_host.c_str (), _port.c_str (), &hints, &res);
+    if (r != 0)
+        throw std::runtime_error ("smtp: cannot locate host " + _host + ": " + gai_strerror (r));
+
+    int err = 0;
+    for (struct addrinfo *ai = res; ai != NULL; ai = ai->ai_next) {
+        int fd = ::socket (ai->ai_family, ai->ai_socktype | SOCK_NONBLOCK | SOCK_CLOEXEC, ai->ai_protocol);
+        if (fd == -1) {
+            err = errno;
+            continue;
+        }
+        r = ::connect (fd, ai->ai_addr, ai->ai_addrlen);
+        if (r == -1 && errno == EINPROGRESS) {
+            struct pollfd pfd [2] = {{fd, POLLOUT, 0}, {_cancel, POLLIN, 0}};
+            do {
+                r = ::poll (pfd, 2, _timeout);
+            } while (r == -1 && errno == EINTR);
+            if (r > 0 && pfd [1].revents != 0) {
+                ::close (fd);
+                freeaddrinfo (res);
+                throw std::runtime_error ("smtp: delivery cancelled");
+            }
+            if (r > 0) {
+                socklen_t len = sizeof (err);
+                getsockopt (fd, SOL_SOCKET, SO_ERROR, &err, &len);
+                r = err == 0 ? 0 : -1;
+            }
+            else {
+                err = r == 0 ? ETIMEDOUT : errno;
+                r = -1;
+            }
+        }
+        else
+        if (r == -1)
+            err = errno;
+
+        if (r == 0) {
+            int one = 1;
+            setsockopt (fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof (one));
+            _fd = fd;
+            break;
+        }
+        ::close (fd);
+    }
+    freeaddrinfo (res);
+
+    if (_fd == -1)
+        throw std::runtime_error ("smtp: cannot connect to " + _host + ", port " + _port + ": " + strerror (err));
+}
+
+void SmtpSession::handshake ()
+{
+    if (!_ctx) {
+        _ctx = SSL_CTX_new (SSLv23_client_method ());
+        if (!_ctx)
+            throw std::runtime_error ("smtp: cannot create TLS context");
+        SSL_CTX_set_options (_ctx, SSL_OP_NO_SSLv2 | SSL_OP_NO_SSLv3);
+        if (_verify_ca) {
+            SSL_CTX_set_default_verify_paths (_ctx);
+            SSL_CTX_set_verify (_ctx, SSL_VERIFY_PEER, NULL);
+        }
+        else
+            SSL_CTX_set_verify (_ctx, SSL_VERIFY_NONE, NULL);
+    }
+
+    _ssl = SSL_new (_ctx);
+    if (!_ssl)
+        throw std::runtime_error ("smtp: cannot create TLS session");
+    SSL_set_fd (_ssl, _fd);
+    SSL_set_tlsext_host_name (_ssl, _host.c_str ());
+    if (_verify_ca)
+        X509_VERIFY_PARAM_set1_host (SSL_get0_param (_ssl), _host.c_str (), 0);
+
+    for (;;) {
+        ERR_clear_error ();
+        int r = SSL_connect (_ssl);
+        if (r == 1)
+            break;
+        int err = SSL_get_error (_ssl, r);
+        if (err == SSL_ERROR_WANT_READ)
+            wait_io (POLLIN);
+        else
+        if (err == SSL_ERROR_WANT_WRITE)
+            wait_io (POLLOUT);
+        else {
+            long verify = SSL_get_verify_result (_ssl);
+            if (_verify_ca && verify != X509_V_OK)
+                throw std::runtime_error (std::string ("smtp: TLS certificate verification failed: ") + s_certificate_error (verify));
+            char buf [256];
+            ERR_error_string_n (ERR_get_error (), buf, sizeof (buf));
+            throw std::runtime_error (std::string ("smtp: TLS handshake failed: ") + buf);
+        }
+    }
+}
+
+size_t SmtpSession::read_some (char *data, size_t size)
+{
+    for (;;) {
+        if (_ssl) {
+            ERR_clear_error ();
+            int r = SSL_read (_ssl, data, size);
+            if (r > 0)
+                return r;
+            int err = SSL_get_error (_ssl, r);
+            if (err == SSL_ERROR_WANT_READ)
+                wait_io (POLLIN);
+            else
+            if (err == SSL_ERROR_WANT_WRITE)
+                wait_io (POLLOUT);
+            else
+                fail ("smtp: network read error: connection closed by " + _host);
+            continue;
+        }
+
+        ssize_t r = ::recv (_fd, data, size, 0);
+        if (r > 0)
+            return r;
+        if (r == 0)
+            fail ("smtp: network read error: connection closed by " + _host);
+        if (errno == EAGAIN || errno == EWOULDBLOCK)
+            wait_io (POLLIN);
+        else
+        if (errno != EINTR)
+            fail ("smtp: network read error: " + std::string (strerror (errno)));
+    }
+}
+
+void SmtpSession::write_all (const char *data, size_t size)
+{
+    while (size > 0) {
+        if (_ssl) {
+            ERR_clear_error ();
+            int r = SSL_write (_ssl, data, size);
+            if (r > 0) {
+                data += r;
+                size -= r;
+                continue;
+            }
+            int err = SSL_get_error (_ssl, r);
+            if (err == SSL_ERROR_WANT_READ)
+                wait_io (POLLIN);
+            else
+            if (err == SSL_ERROR_WANT_WRITE)
+                wait_io (POLLOUT);
+            else
+                fail ("smtp: network write error: connection closed by " + _host);
+            continue;
+        }
+
+        ssize_t r = ::send (_fd, data, size, MSG_NOSIGNAL);
+        if (r >= 0) {
+            data += r;
+            size -= r;
+        }
+        else
+        if (errno == EAGAIN || errno == EWOULDBLOCK)
+            wait_io (POLLOUT);
+        else
+        if (errno != EINTR)
+            fail ("smtp: network write error: " + std::string (strerror (errno)));
+    }
+}
+
+// read (multiline) reply, return the code and the text without codes
+int SmtpSession::reply (std::string& text)
+{
+    text.clear ();
+    for (;;) {
+        size_t eol;
+        while ((eol = _rbuf.find ('\n')) == std::string::npos) {
+            char buf [4096];
+            size_t r = read_some (buf, sizeof (buf));
+            _rbuf.append (buf, r);
+        }
+        std::string line = _rbuf.substr (0, eol);
+        _rbuf.erase (0, eol + 1);
+        if (!line.empty () && line.back () == '\r')
+            line.pop_back ();
+
+        if (line.size () < 3
+        || !isdigit (line [0]) || !isdigit (line [1]) || !isdigit (line [2])
+        || (line.size () > 3 && line [3] != ' ' && line [3] != '-'))
+            fail ("smtp: invalid reply from " + _host + ": " + line);
+
+        if (!text.empty ())
+            text += "\n";
+        if (line.size () > 4)
+            text += line.substr (4);
+
+        if (line.size () == 3 || line [3] == ' ')
+            return std::stoi (line.substr (0, 3));
+    }
+}
+
+int SmtpSession::command (const std::string& line, std::string& text)
+{
+    std::string buf = line + "\r\n";
+    write_all (buf.c_str (), buf.size ());
+    return reply (text);
+}
+
+void SmtpSession::ehlo ()
+{
+    std::string text;
+    _auth.clear ();
+    _starttls = false;
+    _pipelining = false;
+
+    int code = command ("EHLO localhost", text);
+    if (code != 250) {
+        code = command ("HELO localhost", text);
+        if (code != 250)
+            throw std::runtime_error ("smtp: command HELO failed: " + text);
+        return;
+    }
+
+    std::istringstream lines {text};
+    std::string line;
+    while (std::getline (lines, line)) {
+        for (auto& ch : line)
+            ch = toupper (ch);
+        if (line == "STARTTLS")
+            _starttls = true;
+        else
+        if (line == "PIPELINING")
+            _pipelining = true;
+        else
+        if (line.compare (0, 5, "AUTH ") == 0 || line.compare (0, 5, "AUTH=") == 0) {
+            std::istringstream methods {line.substr (5)};
+            std::string method;
+            while (methods >> method)
+                _auth.insert (method);
+        }
+    }
+}
+
+void SmtpSession::authenticate (
+        const std::string& username,
+        const std::string& password)
+{
+    std::string text;
+    if (_auth.empty ())
+        throw std::runtime_error ("smtp: the server does not support authentication");
+
+    // like msmtp, send the password in clear text only over TLS
+    bool secure = _ssl != NULL;
+    if (secure && _auth.count ("PLAIN")) {
+        std::string token = std::string (1, '\0') + username + std::string (1, '\0') + password;
+        if (command ("AUTH PLAIN " + s_base64_encode (token), text) != 235)
+            throw std::runtime_error ("smtp: authentication failed (method PLAIN): " + text);
+    }
+    else
+    if (secure && _auth.count ("LOGIN")) {
+        if (command ("AUTH LOGIN", text) != 334
+        ||  command (s_base64_encode (username), text) != 334
+        ||  command (s_base64_encode (password), text) != 235)
+            throw std::runtime_error ("smtp: authentication failed (method LOGIN): " + text);
+    }
+    else
+    if (_auth.count ("CRAM-MD5")) {
+        if (command ("AUTH CRAM-MD5", text) != 334)
+            throw std::runtime_error ("smtp: authentication failed (method CRAM-MD5): " + text);
+        std::string challenge = s_base64_decode (text);
+        unsigned char digest [EVP_MAX_MD_SIZE];
+        unsigned int digest_len = 0;
+        HMAC (EVP_md5 (),
+              password.c_str (), password.size (),
+              (const unsigned char*) challenge.c_str (), challenge.size (),
+              digest, &digest_len);
+        std::string response = username + " ";
+        for (unsigned int i = 0; i != digest_len; i++) {
+            char hex [3];
+            snprintf (hex, sizeof (hex), "%02x", digest [i]);
+            response += hex;
+        }
+        if (command (s_base64_encode (response), text) != 235)
+            throw std::runtime_error ("smtp: authentication failed (method CRAM-MD5): " + text);
+    }
+    else
+    if (_auth.count ("PLAIN") || _auth.count ("LOGIN"))
+        throw std::runtime_error ("smtp: cannot use a secure authentication method");
+    else
+        throw std::runtime_error ("smtp: cannot find a usable authentication method");
+}
+
+void SmtpSession::open (
+        const std::string& username,
+        const std::string& password)
+{
+    std::string text;
+    close ();
+    connect ();
+
+    if (_encryption == Encryption::TLS)
+        handshake ();
+
+    if (reply (text) != 220)
+        throw std::runtime_error ("smtp: cannot get initial OK message from server: " + text);
+    ehlo ();
+
+    if (_encryption == Encryption::STARTTLS) {
+        if (!_starttls)
+            throw std::runtime_error ("smtp: the server does not support TLS via the STARTTLS command");
+        if (command ("STARTTLS", text) != 220)
+            throw std::runtime_error ("smtp: command STARTTLS failed: " + text);
+        // anything read past the reply was not protected by TLS (CVE-2011-0411)
+        if (!_rbuf.empty ())
+            throw std::runtime_error ("smtp: command STARTTLS failed: server sent data before TLS handshake");
+        _rbuf.clear ();
+        handshake ();
+        ehlo ();
+    }
+
+    if (!username.empty ())
+        authenticate (username, password);
+}
+
+// convert line endings to CRLF and dot-stuff the lines
+void SmtpSession::write_data (const char *data, size_t size)
+{
+    std::string chunk;
+    chunk.reserve (std::min (size, static_cast <size_t> (SMTP_DATA_CHUNK)) + 8);
+    for (const char *end = data + size; data != end; data++) {
+        const char ch = *data;
+        if (_bol && ch == '.')
+            chunk.push_back ('.');
+        if (ch == '\n' && _prev != '\r')
+            chunk.push_back ('\r');
+        chunk.push_back (ch);
+        _bol = ch == '\n';
+        _prev = ch;
+        if (chunk.size () >= SMTP_DATA_CHUNK) {
+            write_all (chunk.c_str (), chunk.size ());
+            chunk.clear ();
+        }
+    }
+    if (!chunk.empty ())
+        write_all (chunk.c_str (), chunk.size ());
+}
+
+void SmtpSession::send (
+        const std::string& from,
+        const std::vector<std::string>& recipients,
+        const std::string& data,
+        std::vector<SmtpRecipientStatus> *statuses)
+{
+    begin (from, recipients, statuses);
+    write_data (data.data (), data.size ());
+    end ();
+}
+
+void SmtpSession::begin (
+        const std::string& from,
+        const std::vector<std::string>& recipients,
+        std::vector<SmtpRecipientStatus> *statuses)
+{
+    std::string text;
+    _dirty = true;
+    _committed = false;
+
+    // with PIPELINING, MAIL and all RCPTs go in one write
+    std::string buf = "MAIL FROM:<" + from + ">\r\n";
+    if (_pipelining) {
+        for (const auto& rcpt : recipients)
+            buf += "RCPT TO:<" + rcpt + ">\r\n";
+    }
+    write_all (buf.c_str (), buf.size ());
+
+    if (reply (text) != 250) {
+        if (_pipelining) {
+            std::string ignore;
+            for (size_t i = 0; i != recipients.size (); i++)
+                reply (ignore);
+        }
+        throw std::runtime_error ("smtp: envelope from address " + from + " not accepted by the server: " + text);
+    }
+
+    size_t accepted = 0;
+    std::string rejected;
+    std::string rejected_text;
+    for (const auto& rcpt : recipients) {
+        int code = _pipelining ? reply (text) : command ("RCPT TO:<" + rcpt + ">", text);
+        bool ok = code == 250 || code == 251;
+        if (statuses)
+            statuses->push_back (SmtpRecipientStatus {rcpt, ok, code, text});
+        if (ok)
+            accepted++;
+        else
+        if (rejected.empty ()) {
+            rejected = rcpt;
+            rejected_text = text;
+        }
+    }
+
+    if (!statuses && !rejected.empty ())
+        throw std::runtime_error ("smtp: recipient address " + rejected + " not accepted by the server: " + rejected_text);
+    if (accepted == 0)
+        throw std::runtime_error ("smtp: no recipient address accepted by the server: " + rejected_text);
+
+    if (command ("DATA", text) != 354)
+        throw std::runtime_error ("smtp: the server did not accept the mail: " + text);
+    _bol = true;
+    _prev = '\0';
+}
+
+void SmtpSession::end ()
+{
+    std::string text;
+    std::string chunk = _bol ? ".\r\n" : "\r\n.\r\n";
+    write_all (chunk.c_str (), chunk.size ());
+    _committed = true;
+    if (reply (text) != 250)
+        throw std::runtime_error ("smtp: the server did not accept the mail: " + text);
+    _dirty = false;
+}
+
+bool SmtpSession::reset ()
+{
+    if (_fd == -1)
+        return false;
+
+    // idle connection should not be readable, server closed it or sent 421
+    // TLS layer can still have something to say, so let RSET to find out
+    struct pollfd pfd = {_fd, POLLIN, 0};
+    if (::poll (&pfd, 1, 0) != 0 || !_rbuf.empty ()) {
+        if (!_ssl) {
+            close ();
+            return false;
+        }
+        _dirty = true;
+    }
+
+    if (!_dirty)
+        return true;
+
+    try {
+        std::string text;
+        if (command ("RSET", text) == 250) {
+            _dirty = false;
+            return true;
+        }
+    }
+    catch (const std::runtime_error &e) {
+        log_debug ("smtp: RSET failed: %s", e.what ());
+    }
+    close ();
+    return false;
+}
+
+void SmtpSession::quit ()
+{
+    if (_fd == -1)
+        return;
+    try {
+        std::string text;
+        command ("QUIT", text);
+    }
+    catch (const std::runtime_error &e) {
+        log_debug ("smtp: QUIT failed: %s", e.what ());
+    }
+    close ();
+}
+
+// ----------------------------------------------------------------------------
+// Smtp
 
 Smtp::Smtp():
     _host {},
@@ -48,8 +670,53 @@ Smtp::Smtp():
     _username {},
     _password {},
     _msmtp { "/usr/bin/msmtp" },
+    _msmtp_timeout {60},
+    _cancel {-1},
     _has_fn {false},
-    _verify_ca {false}
+    _verify_ca {false},
+    _transport {Transport::MSMTP},
+    _pool_size {2},
+    _idle_timeout {60},
+    _pool_mutex {},
+    _pool {},
+    _config_mutex {},
+    _config_fds {},
+    _types {std::make_shared<EmailMagic> ()},
+    _parts {std::make_shared<EmailParts> ()}
+{
+    _magic = magic_open (MAGIC_MIME | MAGIC_ERROR | MAGIC_NO_CHECK_COMPRESS | MAGIC_NO_CHECK_TAR);
+    if (!_magic)
+        throw std::runtime_error ("Cannot open magic_cookie");
+
+    int r = magic_load (_magic, NULL);
+    if (r == -1) {
+        magic_close (_magic);
+        throw std::runtime_error ("Cannot load magic database");
+    }
+}
+
+Smtp::Smtp (const Smtp& other):
+    _host {other._host},
+    _port {other._port},
+    _from {other._from},
+    _encryption {other._encryption},
+    _username {other._username},
+    _password {other._password},
+    _msmtp {other._msmtp},
+    _msmtp_timeout {other._msmtp_timeout},
+    _cancel {-1},
+    _has_fn {other._has_fn},
+    _verify_ca {other._verify_ca},
+    _transport {other._transport},
+    _pool_size {other._pool_size},
+    _idle_timeout {other._idle_timeout},
+    _pool_mutex {},
+    _pool {},
+    _config_mutex {},
+    _config_fds {},
+    _fn {other._fn},
+    _types {other._types},
+    _parts {other._parts}
 {
     _magic = magic_open (MAGIC_MIME | MAGIC_ERROR | MAGIC_NO_CHECK_COMPRESS | MAGIC_NO_CHECK_TAR);
     if (!_magic)
@@ -65,12 +732,12 @@ Smtp::Smtp():
 Smtp::~Smtp ()
 {
     magic_close (_magic);
+    for (const auto& it : _config_fds)
+        close (it.second);
 }
 
-std::string Smtp::createConfigFile() const
+std::string Smtp::msmtp_config () const
 {
-    char filename[] = "/tmp/bios-msmtp-XXXXXX.cfg";
-    int handle = mkstemps(filename,4);
     std::string line;
 
     line = "defaults\n";
@@ -83,11 +750,12 @@ std::string Smtp::createConfigFile() const
         break;
     case Encryption::TLS:
         line += "tls on\n"
-                "tls_certcheck " + verify_ca + "\n";
+                "tls_certcheck " + verify_ca + "\n"
+                "tls_starttls off\n";
         break;
     case Encryption::STARTTLS:
-        // TODO: check if this is correct!
-        line += "tls off\n"
+        // msmtp ignores tls_starttls unless tls is on
+        line += "tls on\n"
                 "tls_certcheck " + verify_ca + "\n"
                 "tls_starttls on\n";
         break;
@@ -104,6 +772,48 @@ std::string Smtp::createConfigFile() const
     line += "host " + _host +"\n";
     line += "port " + _port +"\n";
     line += "from " + _from + "\n";
+    return line;
+}
+
+int Smtp::msmtp_config_fd () const
+{
+#ifdef MFD_CLOEXEC
+    std::string config = msmtp_config ();
+    std::lock_guard<std::mutex> lock (_config_mutex);
+    auto it = _config_fds.find (config);
+    if (it == _config_fds.end ()) {
+        // settings changed, configs of other relays are kept
+        if (_config_fds.size () >= MSMTP_CONFIG_CACHE) {
+            for (const auto& old : _config_fds)
+                close (old.second);
+            _config_fds.clear ();
+        }
+        // it holds the password, msmtp gets only its own config by s_spawn
+        int fd = memfd_create ("msmtp-config", MFD_CLOEXEC);
+        if (fd == -1) {
+            log_warning ("memfd_create failed: %s, using temporary file for msmtp config", strerror (errno));
+            return -1;
+        }
+        // msmtp refuses config readable by others
+        if (fchmod (fd, 0600) == -1
+        ||  write (fd, config.c_str (), config.size ()) != static_cast <ssize_t> (config.size ())) {
+            log_warning ("writing msmtp config to memfd failed: %s", strerror (errno));
+            close (fd);
+            return -1;
+        }
+        it = _config_fds.insert (std::make_pair (config, fd)).first;
+    }
+    return it->second;
+#else
+    return -1;
+#endif
+}
+
+std::string Smtp::createConfigFile() const
+{
+    char filename[] = "/tmp/bios-msmtp-XXXXXX.cfg";
+    int handle = mkstemps(filename,4);
+    std::string line = msmtp_config ();
     ssize_t r = write (handle,  line.c_str(), line.size());
     if (r > 0 && (size_t) r != line.size ())
         log_error ("write to %s was truncated, expected %zu, written %zd", filename, line.size(), r);
@@ -118,39 +828,98 @@ void Smtp::deleteConfigFile(std::string &filename) const
     unlink (filename.c_str());
 }
 
+std::string Smtp::address () const
+{
+    if (_host.find (':') != std::string::npos)
+        return "[" + _host + "]:" + _port;
+    return _host + ":" + _port;
+}
+
+void Smtp::address (const std::string& address)
+{
+    std::string host;
+    std::string port;
+    if (!smtp_split_address (address, _port, host, port)) {
+        log_warning ("smtp: invalid server address %s, IPv6 address must be in brackets", address.c_str ());
+        return;
+    }
+    _host = host;
+    _port = port;
+}
+
 void Smtp::encryption(std::string enc)
 {
     if( strcasecmp ("starttls", enc.c_str()) == 0) encryption (Encryption::STARTTLS);
-    if( strcasecmp ("tls", enc.c_str()) == 0) encryption (Encryption::TLS);
-    encryption (Encryption::NONE);
+    else if( strcasecmp ("tls", enc.c_str()) == 0) encryption (Encryption::TLS);
+    else encryption (Encryption::NONE);
 }
 
-void Smtp::sendmail(
+void Smtp::transport (const std::string& name)
+{
+    if (strcasecmp ("native", name.c_str ()) == 0)
+        transport (Transport::NATIVE);
+    else
+        transport (Transport::MSMTP);
+}
+
+std::vector<SmtpRecipientStatus>
+Smtp::sendmail(
         const std::vector<std::string> &to,
         const std::string& subject,
         const std::string& body) const
 {
+    std::vector<SmtpRecipientStatus> statuses;
+    if (to.empty ())
+        return statuses;
+
+    if (_transport == Transport::NATIVE && !_has_fn && _host.empty ()) {
+        for (const auto& it : to)
+            statuses.push_back (SmtpRecipientStatus {it, false, 0, "smtp: no server configured"});
+        return statuses;
+    }
 
+    // contacts must not see each other, native transport gets them in the
+    // envelope, msmtp from Bcc: which it removes
+    bool native = _transport == Transport::NATIVE && !_has_fn;
+    std::string bcc;
     for (const auto& it : to)
-    {
-        zuuid_t *uuid = zuuid_new ();
-        zmsg_t *msg = fty_email_encode (
-            zuuid_str_canonical (uuid),
-            it.c_str (),
-            subject.c_str (),
-            NULL,
-            body.c_str (),
-            NULL
-        );
-        zuuid_destroy (&uuid);
-
-        // MVY: this is weird, horrible, ugly and hard to use.
-        //      Need to rething API for smtp_encode
-        //      BUT .. NEVER pass message with first uuid frame to msg2email
-        //      or BAD things will happen
-        char* cuuid = zmsg_popstr (msg); zstr_free (&cuuid);
-        sendmail (msg2email (&msg));
+        bcc += bcc.empty () ? it : ", " + it;
+    zhash_t *headers = zhash_new ();
+    if (to.size () > 1 && !native)
+        zhash_update (headers, "Bcc", (void*) bcc.c_str ());
+
+    zuuid_t *uuid = zuuid_new ();
+    zmsg_t *msg = fty_email_encode (
+        zuuid_str_canonical (uuid),
+        to.size () == 1 ? to [0].c_str () : "undisclosed-recipients:;",
+        subject.c_str (),
+        headers,
+        body.c_str (),
+        NULL
+    );
+    zuuid_destroy (&uuid);
+    zhash_destroy (&headers);
+
+    // MVY: this is weird, horrible, ugly and hard to use.
+    //      Need to rething API for smtp_encode
+    //      BUT .. NEVER pass message with first uuid frame to msg2email
+    //      or BAD things will happen
+    char* cuuid = zmsg_popstr (msg); zstr_free (&cuuid);
+    std::string data = msg2email (&msg);
+
+    if (native) {
+        sendmail_native ([&data] (const EmailMime::Sink& sink) {
+            sink (data.data (), data.size ());
+        }, &to, &statuses);
+        return statuses;
     }
+
+    // msmtp reads recipients from the headers and fails for all of them,
+    // its replies for single recipients are not known
+    sendmail (data);
+    for (const auto& it : to)
+        statuses.push_back (SmtpRecipientStatus {it, true, 0, "msmtp: per-recipient status unavailable"});
+    return statuses;
 }
 
 void Smtp::sendmail(
@@ -160,9 +929,239 @@ void Smtp::sendmail(
 {
     std::vector<std::string> recip;
     recip.push_back(to);
-    return sendmail(recip, subject, body);
+    sendmail(recip, subject, body);
+}
+
+
+// child process with pipes to its stdin, stdout and stderr
+struct SpawnedProcess {
+    pid_t pid;
+    int fds [3];
+};
+
+// start the process by posix_spawn, glibc does it by clone (CLONE_VM |
+// CLONE_VFORK), so unlike fork the cost does not grow with memory of the
+// daemon (libmagic, translations, ...)
+// config_fd, if not -1, is passed to the child as MSMTP_CONFIG_FD, all
+// other descriptors are expected to be O_CLOEXEC
+// returns 0 or errno
+static int
+s_spawn (
+        const std::vector<std::string>& argv,
+        SpawnedProcess& proc,
+        int config_fd = -1)
+{
+    // other threads spawn too, their children must not get our pipes
+    int pipes [3][2];
+    for (int i = 0; i != 3; i++) {
+        if (pipe2 (pipes [i], O_CLOEXEC) == -1) {
+            int err = errno;
+            for (int j = 0; j != i; j++) {
+                ::close (pipes [j][0]);
+                ::close (pipes [j][1]);
+            }
+            return err;
+        }
+    }
+
+    posix_spawn_file_actions_t actions;
+    posix_spawn_file_actions_init (&actions);
+    posix_spawn_file_actions_adddup2 (&actions, pipes [0][0], STDIN_FILENO);
+    posix_spawn_file_actions_adddup2 (&actions, pipes [1][1], STDOUT_FILENO);
+    posix_spawn_file_actions_adddup2 (&actions, pipes [2][1], STDERR_FILENO);
+    // dup2 clears FD_CLOEXEC, glibc does it also if config_fd is already MSMTP_CONFIG_FD
+    if (config_fd != -1)
+        posix_spawn_file_actions_adddup2 (&actions, config_fd, MSMTP_CONFIG_FD);
+
+    // child starts with default signal handlers and nothing blocked
+    posix_spawnattr_t attr;
+    posix_spawnattr_init (&attr);
+    sigset_t none, all;
+    sigemptyset (&none);
+    sigfillset (&all);
+    posix_spawnattr_setsigmask (&attr, &none);
+    posix_spawnattr_setsigdefault (&attr, &all);
+    posix_spawnattr_setflags (&attr, POSIX_SPAWN_SETSIGMASK | POSIX_SPAWN_SETSIGDEF);
+
+    std::vector<char*> args;
+    for (const auto& arg : argv)
+        args.push_back (const_cast <char*> (arg.c_str ()));
+    args.push_back (NULL);
+
+    int r = posix_spawn (&proc.pid, args [0], &actions, &attr, args.data (), environ);
+    posix_spawn_file_actions_destroy (&actions);
+    posix_spawnattr_destroy (&attr);
+
+    ::close (pipes [0][0]);
+    ::close (pipes [1][1]);
+    ::close (pipes [2][1]);
+    if (r != 0) {
+        ::close (pipes [0][1]);
+        ::close (pipes [1][0]);
+        ::close (pipes [2][0]);
+        return r;
+    }
+    proc.fds [0] = pipes [0][1];
+    proc.fds [1] = pipes [1][0];
+    proc.fds [2] = pipes [2][0];
+    return 0;
+}
+
+// close pipes still open and wait for the process
+// returns exit code, or 128 + signal number if it was killed
+static int
+s_wait (SpawnedProcess& proc)
+{
+    for (auto& fd : proc.fds) {
+        if (fd != -1)
+            ::close (fd);
+        fd = -1;
+    }
+    int status = 0;
+    while (waitpid (proc.pid, &status, 0) == -1 && errno == EINTR)
+        ;
+    if (WIFSIGNALED (status))
+        return 128 + WTERMSIG (status);
+    return WEXITSTATUS (status);
+}
+
+// feeds stdin of the process in chunks while reading its stdout and stderr,
+// so it never blocks on full pipe, closed pipes are set to -1
+class ProcessFeed
+{
+    public:
+        // cancel is readable when feeding should be aborted, or -1
+        ProcessFeed (int fds [3], int64_t deadline, int cancel = -1);
+        ~ProcessFeed ();
+
+        // returns false on timeout or cancel, data are dropped when process closed stdin
+        bool write (const char *data, size_t size);
+        // close stdin, returns false if outputs were not closed before deadline
+        bool close ();
+
+        const std::string& errors () const { return _errors; };
+        bool cancelled () const { return _cancelled; };
+
+    protected:
+        bool poll (const char *data, size_t size, size_t& written);
+
+        int *_fds;
+        int64_t _deadline;
+        int _cancel;
+        bool _cancelled;
+        size_t _written;
+        std::string _errors;
+        sigset_t _sigpipe;
+        sigset_t _old_mask;
+
+    private:
+        ProcessFeed (const ProcessFeed&) = delete;
+        ProcessFeed& operator= (const ProcessFeed&) = delete;
+};
+
+ProcessFeed::ProcessFeed (int fds [3], int64_t deadline, int cancel):
+    _fds {fds},
+    _deadline {deadline},
+    _cancel {cancel},
+    _cancelled {false},
+    _written {0},
+    _errors {}
+{
+    for (int i = 0; i != 3; i++)
+        fcntl (_fds [i], F_SETFL, fcntl (_fds [i], F_GETFL) | O_NONBLOCK);
+
+    // closed pipe means EPIPE instead of signal killing us
+    sigemptyset (&_sigpipe);
+    sigaddset (&_sigpipe, SIGPIPE);
+    pthread_sigmask (SIG_BLOCK, &_sigpipe, &_old_mask);
+}
+
+ProcessFeed::~ProcessFeed ()
+{
+    pthread_sigmask (SIG_SETMASK, &_old_mask, NULL);
+}
+
+bool
+ProcessFeed::poll (const char *data, size_t size, size_t& written)
+{
+    int64_t timeout = _deadline - zclock_mono ();
+    struct pollfd pfd [4] = {
+        {written < size ? _fds [0] : -1, POLLOUT, 0},
+        {_fds [1], POLLIN, 0},
+        {_fds [2], POLLIN, 0},
+        {_cancel, POLLIN, 0}};
+    int r = timeout > 0 ? ::poll (pfd, 4, timeout) : 0;
+    if (r == -1 && errno == EINTR)
+        return true;
+    if (r <= 0) {
+        if (r == -1)
+            log_error ("poll on msmtp pipes failed: %s", strerror (errno));
+        return false;
+    }
+    if (pfd [3].revents != 0) {
+        _cancelled = true;
+        return false;
+    }
+
+    if (pfd [0].revents & (POLLOUT | POLLERR | POLLHUP)) {
+        size_t chunk = std::min (size - written, static_cast <size_t> (SMTP_DATA_CHUNK));
+        ssize_t n = ::write (_fds [0], data + written, chunk);
+        if (n > 0) {
+            written += n;
+            _written += n;
+        }
+        else
+        if (n == -1 && errno != EAGAIN && errno != EINTR) {
+            // msmtp exited, its exit code and stderr tell why
+            log_warning ("Email truncated after '%zu' bytes: %s", _written, strerror (errno));
+            if (errno == EPIPE) {
+                struct timespec zero = {0, 0};
+                sigtimedwait (&_sigpipe, NULL, &zero);
+            }
+            ::close (_fds [0]);
+            _fds [0] = -1;
+        }
+    }
+    char buf [4096];
+    for (int i = 1; i != 3; i++) {
+        if (!(pfd [i].revents & (POLLIN | POLLERR | POLLHUP)))
+            continue;
+        ssize_t n = ::read (_fds [i], buf, sizeof (buf));
+        if (n > 0 && i == 2)
+            _errors.append (buf, n);
+        if (n == 0 || (n == -1 && errno != EAGAIN && errno != EINTR)) {
+            ::close (_fds [i]);
+            _fds [i] = -1;
+        }
+    }
+    return true;
+}
+
+bool
+ProcessFeed::write (const char *data, size_t size)
+{
+    size_t written = 0;
+    while (written < size && _fds [0] != -1) {
+        if (!poll (data, size, written))
+            return false;
+    }
+    return true;
 }
 
+bool
+ProcessFeed::close ()
+{
+    if (_fds [0] != -1) {
+        ::close (_fds [0]); //EOF
+        _fds [0] = -1;
+    }
+    size_t written = 0;
+    while (_fds [1] != -1 || _fds [2] != -1) {
+        if (!poll (NULL, 0, written))
+            return false;
+    }
+    return true;
+}
 
 void Smtp::sendmail(
         const std::string& data)    const
@@ -174,63 +1173,252 @@ void Smtp::sendmail(
         return;
     }
 
-    std::string cfg = createConfigFile();
-    if (_host.empty()) {
+    if (_host.empty ())
+        return;
+
+    Render render = [&data] (const EmailMime::Sink& sink) {
+        sink (data.data (), data.size ());
+    };
+    if (_transport == Transport::NATIVE)
+        sendmail_native (render, NULL, NULL);
+    else
+        sendmail_msmtp (render);
+}
+
+void Smtp::sendmail (zmsg_t **msg_p) const
+{
+    assert (msg_p && *msg_p);
+
+    // for testing
+    if (_has_fn) {
+        _fn (msg2email (msg_p));
         return;
     }
-    MlmSubprocess::Argv argv = { _msmtp, "-t", "-C", cfg };
-    MlmSubprocess::SubProcess proc{argv, MlmSubprocess::SubProcess::STDIN_PIPE |
-            MlmSubprocess::SubProcess::STDOUT_PIPE |
-            MlmSubprocess::SubProcess::STDERR_PIPE};
 
-    bool bret = proc.run();
-    if (!bret) {
-        throw std::runtime_error( \
-                _msmtp + " failed with exit code '" + \
-                std::to_string(proc.getReturnCode()) + "'\nstderr:\n" + \
-                MlmSubprocess::read_all(proc.getStderr()));
+    if (_host.empty ()) {
+        zmsg_destroy (msg_p);
+        return;
     }
 
-    ssize_t wr = ::write(proc.getStdin(), data.c_str(), data.size());
-    if (wr != static_cast<ssize_t>(data.size())) {
-        log_warning("Email truncated, exp '%zu', piped '%zd'", data.size(), wr);
+    // conversion consumes the message, so each attempt converts a copy
+    zmsg_t *msg = *msg_p;
+    *msg_p = NULL;
+    Render render = [this, msg] (const EmailMime::Sink& sink) {
+        zmsg_t *copy = zmsg_dup (msg);
+        msg2email (&copy, sink);
+    };
+    try {
+        if (_transport == Transport::NATIVE)
+            sendmail_native (render, NULL, NULL);
+        else
+            sendmail_msmtp (render);
+    }
+    catch (...) {
+        zmsg_destroy (&msg);
+        throw;
     }
-    ::close(proc.getStdin()); //EOF
+    zmsg_destroy (&msg);
+}
 
-    int ret = proc.wait();
-    deleteConfigFile (cfg);
-    if ( ret != 0 ) {
-        throw std::runtime_error( \
-                _msmtp + " wait with exit code '" + \
-                std::to_string(proc.getReturnCode()) + "'\nstderr:\n" + \
-                MlmSubprocess::read_all(proc.getStderr()));
+void Smtp::sendmail_msmtp (const Render& render) const
+{
+    int config_fd = msmtp_config_fd ();
+    bool temporary = config_fd == -1;
+    std::string cfg = temporary ? createConfigFile () : "/dev/fd/" + std::to_string (MSMTP_CONFIG_FD);
+    SpawnedProcess proc;
+    int r = s_spawn ({ _msmtp, "-t", "-C", cfg }, proc, config_fd);
+    if (r != 0) {
+        if (temporary)
+            deleteConfigFile (cfg);
+        throw std::runtime_error (_msmtp + " failed to start: " + strerror (r));
     }
 
-    ret = proc.getReturnCode();
+    int64_t timeout = static_cast <int64_t> (_msmtp_timeout) * 1000;
+    ProcessFeed feed {proc.fds, zclock_mono () + timeout, _cancel};
+    auto timed_out = [&] () {
+        if (feed.cancelled ())
+            return std::runtime_error (_msmtp + " delivery cancelled, killed");
+        return std::runtime_error( \
+                _msmtp + " timed out after " + std::to_string (timeout) + " ms, killed\nstderr:\n" + \
+                feed.errors ());
+    };
+    try {
+        render ([&] (const char *data, size_t size) {
+            if (!feed.write (data, size))
+                throw timed_out ();
+        });
+        if (!feed.close ())
+            throw timed_out ();
+    }
+    catch (...) {
+        kill (proc.pid, SIGKILL);
+        s_wait (proc);
+        if (temporary)
+            deleteConfigFile (cfg);
+        throw;
+    }
+
+    int ret = s_wait (proc);
+    if (temporary)
+        deleteConfigFile (cfg);
     if (ret != 0) {
         throw std::runtime_error( \
                 _msmtp + " failed with exit code '" + \
-                std::to_string(proc.getReturnCode()) + "'\nstderr:\n" + \
-                MlmSubprocess::read_all(proc.getStderr()));
+                std::to_string(ret) + "'\nstderr:\n" + \
+                feed.errors ());
     }
+}
 
+void Smtp::sendmail_native (
+        const Render& render,
+        const std::vector<std::string> *recipients,
+        std::vector<SmtpRecipientStatus> *statuses) const
+{
+    if (recipients && recipients->empty ())
+        throw std::runtime_error ("smtp: no recipients found");
+
+    for (int attempt = 0; ; attempt++) {
+        bool reused = false;
+        std::unique_ptr<SmtpSession> session = acquire_session (reused);
+        // DATA started and not finished, session can't be reused
+        bool in_data = false;
+        try {
+            if (statuses)
+                statuses->clear ();
+            bool started = false;
+            render ([&] (const char *data, size_t size) {
+                if (started) {
+                    session->write_data (data, size);
+                    return;
+                }
+                started = true;
+                if (recipients) {
+                    session->begin (_from, *recipients, statuses);
+                    in_data = true;
+                    session->write_data (data, size);
+                    return;
+                }
+                // headers come first in one piece
+                std::string stripped;
+                std::vector<std::string> found = smtp_recipients (std::string (data, size), &stripped);
+                if (found.empty ())
+                    throw std::runtime_error ("smtp: no recipients found");
+                session->begin (_from, found, statuses);
+                in_data = true;
+                session->write_data (stripped.data (), stripped.size ());
+            });
+            if (!started)
+                throw std::runtime_error ("smtp: no recipients found");
+            in_data = false;
+            session->end ();
+            release_session (std::move (session));
+            return;
+        }
+        catch (const std::runtime_error &e) {
+            // pooled connection might be dropped by server meanwhile, try
+            // once more with a new one unless the email might be delivered
+            bool retry = attempt == 0 && reused && !session->is_open () && !session->committed ();
+            // rendering failed in the middle of the message
+            if (in_data)
+                session->close ();
+            release_session (std::move (session));
+            if (!retry)
+                throw;
+            log_debug ("smtp: reused connection failed (%s), opening new one", e.what ());
+        }
+    }
+}
+
+std::string Smtp::session_config () const
+{
+    return std::to_string (static_cast<int> (_encryption)) + (_verify_ca ? "1" : "0") + "\n"
+        + _username + "\n" + _password;
 }
 
-static bool
-s_is_text (const char* mime)
+std::unique_ptr<SmtpSession>
+Smtp::acquire_session (bool& reused) const
 {
-    assert (mime);
-    return !strncmp (mime, "text", 4);
+    std::unique_ptr<SmtpSession> session;
+    std::string relay = address ();
+    std::string config = session_config ();
+
+    expire_sessions ();
+    {
+        std::lock_guard<std::mutex> lock (_pool_mutex);
+        for (auto it = _pool.begin (); it != _pool.end (); ++it) {
+            if (it->relay == relay && it->config == config) {
+                session = std::move (it->session);
+                _pool.erase (it);
+                break;
+            }
+        }
+    }
+
+    reused = session && session->reset ();
+    if (reused)
+        return session;
+
+    session.reset (new SmtpSession {_host, _port, _encryption, _verify_ca, SMTP_NATIVE_TIMEOUT, _cancel});
+    session->open (_username, _password);
+    return session;
+}
+
+void Smtp::release_session (std::unique_ptr<SmtpSession> session) const
+{
+    if (!session->is_open ())
+        return;
+    {
+        // each relay has its own pool_size sessions
+        std::string relay = address ();
+        std::lock_guard<std::mutex> lock (_pool_mutex);
+        size_t pooled = std::count_if (_pool.begin (), _pool.end (),
+                [&relay] (const PooledSession& it) { return it.relay == relay; });
+        if (pooled < _pool_size) {
+            _pool.push_front (PooledSession {std::move (session), relay, session_config (), zclock_mono ()});
+            return;
+        }
+    }
+    session->quit ();
+}
+
+void Smtp::expire_sessions () const
+{
+    // sessions with old credentials or TLS settings are expired too, so
+    // LOAD rebuilds the pool, sessions of other relays are kept as workers
+    // switch between them
+    std::string config = session_config ();
+    int64_t now = zclock_mono ();
+    std::list<PooledSession> expired;
+    {
+        std::lock_guard<std::mutex> lock (_pool_mutex);
+        for (auto it = _pool.begin (); it != _pool.end (); ) {
+            auto next = std::next (it);
+            if (it->config != config || now - it->last_used >= _idle_timeout * 1000)
+                expired.splice (expired.end (), _pool, it);
+            it = next;
+        }
+    }
+    for (auto& it : expired)
+        it.session->quit ();
 }
 
 std::string
 Smtp::msg2email (zmsg_t **msg_p) const
+{
+    std::string email;
+    msg2email (msg_p, [&email] (const char *data, size_t size) {
+        email.append (data, size);
+    });
+    return email;
+}
+
+void
+Smtp::msg2email (zmsg_t **msg_p, const EmailMime::Sink& sink) const
 {
     assert (msg_p && *msg_p);
     zmsg_t *msg = *msg_p;
 
-    std::stringstream buff;
-    cxxtools::MimeMultipart mime;
+    EmailMime mime {sink, _parts.get ()};
 
     char *to = zmsg_popstr (msg);
     char *subject = zmsg_popstr (msg);
@@ -238,14 +1426,14 @@ Smtp::msg2email (zmsg_t **msg_p) const
     ZstrGuard bodyTemp (zmsg_popstr (msg));
     body += bodyTemp.get();
 
-    mime.setHeader ("To", to);
-    mime.setHeader ("Subject", subject);
-    mime.addObject (body.c_str());
+    mime.header ("To", to);
+    mime.header ("Subject", subject);
 
     zstr_free (&to);
     zstr_free (&subject);
 
     // new protocol have more frames
+    std::vector<std::string> paths;
     if (zmsg_size (msg) != 0) {
         zframe_t *frame = zmsg_pop (msg);
         zhash_t *headers = zhash_unpack (frame);
@@ -257,7 +1445,7 @@ Smtp::msg2email (zmsg_t **msg_p) const
                    value = (char*) zhash_next (headers))
         {
             const char* key = zhash_cursor (headers);
-            mime.setHeader (key, value);
+            mime.header (key, value);
         }
         zhash_destroy (&headers);
 
@@ -266,34 +1454,32 @@ Smtp::msg2email (zmsg_t **msg_p) const
         time_t t = ::time(NULL);
         struct tm* tmp = ::localtime(&t);
         char buf[256];
-        strftime(buf, sizeof(buf), "%a, %d %b %Y %T %z\n", tmp);
-        mime.setHeader ("Date", buf);
+        strftime(buf, sizeof(buf), "%a, %d %b %Y %T %z", tmp);
+        mime.header ("Date", buf);
 
         while (zmsg_size (msg) != 0)
         {
             char* path = zmsg_popstr (msg);
-            const char* mime_type = magic_file (_magic, path);
-            if (!mime_type) {
-                log_warning ("Can't guess type for %s, using application/octet-stream", path);
-                mime_type = "application/octet-stream; charset=binary";
-            }
-
-            std::ifstream ipath {path};
-
-            if (s_is_text (mime_type))
-                mime.attachTextFile (ipath, basename (path), mime_type);
-            else
-                mime.attachBinaryFile (ipath, basename (path), mime_type);
-
-            ipath.close ();
+            paths.push_back (path);
             zstr_free (&path);
         }
     }
     zmsg_destroy (&msg);
     *msg_p = NULL;
 
-    buff << mime;
-    return buff.str ();
+    mime.text (body);
+    for (const auto& path : paths) {
+        std::string mime_type = _types->type (_magic, path);
+        if (mime_type.empty ()) {
+            log_warning ("Can't guess type for %s, using application/octet-stream", path.c_str ());
+            mime_type = "application/octet-stream; charset=binary";
+        }
+        // POSIX basename can modify its argument
+        std::vector<char> name (path.begin (), path.end ());
+        name.push_back ('\0');
+        mime.attach (path, basename (name.data ()), mime_type);
+    }
+    mime.finish ();
 }
 
 std::string
@@ -322,6 +1508,137 @@ sms_email_address (
     return ret;
 }
 
+// add addresses from one To/Cc/Bcc header value to recipients
+static void
+s_parse_addresses (
+        const std::string& value,
+        std::vector<std::string>& recipients)
+{
+    std::vector<std::string> items;
+    std::string item;
+    bool quoted = false;
+    for (const char ch : value) {
+        if (ch == '"')
+            quoted = !quoted;
+        if (ch == ',' && !quoted) {
+            items.push_back (item);
+            item.clear ();
+        }
+        else
+            item.push_back (ch);
+    }
+    items.push_back (item);
+
+    for (auto& it : items) {
+        // group "name: a, b;", e.g. "undisclosed-recipients:;"
+        auto colon = it.find (':');
+        if (colon != std::string::npos && colon < it.find ('<'))
+            it.erase (0, colon + 1);
+        auto semicolon = it.rfind (';');
+        if (semicolon != std::string::npos && it.find ('>', semicolon) == std::string::npos)
+            it.erase (semicolon);
+        auto lt = it.rfind ('<');
+        auto gt = it.rfind ('>');
+        if (lt != std::string::npos && gt != std::string::npos && lt < gt)
+            it = it.substr (lt + 1, gt - lt - 1);
+        auto first = it.find_first_not_of (" \t\r\n");
+        if (first == std::string::npos)
+            continue;
+        auto last = it.find_last_not_of (" \t\r\n");
+        recipients.push_back (it.substr (first, last - first + 1));
+    }
+}
+
+bool
+smtp_split_address (
+        const std::string& address,
+        const std::string& default_port,
+        std::string& host,
+        std::string& port)
+{
+    std::string rest;
+    if (!address.empty () && address [0] == '[') {
+        size_t bracket = address.find (']');
+        if (bracket == std::string::npos || bracket == 1)
+            return false;
+        host = address.substr (1, bracket - 1);
+        rest = address.substr (bracket + 1);
+    }
+    else {
+        size_t colon = address.find (':');
+        // more colons mean IPv6 without brackets, port would be ambiguous
+        if (colon != std::string::npos && address.find (':', colon + 1) != std::string::npos)
+            return false;
+        host = address.substr (0, colon);
+        rest = colon == std::string::npos ? "" : address.substr (colon);
+    }
+    if (host.empty () && !address.empty ())
+        return false;
+
+    if (rest.empty ())
+        port = default_port;
+    else
+    if (rest [0] == ':' && rest.size () > 1)
+        port = rest.substr (1);
+    else
+        return false;
+    return true;
+}
+
+std::vector<std::string>
+smtp_recipients (
+        const std::string& data,
+        std::string *stripped)
+{
+    std::vector<std::string> recipients;
+    if (stripped)
+        stripped->clear ();
+
+    size_t pos = 0;
+    bool bcc = false;
+    bool collecting = false;
+    std::string value;
+    while (pos < data.size ()) {
+        size_t eol = data.find ('\n', pos);
+        size_t next = eol == std::string::npos ? data.size () : eol + 1;
+        std::string line = data.substr (pos, next - pos);
+
+        bool continuation = line [0] == ' ' || line [0] == '\t';
+        if (!continuation && collecting) {
+            s_parse_addresses (value, recipients);
+            collecting = false;
+        }
+
+        // end of headers
+        if (line == "\n" || line == "\r\n") {
+            if (stripped)
+                stripped->append (data, pos, std::string::npos);
+            return recipients;
+        }
+
+        if (!continuation) {
+            auto colon = line.find (':');
+            std::string name = colon == std::string::npos ? "" : line.substr (0, colon);
+            bcc = strcasecmp (name.c_str (), "Bcc") == 0;
+            collecting = bcc
+                || strcasecmp (name.c_str (), "To") == 0
+                || strcasecmp (name.c_str (), "Cc") == 0;
+            if (collecting)
+                value = line.substr (colon + 1);
+        }
+        else
+        if (collecting)
+            value += line;
+
+        if (stripped && !bcc)
+            stripped->append (line);
+        pos = next;
+    }
+    if (collecting)
+        s_parse_addresses (value, recipients);
+    return recipients;
+}
+
 SmtpError
     msmtp_stderr2code (
         const std::string &inp)
@@ -329,6 +1646,8 @@ SmtpError
     if (inp.size () == 0)
         return SmtpError::Succeeded;
 
+    static cxxtools::Regex Timeout {"(timed out after [0-9]+ ms, killed|network operation with .* timed out)", REG_EXTENDED};
+    static cxxtools::Regex NoRecipient {"(no recipients found|no recipient address accepted)"};
     static cxxtools::Regex ServerUnreachable {"cannot connect to .*, port .*"};
     static cxxtools::Regex DNSFailed {"(cannot locate host.*: Name or service not known|the server does not support DNS)", REG_EXTENDED};
     static cxxtools::Regex SSLNotSupported {"(the server does not support TLS via the STARTTLS command|command STARTTLS failed|cannot use a secure authentication method)"};
@@ -336,6 +1655,12 @@ SmtpError
     static cxxtools::Regex AuthFailed {"(authentication failed|(AUTH LOGIN|AUTH CRAM-MD5|AUTH EXTERNAL) failed)"};
     static cxxtools::Regex UnknownCA {"(no certificate was founderror gettint .* fingerprint|the certificate fingerprint does not match|the certificate has been revoked|the certificate hasn't got a known issuer|the certificate is not trusted)"};
 
+    if (Timeout.match (inp))
+        return SmtpError::Timeout;
+
+    if (NoRecipient.match (inp))
+        return SmtpError::NoRecipient;
+
     if (ServerUnreachable.match (inp))
         return SmtpError::ServerUnreachable;
 
@@ -357,6 +1682,207 @@ SmtpError
     return SmtpError::Unknown;
 }
 
+bool
+    smtp_error_is_transient (
+        SmtpError error)
+{
+    switch (error) {
+        case SmtpError::ServerUnreachable:
+        case SmtpError::DNSFailed:
+        case SmtpError::Timeout:
+            return true;
+        default:
+            return false;
+    }
+}
+
+
+//  --------------------------------------------------------------------------
+//  Minimal SMTP server for the selftest
+//
+//  It does not offer STARTTLS nor AUTH, it rejects recipients starting with
+//  "reject" and reports each accepted email on the actor pipe as
+//  [$connection|$from|$rcpt1,$rcpt2,...|$data]. The first message on the pipe
+//  is the port it listens on.
+
+struct s_standin_conn_t {
+    int fd;
+    int id;
+    bool in_data;
+    std::string rbuf;
+    std::string from;
+    std::string rcpt;
+    std::string data;
+};
+
+static void
+s_standin_write (int fd, const char *reply)
+{
+    ssize_t r = ::send (fd, reply, strlen (reply), MSG_NOSIGNAL);
+    if (r != (ssize_t) strlen (reply))
+        log_debug ("smtp-standin: short write: %zd", r);
+}
+
+static std::string
+s_standin_address (const std::string& line)
+{
+    auto lt = line.find ('<');
+    auto gt = line.find ('>');
+    if (lt == std::string::npos || gt == std::string::npos || gt < lt)
+        return "";
+    return line.substr (lt + 1, gt - lt - 1);
+}
+
+static void
+s_standin_line (zsock_t *pipe, s_standin_conn_t &conn, std::string line)
+{
+    if (conn.in_data) {
+        if (line == ".") {
+            conn.in_data = false;
+            zmsg_t *msg = zmsg_new ();
+            zmsg_addstrf (msg, "%d", conn.id);
+            zmsg_addstr (msg, conn.from.c_str ());
+            zmsg_addstr (msg, conn.rcpt.c_str ());
+            zmsg_addstr (msg, conn.data.c_str ());
+            zmsg_send (&msg, pipe);
+            conn.from.clear ();
+            conn.rcpt.clear ();
+            conn.data.clear ();
+            s_standin_write (conn.fd, "250 OK queued\r\n");
+            return;
+        }
+        if (line [0] == '.')
+            line.erase (0, 1);
+        conn.data += line + "\r\n";
+        return;
+    }
+
+    std::string verb = line.substr (0, 4);
+    for (auto& ch : verb)
+        ch = toupper (ch);
+
+    if (verb == "EHLO")
+        s_standin_write (conn.fd, "250-localhost\r\n250-PIPELINING\r\n250 8BITMIME\r\n");
+    else
+    if (verb == "HELO" || verb == "NOOP")
+        s_standin_write (conn.fd, "250 OK\r\n");
+    else
+    if (verb == "MAIL") {
+        conn.from = s_standin_address (line);
+        s_standin_write (conn.fd, "250 OK\r\n");
+    }
+    else
+    if (verb == "RCPT") {
+        std::string rcpt = s_standin_address (line);
+        if (rcpt.compare (0, 6, "reject") == 0)
+            s_standin_write (conn.fd, "550 5.1.1 No such user\r\n");
+        else {
+            conn.rcpt += conn.rcpt.empty () ? rcpt : "," + rcpt;
+            s_standin_write (conn.fd, "250 OK\r\n");
+        }
+    }
+    else
+    if (verb == "DATA") {
+        if (conn.rcpt.empty ())
+            s_standin_write (conn.fd, "554 No valid recipients\r\n");
+        else {
+            conn.in_data = true;
+            s_standin_write (conn.fd, "354 End data with <CR><LF>.<CR><LF>\r\n");
+        }
+    }
+    else
+    if (verb == "RSET") {
+        conn.from.clear ();
+        conn.rcpt.clear ();
+        conn.data.clear ();
+        s_standin_write (conn.fd, "250 OK\r\n");
+    }
+    else
+    if (verb == "QUIT") {
+        s_standin_write (conn.fd, "221 Bye\r\n");
+        ::close (conn.fd);
+        conn.fd = -1;
+    }
+    else
+        s_standin_write (conn.fd, "502 Command not implemented\r\n");
+}
+
+static void
+s_smtp_standin (zsock_t *pipe, void *args)
+{
+    int listener = ::socket (AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    assert (listener != -1);
+    struct sockaddr_in addr;
+    memset (&addr, 0, sizeof (addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl (INADDR_LOOPBACK);
+    addr.sin_port = 0;
+    int r = ::bind (listener, (struct sockaddr*) &addr, sizeof (addr));
+    assert (r == 0);
+    r = ::listen (listener, 16);
+    assert (r == 0);
+    socklen_t len = sizeof (addr);
+    r = getsockname (listener, (struct sockaddr*) &addr, &len);
+    assert (r == 0);
+
+    zsock_signal (pipe, 0);
+    zstr_sendf (pipe, "%d", ntohs (addr.sin_port));
+
+    zpoller_t *poller = zpoller_new (pipe, NULL);
+    std::vector<s_standin_conn_t> conns;
+    int last_id = 0;
+    bool terminated = false;
+    while (!terminated && !zsys_interrupted) {
+        std::vector<struct pollfd> fds;
+        fds.push_back ({listener, POLLIN, 0});
+        for (const auto& conn : conns)
+            fds.push_back ({conn.fd, POLLIN, 0});
+        ::poll (&fds [0], fds.size (), 10);
+
+        for (size_t i = 1; i != fds.size (); i++) {
+            if (!fds [i].revents)
+                continue;
+            s_standin_conn_t &conn = conns [i - 1];
+            char buf [4096];
+            ssize_t n = ::recv (conn.fd, buf, sizeof (buf), 0);
+            if (n <= 0) {
+                ::close (conn.fd);
+                conn.fd = -1;
+                continue;
+            }
+            conn.rbuf.append (buf, n);
+            size_t eol;
+            while (conn.fd != -1 && (eol = conn.rbuf.find ("\r\n")) != std::string::npos) {
+                std::string line = conn.rbuf.substr (0, eol);
+                conn.rbuf.erase (0, eol + 2);
+                s_standin_line (pipe, conn, line);
+            }
+        }
+        conns.erase (
+            std::remove_if (conns.begin (), conns.end (), [] (const s_standin_conn_t &c) { return c.fd == -1; }),
+            conns.end ());
+
+        if (fds [0].revents & POLLIN) {
+            int fd = ::accept (listener, NULL, NULL);
+            if (fd != -1) {
+                conns.push_back (s_standin_conn_t {fd, ++last_id, false, "", "", "", ""});
+                s_standin_write (fd, "220 localhost ESMTP stand-in\r\n");
+            }
+        }
+
+        if (zpoller_wait (poller, 0) == pipe) {
+            char *cmd = zstr_recv (pipe);
+            if (cmd && streq (cmd, "$TERM"))
+                terminated = true;
+            zstr_free (&cmd);
+        }
+    }
+
+    for (const auto& conn : conns)
+        ::close (conn.fd);
+    ::close (listener);
+    zpoller_destroy (&poller);
+}
 
 //  --------------------------------------------------------------------------
 //  Self test of this class
@@ -414,6 +1940,10 @@ email_test (bool verbose)
     // test of msmtp_stderr2code
     // test case 3 DNSFailed
     assert (msmtp_stderr2code ("msmtp: cannot locate host NOTmail.etn.com: Name or service not known\nmsmtp: could not send mail (account default from config)") == SmtpError::DNSFailed);
+    assert (smtp_error_is_transient (SmtpError::DNSFailed));
+    assert (smtp_error_is_transient (SmtpError::ServerUnreachable));
+    assert (smtp_error_is_transient (SmtpError::Timeout));
+    assert (!smtp_error_is_transient (SmtpError::AuthFailed));
 
     zhash_t *headers = zhash_new ();
     zhash_update (headers, "Foo", (void*) "bar");
@@ -443,6 +1973,457 @@ email_test (bool verbose)
     std::string email = smtp.msg2email (&email_msg);
     log_debug ("E M A I L:=\n%s\n", email.c_str ());
 
+    // test of smtp_recipients
+    {
+        std::string stripped;
+        std::vector<std::string> rcpt = smtp_recipients (
+                "From: joe@example.com\r\n"
+                "To: \"Doe, John\" <john@example.com>, jane@example.com\r\n"
+                "Bcc: secret@example.com\r\n"
+                "Cc: a@example.com,\r\n"
+                "  b@example.com\r\n"
+                "Subject: To: nobody@example.com\r\n"
+                "\r\n"
+                "To: nobody@example.com\r\n",
+                &stripped);
+        assert (rcpt.size () == 5);
+        assert (rcpt [0] == "john@example.com");
+        assert (rcpt [1] == "jane@example.com");
+        assert (rcpt [2] == "secret@example.com");
+        assert (rcpt [3] == "a@example.com");
+        assert (rcpt [4] == "b@example.com");
+        assert (stripped.find ("secret") == std::string::npos);
+        assert (stripped.find ("\r\n\r\nTo: nobody@example.com\r\n") != std::string::npos);
+    }
+
+    // test of recipients hidden from each other
+    {
+        std::vector<std::string> rcpt = smtp_recipients (
+                "To: undisclosed-recipients:;\r\n"
+                "Bcc: joe@example.com, jane@example.com\r\n"
+                "\r\n"
+                "body\r\n",
+                NULL);
+        assert (rcpt.size () == 2);
+        assert (rcpt [0] == "joe@example.com");
+        assert (rcpt [1] == "jane@example.com");
+
+        std::string sent;
+        Smtp hidden {};
+        hidden.sendmail_set_test_fn ([&sent] (const std::string& data) { sent = data; });
+        std::vector<SmtpRecipientStatus> statuses = hidden.sendmail (
+                std::vector<std::string> {"joe@example.com", "jane@example.com"}, "Subject", "body");
+        assert (sent.find ("To: undisclosed-recipients:;\n") != std::string::npos);
+        // no SMTP reply for single recipients without native transport
+        assert (statuses.size () == 2);
+        assert (statuses [1].recipient == "jane@example.com");
+        assert (statuses [1].accepted);
+        assert (statuses [1].code == 0);
+        assert (sent.find ("Bcc: joe@example.com, jane@example.com\n") != std::string::npos);
+
+        hidden.sendmail (std::vector<std::string> {"joe@example.com"}, "Subject", "body");
+        assert (sent.find ("To: joe@example.com\n") != std::string::npos);
+        assert (sent.find ("Bcc:") == std::string::npos);
+
+        // native transport without server fails for all recipients
+        Smtp nowhere {};
+        nowhere.transport ("native");
+        statuses = nowhere.sendmail (
+                std::vector<std::string> {"joe@example.com", "jane@example.com"}, "Subject", "body");
+        assert (statuses.size () == 2);
+        assert (!statuses [0].accepted);
+        assert (!statuses [1].accepted);
+    }
+
+    // test of native transport against local stand-in
+    {
+        zactor_t *standin = zactor_new (s_smtp_standin, NULL);
+        assert (standin);
+        char *port = zstr_recv (standin);
+        assert (port);
+
+        Smtp native {};
+        native.host ("127.0.0.1");
+        native.port (port);
+        native.from ("sender@example.com");
+        native.transport ("native");
+
+        // test case 01 - message is delivered, dot-stuffing and CRLF are fine
+        native.sendmail ("To: joe@example.com\nSubject: test\n\n.leading dot\nbody");
+        zmsg_t *mail = zmsg_recv (standin);
+        assert (mail);
+        char *conn = zmsg_popstr (mail);
+        char *from = zmsg_popstr (mail);
+        char *rcpt = zmsg_popstr (mail);
+        char *data = zmsg_popstr (mail);
+        assert (streq (from, "sender@example.com"));
+        assert (streq (rcpt, "joe@example.com"));
+        assert (streq (data, "To: joe@example.com\r\nSubject: test\r\n\r\n.leading dot\r\nbody\r\n"));
+        zstr_free (&from);
+        zstr_free (&rcpt);
+        zstr_free (&data);
+        zmsg_destroy (&mail);
+
+        // test case 02 - connection is reused for next email
+        native.sendmail ("To: joe@example.com\nSubject: test\n\nbody");
+        mail = zmsg_recv (standin);
+        assert (mail);
+        char *conn2 = zmsg_popstr (mail);
+        assert (streq (conn, conn2));
+        zstr_free (&conn2);
+        zmsg_destroy (&mail);
+
+        // test case 03 - new credentials mean new connection
+        native.password ("new");
+        native.sendmail ("To: joe@example.com\nSubject: test\n\nbody");
+        mail = zmsg_recv (standin);
+        assert (mail);
+        conn2 = zmsg_popstr (mail);
+        assert (!streq (conn, conn2));
+        zstr_free (&conn);
+        conn = conn2;
+        zmsg_destroy (&mail);
+
+        // test case 04 - connection is reused after failed transaction
+        try {
+            native.sendmail ("To: reject@example.com\nSubject: test\n\nbody\n");
+            assert (false);
+        }
+        catch (const std::runtime_error &e) {
+        }
+        native.sendmail ("To: joe@example.com\nSubject: test\n\nbody");
+        mail = zmsg_recv (standin);
+        assert (mail);
+        conn2 = zmsg_popstr (mail);
+        assert (streq (conn, conn2));
+        zstr_free (&conn2);
+        zmsg_destroy (&mail);
+
+        // test case 05 - idle connection is closed
+        native.idle_timeout (0);
+        native.expire_sessions ();
+        native.idle_timeout (60);
+        native.sendmail ("To: joe@example.com\nSubject: test\n\nbody");
+        mail = zmsg_recv (standin);
+        assert (mail);
+        conn2 = zmsg_popstr (mail);
+        assert (!streq (conn, conn2));
+        zstr_free (&conn2);
+        zmsg_destroy (&mail);
+        zstr_free (&conn);
+
+        // test case 06 - connection is not reused after rendering failed in DATA
+        native.sendmail ("To: joe@example.com\nSubject: test\n\nbody");
+        mail = zmsg_recv (standin);
+        assert (mail);
+        conn = zmsg_popstr (mail);
+        zmsg_destroy (&mail);
+        {
+            // directory can be opened, but not read
+            zmsg_t *msg = fty_email_encode ("UUID", "joe@example.com", "Subject", NULL, "body", "/tmp", NULL);
+            char *uuid = zmsg_popstr (msg);
+            zstr_free (&uuid);
+            try {
+                native.sendmail (&msg);
+                assert (false);
+            }
+            catch (const std::runtime_error &e) {
+                assert (strstr (e.what (), "Can't read attachment /tmp"));
+            }
+            zmsg_destroy (&msg);
+        }
+        // reused connection would be still in DATA and time out on RSET
+        int64_t start = zclock_mono ();
+        native.sendmail ("To: joe@example.com\nSubject: test\n\nbody");
+        assert (zclock_mono () - start < 5000);
+        mail = zmsg_recv (standin);
+        assert (mail);
+        conn2 = zmsg_popstr (mail);
+        assert (!streq (conn, conn2));
+        char *data2 = zmsg_popstr (mail);
+        zstr_free (&data2);
+        data2 = zmsg_popstr (mail);
+        zstr_free (&data2);
+        data2 = zmsg_popstr (mail);
+        assert (streq (data2, "To: joe@example.com\r\nSubject: test\r\n\r\nbody\r\n"));
+        zstr_free (&data2);
+        zstr_free (&conn2);
+        zstr_free (&conn);
+        zmsg_destroy (&mail);
+
+        // test case 07 - rejected recipient
+        try {
+            native.sendmail ("To: reject@example.com\nSubject: test\n\nbody\n");
+            assert (false);
+        }
+        catch (const std::runtime_error &e) {
+            assert (strstr (e.what (), "reject@example.com not accepted"));
+        }
+
+        // test case 08 - one transaction for many recipients, rejected ones are reported
+        std::vector<SmtpRecipientStatus> statuses = native.sendmail (
+                {"joe@example.com", "reject@example.com", "jane@example.com"},
+                "Subject",
+                "body");
+        assert (statuses.size () == 3);
+        assert (statuses [0].accepted);
+        assert (!statuses [1].accepted);
+        assert (statuses [1].code == 550);
+        assert (statuses [2].accepted);
+        mail = zmsg_recv (standin);
+        assert (mail);
+        assert (zmsg_size (mail) == 4);
+        zstr_free (&conn2);
+        conn2 = zmsg_popstr (mail);
+        zstr_free (&conn2);
+        conn2 = zmsg_popstr (mail);
+        zstr_free (&conn2);
+        char *rcpts = zmsg_popstr (mail);
+        assert (streq (rcpts, "joe@example.com,jane@example.com"));
+        zstr_free (&rcpts);
+        // contacts don't see each other
+        char *data3 = zmsg_popstr (mail);
+        assert (strstr (data3, "To: undisclosed-recipients:;\r\n"));
+        assert (!strstr (data3, "joe@example.com"));
+        zstr_free (&data3);
+        zmsg_destroy (&mail);
+
+        try {
+            native.sendmail (std::vector<std::string> {"reject1@example.com", "reject2@example.com"}, "Subject", "body");
+            assert (false);
+        }
+        catch (const std::runtime_error &e) {
+            assert (msmtp_stderr2code (e.what ()) == SmtpError::NoRecipient);
+        }
+
+        // test case 09 - STARTTLS is not offered by stand-in
+        native.encryption (Encryption::STARTTLS);
+        try {
+            native.sendmail ("To: joe@example.com\nSubject: test\n\nbody\n");
+            assert (false);
+        }
+        catch (const std::runtime_error &e) {
+            assert (msmtp_stderr2code (e.what ()) == SmtpError::SSLNotSupported);
+        }
+        native.encryption (Encryption::NONE);
+
+        // test case 10 - AUTH is not offered by stand-in
+        native.username ("joe");
+        native.password ("secret");
+        try {
+            native.sendmail ("To: joe@example.com\nSubject: test\n\nbody\n");
+            assert (false);
+        }
+        catch (const std::runtime_error &e) {
+            assert (msmtp_stderr2code (e.what ()) == SmtpError::AuthMethodNotSupported);
+        }
+        native.username ("");
+
+        // test case 11 - switching between relays keeps connections to each of them
+        native.sendmail ("To: joe@example.com\nSubject: test\n\nbody");
+        mail = zmsg_recv (standin);
+        assert (mail);
+        conn = zmsg_popstr (mail);
+        zmsg_destroy (&mail);
+        // same stand-in, but other relay for the pool
+        native.host ("localhost");
+        native.sendmail ("To: joe@example.com\nSubject: test\n\nbody");
+        mail = zmsg_recv (standin);
+        assert (mail);
+        conn2 = zmsg_popstr (mail);
+        assert (!streq (conn, conn2));
+        zstr_free (&conn2);
+        zmsg_destroy (&mail);
+        native.host ("127.0.0.1");
+        native.sendmail ("To: joe@example.com\nSubject: test\n\nbody");
+        mail = zmsg_recv (standin);
+        assert (mail);
+        conn2 = zmsg_popstr (mail);
+        assert (streq (conn, conn2));
+        zstr_free (&conn2);
+        zstr_free (&conn);
+        zmsg_destroy (&mail);
+
+        // test case 12 - server is gone
+        zactor_destroy (&standin);
+        try {
+            native.sendmail ("To: joe@example.com\nSubject: test\n\nbody\n");
+            assert (false);
+        }
+        catch (const std::runtime_error &e) {
+            assert (msmtp_stderr2code (e.what ()) == SmtpError::ServerUnreachable);
+        }
+        zstr_free (&port);
+
+        // test case 13 - server can be set as host:port
+        native.address ("mail.example.com:2525");
+        assert (native.address () == "mail.example.com:2525");
+        assert (native.host () == "mail.example.com");
+        native.address ("[::1]");
+        assert (native.host () == "::1");
+        assert (native.address () == "[::1]:2525");
+        native.address ("::1:26");
+        assert (native.address () == "[::1]:2525");
+
+        std::string split_host, split_port;
+        assert (smtp_split_address ("[fe80::1]:26", "25", split_host, split_port));
+        assert (split_host == "fe80::1");
+        assert (split_port == "26");
+        assert (smtp_split_address ("mail.example.com", "25", split_host, split_port));
+        assert (split_host == "mail.example.com");
+        assert (split_port == "25");
+        assert (!smtp_split_address ("fe80::1", "25", split_host, split_port));
+        assert (!smtp_split_address ("[fe80::1", "25", split_host, split_port));
+        assert (!smtp_split_address ("[fe80::1]26", "25", split_host, split_port));
+        assert (!smtp_split_address ("mail.example.com:", "25", split_host, split_port));
+    }
+
+    // msmtp configuration in memory
+    {
+        Smtp smtp {};
+        smtp.host ("mail.example.com");
+        smtp.username ("joe");
+        smtp.password ("secret");
+        int fd = smtp.msmtp_config_fd ();
+        if (fd != -1) {
+            // test case 01 - config is not written again for next email
+            assert (smtp.msmtp_config_fd () == fd);
+
+            // test case 02 - only owner can read it, children don't inherit it and it has current settings
+            struct stat st;
+            assert (fstat (fd, &st) == 0);
+            assert ((st.st_mode & 0777) == 0600);
+            assert (fcntl (fd, F_GETFD) & FD_CLOEXEC);
+            std::string content (st.st_size, '\0');
+            assert (pread (fd, &content [0], content.size (), 0) == st.st_size);
+            assert (content.find ("host mail.example.com\n") != std::string::npos);
+            assert (content.find ("password secret\n") != std::string::npos);
+
+            // test case 03 - changed settings make new config
+            smtp.password ("secret2");
+            assert (smtp.msmtp_config_fd () != fd);
+        }
+    }
+
+    // msmtp transport with fake msmtp
+    {
+        std::string script = str_SELFTEST_DIR_RW + "/fake-msmtp";
+        std::string output = str_SELFTEST_DIR_RW + "/fake-msmtp.out";
+        auto fake_msmtp = [&script] (const std::string& commands) {
+            std::ofstream file {script};
+            file << "#!/bin/sh\n" << commands << "\n";
+            file.close ();
+            chmod (script.c_str (), 0700);
+        };
+        Smtp smtp {};
+        smtp.host ("mail.example.com");
+        smtp.msmtp_path (script);
+
+        // test case 01 - big email is written whole while msmtp fills its stderr
+        fake_msmtp ("head -c 200000 /dev/zero >&2\ncat > " + output);
+        std::string data = "To: joe@example.com\nSubject: big\n\n" + std::string (1000000, 'a') + "\n";
+        smtp.sendmail (data);
+        std::ifstream sent {output, std::ios::binary | std::ios::ate};
+        assert (static_cast <size_t> (sent.tellg ()) == data.size ());
+        sent.close ();
+
+        // test case 02 - error is classified by stderr
+        fake_msmtp ("cat > /dev/null\necho 'msmtp: cannot connect to mail.example.com, port 25' >&2\nexit 1");
+        try {
+            smtp.sendmail (data);
+            assert (false);
+        }
+        catch (const std::runtime_error &e) {
+            assert (msmtp_stderr2code (e.what ()) == SmtpError::ServerUnreachable);
+        }
+
+        // test case 03 - stuck msmtp is killed after timeout
+        fake_msmtp ("exec sleep 10");
+        smtp.msmtp_timeout (1);
+        int64_t start = zclock_mono ();
+        try {
+            smtp.sendmail (data);
+            assert (false);
+        }
+        catch (const std::runtime_error &e) {
+            assert (msmtp_stderr2code (e.what ()) == SmtpError::Timeout);
+        }
+        assert (zclock_mono () - start < 5000);
+
+        // test case 04 - email with attachment is streamed to msmtp
+        std::string attachment = str_SELFTEST_DIR_RW + "/report.bin";
+        {
+            std::ofstream file {attachment, std::ios::binary};
+            file << std::string (2 * 1024 * 1024, '\x01');
+        }
+        fake_msmtp ("cat > " + output);
+        smtp.msmtp_timeout (60);
+        zmsg_t *mail = fty_email_encode ("UUID", "joe@example.com", "report", NULL, "see attachment", attachment.c_str (), NULL);
+        char *uuid = zmsg_popstr (mail);
+        zstr_free (&uuid);
+        smtp.sendmail (&mail);
+        assert (!mail);
+        std::ifstream streamed {output};
+        std::string content ((std::istreambuf_iterator<char> (streamed)), std::istreambuf_iterator<char> ());
+        assert (content.find ("To: joe@example.com\n") == 0);
+        assert (content.find ("filename=\"report.bin\"") != std::string::npos);
+        assert (content.find ("AQEBAQEB") != std::string::npos);
+        assert (content.size () > 2 * 1024 * 1024 * 4 / 3);
+
+        // test case 05 - msmtp gets its config as /dev/fd/3 and no config of other relay
+        Smtp other {};
+        other.host ("other.example.com");
+        if (other.msmtp_config_fd () != -1) {
+            fake_msmtp ("cat > /dev/null\necho \"$3\" > " + output + "\ncat \"$3\" >> " + output +
+                    "\nls -l /proc/$$/fd | grep -c msmtp-config >> " + output);
+            smtp.sendmail (data);
+            std::ifstream child {output};
+            std::string seen ((std::istreambuf_iterator<char> (child)), std::istreambuf_iterator<char> ());
+            assert (seen.find ("/dev/fd/3\n") == 0);
+            assert (seen.find ("host mail.example.com\n") != std::string::npos);
+            assert (seen.find ("other.example.com") == std::string::npos);
+            assert (seen.size () > 2 && seen.compare (seen.size () - 2, 2, "1\n") == 0);
+        }
+
+        zsys_file_delete (attachment.c_str ());
+        zsys_file_delete (script.c_str ());
+        zsys_file_delete (output.c_str ());
+    }
+
+    if (verbose) {
+        // benchmark - spawn to exit latency, posix_spawn vs fork based MlmSubprocess
+        // with bigger heap, as the daemon has with libmagic and translations loaded
+        const int count = 1000;
+        std::vector<char> heap (256 * 1024 * 1024, 'x');
+
+        int64_t start = zclock_usecs ();
+        for (int i = 0; i != count; i++) {
+            SpawnedProcess proc;
+            int r = s_spawn ({"/bin/true"}, proc);
+            assert (r == 0);
+            r = s_wait (proc);
+            assert (r == 0);
+        }
+        double spawn_usecs = static_cast <double> (zclock_usecs () - start) / count;
+
+        start = zclock_usecs ();
+        for (int i = 0; i != count; i++) {
+            MlmSubprocess::SubProcess proc {{"/bin/true"}, MlmSubprocess::SubProcess::STDIN_PIPE |
+                    MlmSubprocess::SubProcess::STDOUT_PIPE |
+                    MlmSubprocess::SubProcess::STDERR_PIPE};
+            bool started = proc.run ();
+            assert (started);
+            int r = proc.wait ();
+            assert (r == 0);
+        }
+        double fork_usecs = static_cast <double> (zclock_usecs () - start) / count;
+
+        log_info ("spawn benchmark: %zu MB heap, posix_spawn %.0f us, MlmSubprocess %.0f us",
+                heap.size () >> 20, spawn_usecs, fork_usecs);
+        printf ("\n   %zu MB heap, spawn to exit: posix_spawn %6.0f us, MlmSubprocess %6.0f us\n * email: ",
+                heap.size () >> 20, spawn_usecs, fork_usecs);
+    }
+
     //  @end
     printf ("OK\n");
 }
@@ -20,7 +20,7 @@
 */
 
 /*! \file   email.h
-    \brief  Simple wrapper on top of msmtp to send an email
+    \brief  Simple wrapper on top of msmtp (or native SMTP client) to send an email
     \author Michal Vyskocil <MichalVyskocil@Eaton.com>
 
 Example:
@@ -44,7 +44,12 @@ Example:
 
 #include <string>
 #include <vector>
+#include <set>
 #include <functional>
+#include <list>
+#include <map>
+#include <memory>
+#include <mutex>
 #include <fty_common_mlm_subprocess.h>
 
 /**
@@ -58,6 +63,18 @@ enum class Encryption {
     STARTTLS
 };
 
+/**
+ * \class Transport
+ *
+ * How the email is handed over to the SMTP server
+ *  MSMTP   fork /usr/bin/msmtp for each email
+ *  NATIVE  speak SMTP directly from this process
+ */
+enum class Transport {
+    MSMTP,
+    NATIVE
+};
+
 /*
  * \class SmtpError
  *
@@ -72,6 +89,7 @@ enum class Encryption {
 8: if SSL is requiered by the smtp server
 9: if sender address is not specified
 10: if the reason is unknown
+11: if the delivery did not finish in time
 */
 
 enum class SmtpError {
@@ -85,7 +103,150 @@ enum class SmtpError {
     UnknownCA = 7,
     SSLRequired = 8,
     NoSenderAddress = 9,
-    Unknown = 10
+    Unknown = 10,
+    Timeout = 11
+};
+
+/**
+ * \class SmtpRecipientStatus
+ *
+ * Result of RCPT TO for one recipient, only native transport sees the
+ * replies, otherwise code is 0 and accepted is result of whole transaction
+ */
+struct SmtpRecipientStatus {
+    std::string recipient;
+    bool accepted;
+    int code;               // SMTP reply code, 0 if unknown
+    std::string message;    // SMTP reply text
+};
+
+/**
+ * \class SmtpSession
+ *
+ * \brief One SMTP connection to the server
+ *
+ * Speaks the protocol directly (RFC 5321), with optional implicit TLS or
+ * STARTTLS (RFC 3207) and AUTH PLAIN/LOGIN/CRAM-MD5 (RFC 4954). Errors are
+ * reported as std::runtime_error with msmtp compatible wording, so
+ * msmtp_stderr2code classifies them the same way as msmtp failures.
+ */
+class SmtpSession
+{
+    public:
+        SmtpSession (
+                const std::string& host,
+                const std::string& port,
+                Encryption encryption,
+                bool verify_ca,
+                int timeout,
+                int cancel = -1);
+
+        ~SmtpSession ();
+
+        /**
+         * \brief connect, read greeting, EHLO, TLS and AUTH
+         *
+         * \param username  empty username turns authentication off
+         * \param password  password for authentication
+         *
+         * \throws std::runtime_error on connection or protocol errors
+         */
+        void open (
+                const std::string& username,
+                const std::string& password);
+
+        /**
+         * \brief send one email in one MAIL/RCPT/DATA transaction
+         *
+         * RCPT commands are pipelined if the server supports PIPELINING.
+         *
+         * \param from          envelope sender
+         * \param recipients    envelope recipients
+         * \param data          email DATA, dot-stuffing and CRLF are handled here
+         * \param statuses      if NULL, any rejected recipient aborts the email
+         *                      (like msmtp does), otherwise email goes to accepted
+         *                      recipients and result for each is stored here
+         *
+         * \throws std::runtime_error if the server refuses the email
+         */
+        void send (
+                const std::string& from,
+                const std::vector<std::string>& recipients,
+                const std::string& data,
+                std::vector<SmtpRecipientStatus> *statuses = NULL);
+
+        /**
+         * \brief start the transaction of send, up to DATA
+         *
+         * Then DATA is written in pieces by write_data and finished by end.
+         */
+        void begin (
+                const std::string& from,
+                const std::vector<std::string>& recipients,
+                std::vector<SmtpRecipientStatus> *statuses = NULL);
+
+        /** \brief write next piece of DATA, dot-stuffing and CRLF are handled here */
+        void write_data (const char *data, size_t size);
+
+        /** \brief finish DATA and check the server accepted the email */
+        void end ();
+
+        /** \brief say QUIT and close the connection */
+        void quit ();
+
+        /** \brief close the connection without QUIT, e.g. in the middle of DATA */
+        void close ();
+
+        /**
+         * \brief prepare idle connection for the next email
+         *
+         * Sends RSET if the last transaction did not finish and checks
+         * the server did not close the connection meanwhile.
+         *
+         * \return false if connection can't be reused
+         */
+        bool reset ();
+
+        /** \brief true if connection is established */
+        bool is_open () const { return _fd != -1; };
+
+        /** \brief true if the end of DATA was sent in the last transaction */
+        bool committed () const { return _committed; };
+
+    private:
+        SmtpSession (const SmtpSession&) = delete;
+        SmtpSession& operator= (const SmtpSession&) = delete;
+
+        void connect ();
+        void handshake ();
+        void ehlo ();
+        void authenticate (
+                const std::string& username,
+                const std::string& password);
+        int command (const std::string& line, std::string& text);
+        int reply (std::string& text);
+        void write_all (const char *data, size_t size);
+        size_t read_some (char *data, size_t size);
+        void wait_io (short events);
+        void fail (const std::string& message);
+
+        std::string _host;
+        std::string _port;
+        Encryption _encryption;
+        bool _verify_ca;
+        int _timeout;
+        int _cancel;        // readable when the session should be aborted, or -1
+        int _fd;
+        SSL_CTX *_ctx;
+        SSL *_ssl;
+        std::string _rbuf;
+        std::set<std::string> _auth;
+        bool _starttls;
+        bool _pipelining;
+        bool _dirty;
+        bool _committed;
+        bool _bol;          // DATA is at the beginning of line
+        char _prev;         // last char of DATA
 };
 
 /**
@@ -107,6 +268,15 @@ class Smtp
          */
         explicit Smtp();
 
+        /**
+         * \brief copy the configuration
+         *
+         * The copy gets its own libmagic handle and an empty session pool,
+         * so it can be used by other thread. Caches of MIME types and encoded
+         * attachments are shared.
+         */
+        Smtp (const Smtp& other);
+
         ~Smtp ();
 
         /** \brief set the SMTP server address */
@@ -115,6 +285,20 @@ class Smtp
         /** \brief set the SMTP server port. Default is 25.*/
         void port (const std::string& port) { _port = port; };
 
+        /** \brief host name or IP address of the smtp server */
+        const std::string& host () const { return _host; };
+
+        /**
+         * \brief host:port of the smtp server, [ipv6]:port for IPv6 address
+         */
+        std::string address () const;
+
+        /**
+         * \brief set the SMTP server address and port as host:port or [ipv6]:port,
+         *        invalid address is ignored with a warning
+         */
+        void address (const std::string& address);
+
         /** \brief set the "mail from" address */
         void from (const std::string& from) { _from = from; };
 
@@ -131,6 +315,25 @@ class Smtp
         /** \brief turn on or of the CA verification */
         void verify_ca (bool verify) { _verify_ca = verify; }
 
+        /** \brief set the transport used to send emails (msmtp|native) */
+        void transport (const std::string& name);
+        void transport (Transport transport) { _transport = transport; };
+
+        /** \brief set maximum number of idle connections to each relay kept by native transport, 0 disables reuse */
+        void pool_size (size_t size) { _pool_size = size; };
+
+        /** \brief set time in seconds after which idle connection is closed */
+        void idle_timeout (int seconds) { _idle_timeout = seconds; };
+
+        /**
+         * \brief close idle connections older than idle_timeout and
+         *        connections opened with other credentials or TLS settings
+         *
+         * Connections are expired on each send anyway, call this periodically
+         * to not keep connections open when no email is sent.
+         */
+        void expire_sessions () const;
+
         /**
          * \brief set alternative path for msmtp
          *
@@ -139,6 +342,20 @@ class Smtp
          */
         void msmtp_path (const std::string& msmtp_path) { _msmtp = msmtp_path; };
 
+        /**
+         * \brief set time in seconds after which msmtp is killed, default 60
+         */
+        void msmtp_timeout (int seconds) { _msmtp_timeout = seconds; };
+
+        /**
+         * \brief set file descriptor which becomes readable when delivery
+         *        in progress should be aborted, -1 (default) for none
+         *
+         * Aborted delivery fails with "cancelled" error, it's not copied
+         * with the configuration.
+         */
+        void cancel_fd (int fd) { _cancel = fd; };
+
         /**
          * \brief set sendmail testing function
          *
@@ -153,14 +370,19 @@ class Smtp
         /**
          * \brief send the email
          *
-         * Technically this put email to msmtp's outgoing queue
+         * Email is rendered once and sent to all recipients in one
+         * SMTP transaction.
          * \param to        email header To: multiple recipient in vector
          * \param subject   email header Subject:
          * \param body      email body
+         * \return accept/reject result for each recipient, SMTP reply codes
+         *         need transport = native, msmtp transport reports code 0
+         *         and all accepted if it succeeds
          *
-         * \throws std::runtime_error for msmtp invocation errors
+         * \throws std::runtime_error for msmtp invocation errors or if
+         *         no recipient was accepted
          */
-        void sendmail(
+        std::vector<SmtpRecipientStatus> sendmail(
                 const std::vector<std::string> &to,
                 const std::string& subject,
                 const std::string& body) const;
@@ -203,10 +425,58 @@ class Smtp
         std::string
             msg2email (zmsg_t **msg_p) const;
 
+        /**
+         * \brief convert zmq message to email written to sink in pieces
+         *
+         * Attachments are read and encoded piece by piece, see EmailMime.
+         *
+         * \throws std::runtime_error if reading of an attachment fails
+         */
+        void
+            msg2email (zmsg_t **msg_p, const EmailMime::Sink& sink) const;
+
+        /**
+         * \brief send the email from zmq message, see msg2email
+         *
+         * The email is streamed to msmtp or the server as it's converted,
+         * so it's never in memory as a whole.
+         *
+         * \throws std::runtime_error for msmtp invocation errors
+         */
+        void sendmail (zmsg_t **msg_p) const;
+
+        /**
+         * \brief descriptor of msmtp configuration for current settings
+         *
+         * Configuration is kept in memory (memfd, close-on-exec) and only
+         * the msmtp process being started gets it, as /dev/fd/3. It's
+         * written again only when settings change.
+         *
+         * \return descriptor or -1 if memfd is not available
+         */
+        int msmtp_config_fd () const;
+
+        /** \brief MIME types of attachments */
+        const EmailMagic& mime_types () const { return *_types; };
+
+        /**
+         * \brief set memory budget of encoded attachments cache (bytes),
+         *        0 disables it
+         */
+        void attachment_cache (size_t budget) { _parts->budget (budget); };
+
+        /** \brief encoded attachments */
+        const EmailParts& attachments () const { return *_parts; };
+
     protected:
 
         /**
-         * \brief create msmtp config file
+         * \brief msmtp configuration for current settings
+         */
+        std::string msmtp_config () const;
+
+        /**
+         * \brief create msmtp config file, used if memfd is not available
          */
         std::string createConfigFile() const;
         /**
@@ -214,6 +484,52 @@ class Smtp
          */
         void deleteConfigFile(std::string &filename) const;
 
+        // writes the email to sink, can be called again for another attempt
+        typedef std::function<void (const EmailMime::Sink& sink)> Render;
+
+        /**
+         * \brief send the email using SmtpSession instead of msmtp
+         *
+         * \param render        writes email DATA
+         * \param recipients    envelope recipients, if NULL they are taken
+         *                      from headers (the first piece of render)
+         *                      and Bcc is removed
+         * \param statuses      see SmtpSession::send
+         */
+        void sendmail_native (
+                const Render& render,
+                const std::vector<std::string> *recipients,
+                std::vector<SmtpRecipientStatus> *statuses) const;
+
+        /**
+         * \brief send the email rendered to msmtp
+         */
+        void sendmail_msmtp (const Render& render) const;
+
+        /**
+         * \brief get connected session from the pool or open new one
+         *
+         * \param [out] reused  true if session comes from the pool
+         */
+        std::unique_ptr<SmtpSession> acquire_session (bool& reused) const;
+
+        /**
+         * \brief return session to the pool
+         */
+        void release_session (std::unique_ptr<SmtpSession> session) const;
+
+        /**
+         * \brief credentials and TLS settings sessions are opened with
+         */
+        std::string session_config () const;
+
+        struct PooledSession {
+            std::unique_ptr<SmtpSession> session;
+            std::string relay;      // host:port
+            std::string config;     // session_config ()
+            int64_t last_used;
+        };
+
         std::string _host;
         std::string _port;
         std::string _from;
@@ -221,10 +537,21 @@ class Smtp
         std::string _username;
         std::string _password;
         std::string _msmtp;
+        int _msmtp_timeout;
+        int _cancel;
         bool _has_fn;
         bool _verify_ca;
+        Transport _transport;
+        size_t _pool_size;
+        int _idle_timeout;
+        mutable std::mutex _pool_mutex;
+        mutable std::list<PooledSession> _pool;
+        mutable std::mutex _config_mutex;
+        mutable std::map<std::string, int> _config_fds;    // msmtp config -> memfd
         std::function <void(const std::string&)> _fn;
         magic_t _magic;
+        std::shared_ptr<EmailMagic> _types;
+        std::shared_ptr<EmailParts> _parts;
 };
 
 /**
@@ -257,6 +584,34 @@ std::string
         const std::string& gw_template,
         const std::string& phone_number);
 
+/**
+ * \brief Get envelope recipients from To, Cc and Bcc headers of the email
+ *
+ * This is what msmtp -t does.
+ *
+ * \param [in] data        email DATA
+ * \param [out] stripped   email DATA without Bcc header (can be NULL)
+ * \return list of addresses
+ */
+std::vector<std::string>
+    smtp_recipients (
+        const std::string& data,
+        std::string *stripped);
+
+/**
+ * \brief split SMTP server address host[:port] or [ipv6][:port]
+ *
+ * \param [out] host  host name or IP address, IPv6 without brackets
+ * \param [out] port  port number, default_port if not given
+ * \return false if the address is not valid, e.g. IPv6 without brackets
+ */
+bool
+    smtp_split_address (
+        const std::string& address,
+        const std::string& default_port,
+        std::string& host,
+        std::string& port);
+
 /**
  * Convert msmtp stderr to error code
  */
@@ -264,6 +619,14 @@ SmtpError
     msmtp_stderr2code (
         const std::string &inp);
 
+/**
+ * \brief true if the error can go away on its own (server down or too slow,
+ * DNS outage), so it's worth to try again later
+ */
+bool
+    smtp_error_is_transient (
+        SmtpError error);
+
 void email_test (bool verbose);
 
 #endif
@@ -0,0 +1,196 @@
+/*  =========================================================================
+    emailbreaker - Circuit breaker for SMTP servers
+
+    Copyright (C) 2014 - 2020 Eaton
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License along
+    with this program; if not, write to the Free Software Foundation, Inc.,
+    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+    =========================================================================
+*/
+
+/*
+@header
+    emailbreaker - Circuit breaker for SMTP servers
+@discuss
+    During relay outage every delivery waits for the connect timeout before
+    it fails. Breaker stops sending to the server after few such failures, so
+    emails fail fast (and go to retry) instead of blocking the workers.
+@end
+*/
+
+#include "fty_email_classes.h"
+
+EmailBreaker::EmailBreaker ():
+    _threshold {5},
+    _cooldown {60000},
+    _circuits {}
+{
+}
+
+void
+EmailBreaker::policy (int threshold, int64_t cooldown)
+{
+    _threshold = threshold;
+    _cooldown = cooldown;
+    if (_threshold <= 0)
+        _circuits.clear ();
+}
+
+bool
+EmailBreaker::allow (const std::string& server, int64_t now)
+{
+    auto it = _circuits.find (server);
+    if (_threshold <= 0 || it == _circuits.end ())
+        return true;
+
+    Circuit& circuit = it->second;
+    switch (circuit.state) {
+        case State::CLOSED:
+            return true;
+        case State::OPEN:
+        case State::HALF_OPEN:
+            // half open for too long means the probe got lost, send another one
+            if (now - circuit.since < _cooldown)
+                return false;
+            if (circuit.state == State::OPEN)
+                log_info ("breaker for %s is half open, sending probe", server.c_str ());
+            circuit.state = State::HALF_OPEN;
+            circuit.since = now;
+            return true;
+    }
+    return true;
+}
+
+void
+EmailBreaker::release (const std::string& server, int64_t now)
+{
+    auto it = _circuits.find (server);
+    if (it == _circuits.end () || it->second.state != State::HALF_OPEN)
+        return;
+    it->second.state = State::OPEN;
+    it->second.since = now - _cooldown;
+}
+
+void
+EmailBreaker::result (const std::string& server, SmtpError error, int64_t now)
+{
+    if (_threshold <= 0)
+        return;
+
+    auto it = _circuits.find (server);
+    // server answered, so it's reachable
+    if (!smtp_error_is_transient (error)) {
+        if (it == _circuits.end ())
+            return;
+        if (it->second.state != State::CLOSED)
+            log_info ("breaker for %s is closed", server.c_str ());
+        _circuits.erase (it);
+        return;
+    }
+
+    if (it == _circuits.end ())
+        it = _circuits.insert (std::make_pair (server, Circuit {State::CLOSED, 0, now})).first;
+    Circuit& circuit = it->second;
+    circuit.failures++;
+
+    if (circuit.state == State::HALF_OPEN
+    || (circuit.state == State::CLOSED && circuit.failures >= _threshold)) {
+        log_warning ("breaker for %s is open for %" PRIi64 " ms after %d failures",
+                server.c_str (), _cooldown, circuit.failures);
+        circuit.state = State::OPEN;
+        circuit.since = now;
+    }
+}
+
+EmailBreaker::State
+EmailBreaker::state (const std::string& server) const
+{
+    auto it = _circuits.find (server);
+    return it == _circuits.end () ? State::CLOSED : it->second.state;
+}
+
+//  --------------------------------------------------------------------------
+//  Self test of this class
+
+void
+emailbreaker_test (bool verbose)
+{
+    printf (" * emailbreaker: ");
+
+    //  @selftest
+    const std::string server = "mail.example.com:25";
+    const std::string other = "mail2.example.com:25";
+    {
+        // test case 01 - breaker opens after threshold of connection failures
+        EmailBreaker breaker;
+        breaker.policy (3, 1000);
+        int64_t now = 0;
+        assert (breaker.allow (server, now));
+        breaker.result (server, SmtpError::ServerUnreachable, now);
+        breaker.result (server, SmtpError::DNSFailed, now);
+        assert (breaker.state (server) == EmailBreaker::State::CLOSED);
+        assert (breaker.allow (server, now));
+        breaker.result (server, SmtpError::ServerUnreachable, now);
+        assert (breaker.state (server) == EmailBreaker::State::OPEN);
+        assert (!breaker.allow (server, now + 500));
+        assert (breaker.allow (other, now + 500));
+
+        // test case 02 - one probe after cooldown, failed probe opens it again
+        assert (breaker.allow (server, now + 1000));
+        assert (breaker.state (server) == EmailBreaker::State::HALF_OPEN);
+        assert (!breaker.allow (server, now + 1001));
+        breaker.result (server, SmtpError::ServerUnreachable, now + 1100);
+        assert (breaker.state (server) == EmailBreaker::State::OPEN);
+        assert (!breaker.allow (server, now + 2000));
+
+        // test case 03 - successful probe closes it
+        assert (breaker.allow (server, now + 2100));
+        breaker.result (server, SmtpError::Succeeded, now + 2200);
+        assert (breaker.state (server) == EmailBreaker::State::CLOSED);
+        assert (breaker.allow (server, now + 2200));
+
+        // test case 04 - lost probe is replaced after cooldown
+        for (int i = 0; i != 3; i++)
+            breaker.result (server, SmtpError::ServerUnreachable, now + 3000);
+        assert (breaker.allow (server, now + 4000));
+        assert (!breaker.allow (server, now + 4500));
+        assert (breaker.allow (server, now + 5000));
+
+        // test case 05 - released probe is allowed again at once
+        breaker.release (server, now + 5100);
+        assert (breaker.state (server) == EmailBreaker::State::OPEN);
+        assert (breaker.allow (server, now + 5100));
+        assert (breaker.state (server) == EmailBreaker::State::HALF_OPEN);
+        assert (!breaker.allow (server, now + 5200));
+    }
+
+    {
+        // test case 06 - other errors mean the server is reachable
+        EmailBreaker breaker;
+        breaker.policy (2, 1000);
+        breaker.result (server, SmtpError::ServerUnreachable, 0);
+        breaker.result (server, SmtpError::AuthFailed, 0);
+        breaker.result (server, SmtpError::ServerUnreachable, 0);
+        assert (breaker.state (server) == EmailBreaker::State::CLOSED);
+
+        // test case 07 - zero threshold disables the breaker
+        breaker.policy (0, 1000);
+        for (int i = 0; i != 10; i++)
+            breaker.result (server, SmtpError::ServerUnreachable, 0);
+        assert (breaker.allow (server, 0));
+    }
+    //  @end
+
+    printf ("OK\n");
+}
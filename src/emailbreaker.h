@@ -0,0 +1,95 @@
+/*  =========================================================================
+    emailbreaker - Circuit breaker for SMTP servers
+
+    Copyright (C) 2014 - 2020 Eaton
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License along
+    with this program; if not, write to the Free Software Foundation, Inc.,
+    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+    =========================================================================
+*/
+
+#ifndef EMAILBREAKER_H_INCLUDED
+#define EMAILBREAKER_H_INCLUDED
+
+#include <string>
+#include <map>
+
+/**
+ * \class EmailBreaker
+ *
+ * Circuit breaker for each SMTP server (host:port). After threshold of
+ * consecutive connection failures (see smtp_error_is_transient) the breaker
+ * opens and no delivery to that server is attempted for cooldown. Then one
+ * probe delivery is allowed (half open), its success closes the breaker,
+ * failure opens it for another cooldown.
+ */
+class EmailBreaker
+{
+    public:
+        enum class State {
+            CLOSED,     // deliveries are allowed
+            OPEN,       // deliveries fail fast
+            HALF_OPEN   // one probe delivery is in progress
+        };
+
+        EmailBreaker ();
+
+        /**
+         * \brief set breaker policy
+         *
+         * \param threshold     consecutive failures opening the breaker, 0 disables it
+         * \param cooldown      how long is the breaker open (ms)
+         */
+        void policy (int threshold, int64_t cooldown);
+
+        /**
+         * \brief can a delivery to server start now?
+         *
+         * Returns true for the probe when cooldown is over, following
+         * calls return false until the probe finishes.
+         *
+         * \param now   monotonic time in ms (zclock_mono)
+         */
+        bool allow (const std::string& server, int64_t now);
+
+        /**
+         * \brief probe allowed by allow () was not sent after all, next
+         *        allow () returns true for another one
+         */
+        void release (const std::string& server, int64_t now);
+
+        /**
+         * \brief record the result of delivery to server
+         */
+        void result (const std::string& server, SmtpError error, int64_t now);
+
+        State state (const std::string& server) const;
+
+    protected:
+        struct Circuit {
+            State state;
+            int failures;       // consecutive connection failures
+            int64_t since;      // when the state was entered
+        };
+
+        int _threshold;
+        int64_t _cooldown;
+        std::map<std::string, Circuit> _circuits;
+};
+
+//  Self test of this class
+void
+emailbreaker_test (bool verbose);
+
+#endif // EMAILBREAKER_H_INCLUDED
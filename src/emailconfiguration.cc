@@ -26,6 +26,8 @@
 @end
 */
 
+#include <memory>
+#include <mutex>
 #include <fty_common_macros.h>
 #include <fty_common_translation.h>
 #include "fty_email_classes.h"
@@ -35,7 +37,8 @@
  *   { "key" : "{{var1}} alert on {{var2}}\nfrom the rule {{var3}} is active!", "variables" : {"var1" : "__severity__", "var2" : "__assetname__", "var3" : "__rulename__"}}
  * - this JSON is fed into translation_get_translated_text(), which returns (for English language):
  *   "__severity__ alert on __assetname__\nfrom the rule __rulename__ is active!"
- * - replace_tokens() then replaces __string__ patterns with corresponding values
+ * - EmailTemplate compiles it to literals and __string__ tokens, once per language,
+ *   rendering puts corresponding values in place of the tokens
  */
 
 #define BODY_ACTIVE \
@@ -67,151 +70,498 @@ from the rule %s was resolved", \
 
 
 // ----------------------------------------------------------------------------
-// static helper functions
+// compiled templates
 
-static std::string
-replace_tokens (
-        const std::string& text,
-        const std::string& pattern,
-        const std::string& replacement)
+static const struct {
+    const char *name;
+    EmailTemplate::Token token;
+} s_tokens [] = {
+    {"__rulename__", EmailTemplate::Token::RULENAME},
+    {"__assetname__", EmailTemplate::Token::ASSETNAME},
+    {"__priority__", EmailTemplate::Token::PRIORITY},
+    {"__severity__", EmailTemplate::Token::SEVERITY},
+    {"__description__", EmailTemplate::Token::DESCRIPTION},
+    {"__state__", EmailTemplate::Token::STATE},
+};
+
+const size_t EmailTemplate::TOKENS;
+
+EmailTemplate::EmailTemplate (const std::string& text):
+    _segments {},
+    _literal_size {0}
 {
-    std::string result = text;
-    size_t pos = 0;
-    while( ( pos = result.find(pattern, pos) ) != std::string::npos){
-        result.replace(pos, pattern.length(), replacement);
-        pos += replacement.length();
+    std::string literal;
+    for (size_t pos = 0; pos < text.size (); ) {
+        bool found = false;
+        if (text.compare (pos, 2, "__") == 0) {
+            for (const auto& it : s_tokens) {
+                size_t length = strlen (it.name);
+                if (text.compare (pos, length, it.name) == 0) {
+                    if (!literal.empty ())
+                        _segments.push_back (Segment {Token::LITERAL, literal});
+                    _literal_size += literal.size ();
+                    literal.clear ();
+                    _segments.push_back (Segment {it.token, ""});
+                    pos += length;
+                    found = true;
+                    break;
+                }
+            }
+        }
+        if (!found)
+            literal.push_back (text [pos++]);
     }
-    return result;
+    if (!literal.empty ())
+        _segments.push_back (Segment {Token::LITERAL, literal});
+    _literal_size += literal.size ();
 }
 
-static std::string
-s_generateEmailBodyResolved (fty_proto_t *alert, const std::string& extname)
-{
-    char *result_char = translation_get_translated_text (BODY_RESOLVED.c_str ());
-    std::string result(result_char);
-    zstr_free (&result_char); 
-
-    result = replace_tokens (result, "__rulename__", fty_proto_rule (alert));
-    result = replace_tokens (result, "__assetname__", extname);
-    char *description_char = translation_get_translated_text (fty_proto_description (alert));
-    std::string description (description_char);
-    zstr_free (&description_char);
-    result = replace_tokens (result, "__description__", description.c_str ());
+std::string
+EmailTemplate::render (const Values& values) const
+{
+    size_t sizes [TOKENS];
+    size_t size = _literal_size;
+    for (size_t i = 0; i != TOKENS; i++)
+        sizes [i] = values [i] ? strlen (values [i]) : 0;
+    for (const auto& segment : _segments)
+        size += sizes [static_cast <size_t> (segment.token)];
+
+    std::string result;
+    result.reserve (size);
+    for (const auto& segment : _segments) {
+        size_t i = static_cast <size_t> (segment.token);
+        if (segment.token == Token::LITERAL)
+            result += segment.literal;
+        else
+            result.append (values [i] ? values [i] : "", sizes [i]);
+    }
     return result;
 }
 
-static std::string
-s_generateEmailBodyActive (fty_proto_t *alert, const std::string& priority, const std::string& extname)
-{
-    char *result_char = translation_get_translated_text (BODY_ACTIVE.c_str ());
-    std::string result(result_char);
-    zstr_free (&result_char); 
-
-    result = replace_tokens (result, "__rulename__", fty_proto_rule (alert));
-    result = replace_tokens (result, "__assetname__", extname);
-    char *description_char = translation_get_translated_text (fty_proto_description (alert));
-    std::string description (description_char);
-    zstr_free (&description_char);
-    result = replace_tokens (result, "__description__", description.c_str ());
-    result = replace_tokens (result, "__priority__", priority);
-    result = replace_tokens (result, "__severity__", fty_proto_severity (alert));
-    result = replace_tokens (result, "__state__", fty_proto_state (alert));
-    return result;
+bool
+EmailTemplate::uses (Token token) const
+{
+    for (const auto& segment : _segments)
+        if (segment.token == token)
+            return true;
+    return false;
+}
+
+const size_t DescriptionCache::CAPACITY;
+
+DescriptionCache::DescriptionCache (size_t capacity):
+    _capacity {capacity > 0 ? capacity : 1},
+    _lru {},
+    _index {},
+    _hits {0},
+    _misses {0},
+    _mutex {}
+{
+}
+
+std::string
+DescriptionCache::get (
+        const std::string& language,
+        const std::string& description,
+        const std::function<std::string ()>& translate)
+{
+    Key key {language, description};
+    {
+        std::lock_guard<std::mutex> lock (_mutex);
+        auto it = _index.find (key);
+        if (it != _index.end ()) {
+            _lru.splice (_lru.begin (), _lru, it->second);
+            _hits++;
+            return it->second->translated;
+        }
+    }
+
+    std::string translated = translate ();
+
+    std::lock_guard<std::mutex> lock (_mutex);
+    _misses++;
+    if (_index.count (key))
+        return translated;
+    _lru.push_front (Entry {key, translated});
+    _index [key] = _lru.begin ();
+    if (_lru.size () > _capacity) {
+        _index.erase (_lru.back ().key);
+        _lru.pop_back ();
+    }
+    return translated;
+}
+
+void
+DescriptionCache::clear ()
+{
+    std::lock_guard<std::mutex> lock (_mutex);
+    _index.clear ();
+    _lru.clear ();
+}
+
+size_t
+DescriptionCache::size () const
+{
+    std::lock_guard<std::mutex> lock (_mutex);
+    return _lru.size ();
 }
 
+uint64_t
+DescriptionCache::hits () const
+{
+    std::lock_guard<std::mutex> lock (_mutex);
+    return _hits;
+}
+
+uint64_t
+DescriptionCache::misses () const
+{
+    std::lock_guard<std::mutex> lock (_mutex);
+    return _misses;
+}
+
+struct AlertTemplates {
+    std::string language;
+    EmailTemplate body_active;
+    EmailTemplate subject_active;
+    EmailTemplate body_resolved;
+    EmailTemplate subject_resolved;
+};
+
+// languages with compiled templates, templates of others are dropped over it
+#define MAX_LANGUAGES 16
+
+// translation library has one current language, it's switched under the mutex
+static std::mutex s_translation_mutex;
+static std::string s_language = DEFAULT_LANGUAGE;
+// templates are replaced as a whole, email being rendered keeps the old ones
+static std::map<std::string, std::shared_ptr<const AlertTemplates>> s_templates;
+static DescriptionCache s_descriptions;
+
 static std::string
-s_generateEmailSubjectResolved (fty_proto_t *alert, const std::string &extname)
+s_translate (const std::string& json)
 {
-    char *result_char = translation_get_translated_text (SUBJECT_RESOLVED.c_str ());
-    std::string result (result_char);
+    char *result_char = translation_get_translated_text (json.c_str ());
+    std::string result (result_char ? result_char : "");
     zstr_free (&result_char);
-    result = replace_tokens (result, "__rulename__", fty_proto_rule (alert));
-    result = replace_tokens (result, "__assetname__", extname);
     return result;
 }
 
+// call with the mutex held: fn translates in the language, then the current
+// one is restored
+static void
+s_in_language (const std::string& language, const std::function<void ()>& fn)
+{
+    if (language == s_language) {
+        fn ();
+        return;
+    }
+    if (translation_change_language (language.c_str ()) != TE_OK)
+        log_warning ("Language %s not available, using %s", language.c_str (), s_language.c_str ());
+    fn ();
+    translation_change_language (s_language.c_str ());
+}
+
+// call with the mutex held
+static std::shared_ptr<const AlertTemplates>
+s_compile_templates (const std::string& language)
+{
+    std::shared_ptr<const AlertTemplates> templates;
+    s_in_language (language, [&] () {
+        templates = std::make_shared<const AlertTemplates> (AlertTemplates {
+            language,
+            EmailTemplate (s_translate (BODY_ACTIVE)),
+            EmailTemplate (s_translate (SUBJECT_ACTIVE)),
+            EmailTemplate (s_translate (BODY_RESOLVED)),
+            EmailTemplate (s_translate (SUBJECT_RESOLVED))});
+    });
+    return templates;
+}
+
+static std::shared_ptr<const AlertTemplates>
+s_get_templates (const std::string& language)
+{
+    std::lock_guard<std::mutex> lock (s_translation_mutex);
+    std::string key = language.empty () ? s_language : language;
+    auto it = s_templates.find (key);
+    if (it != s_templates.end ())
+        return it->second;
+
+    if (s_templates.size () >= MAX_LANGUAGES) {
+        for (auto it = s_templates.begin (); it != s_templates.end (); ) {
+            if (it->first == s_language)
+                ++it;
+            else
+                it = s_templates.erase (it);
+        }
+    }
+    std::shared_ptr<const AlertTemplates> templates = s_compile_templates (key);
+    s_templates [key] = templates;
+    return templates;
+}
+
 static std::string
-s_generateEmailSubjectActive (fty_proto_t *alert, const std::string& priority, const std::string& extname)
+s_render (
+        const EmailTemplate& email_template,
+        const std::string& language,
+        fty_proto_t *alert,
+        const std::string& priority,
+        const std::string& extname)
 {
-    char *result_char = translation_get_translated_text (SUBJECT_ACTIVE.c_str ());
-    std::string result (result_char);
-    zstr_free (&result_char);
-    result = replace_tokens (result, "__rulename__", fty_proto_rule (alert));
-    result = replace_tokens (result, "__assetname__", extname);
-    char *description_char = translation_get_translated_text (fty_proto_description (alert));
-    std::string description (description_char);
-    zstr_free (&description_char);
-    result = replace_tokens (result, "__description__", description.c_str ());
-    result = replace_tokens (result, "__priority__", priority);
-    result = replace_tokens (result, "__severity__", fty_proto_severity (alert));
-    result = replace_tokens (result, "__state__", fty_proto_state (alert));
-    return result;
+    std::string description;
+    if (email_template.uses (EmailTemplate::Token::DESCRIPTION))
+        description = s_descriptions.get (language, fty_proto_description (alert), [alert, &language] () {
+            std::lock_guard<std::mutex> lock (s_translation_mutex);
+            std::string translated;
+            s_in_language (language, [&] () {
+                translated = s_translate (fty_proto_description (alert));
+            });
+            return translated;
+        });
+
+    EmailTemplate::Values values;
+    values [static_cast <size_t> (EmailTemplate::Token::LITERAL)] = NULL;
+    values [static_cast <size_t> (EmailTemplate::Token::RULENAME)] = fty_proto_rule (alert);
+    values [static_cast <size_t> (EmailTemplate::Token::ASSETNAME)] = extname.c_str ();
+    values [static_cast <size_t> (EmailTemplate::Token::PRIORITY)] = priority.c_str ();
+    values [static_cast <size_t> (EmailTemplate::Token::SEVERITY)] = fty_proto_severity (alert);
+    values [static_cast <size_t> (EmailTemplate::Token::DESCRIPTION)] = description.c_str ();
+    values [static_cast <size_t> (EmailTemplate::Token::STATE)] = fty_proto_state (alert);
+    return email_template.render (values);
 }
 
 // ----------------------------------------------------------------------------
 // header functions
 
+int
+change_language (const char *language)
+{
+    int rv;
+    {
+        std::lock_guard<std::mutex> lock (s_translation_mutex);
+        rv = translation_change_language (language);
+        s_language = rv == TE_OK ? language : DEFAULT_LANGUAGE;
+        s_templates.clear ();
+        s_templates [s_language] = s_compile_templates (s_language);
+    }
+    s_descriptions.clear ();
+    return rv;
+}
+
+void
+compile_templates ()
+{
+    std::lock_guard<std::mutex> lock (s_translation_mutex);
+    s_templates.clear ();
+    s_templates [s_language] = s_compile_templates (s_language);
+}
+
+const DescriptionCache&
+translated_descriptions ()
+{
+    return s_descriptions;
+}
+
+bool
+valid_language (const std::string& language)
+{
+    if (language.empty () || language.size () > 16)
+        return false;
+    for (const char ch : language) {
+        if (!isalnum (ch) && ch != '_' && ch != '-')
+            return false;
+    }
+    return true;
+}
+
 std::string
-generate_body (fty_proto_t *alert, const std::string& priority, const std::string& extname)
+generate_body (fty_proto_t *alert, const std::string& priority, const std::string& extname, const std::string& language)
 {
+    std::shared_ptr<const AlertTemplates> templates = s_get_templates (language);
     if (streq (fty_proto_state (alert), "RESOLVED")) {
-        return s_generateEmailBodyResolved (alert, extname);
+        return s_render (templates->body_resolved, templates->language, alert, priority, extname);
     }
-    return s_generateEmailBodyActive (alert, priority, extname);
+    return s_render (templates->body_active, templates->language, alert, priority, extname);
 }
 
 std::string
-generate_subject (fty_proto_t *alert, const std::string& priority, const std::string& extname)
+generate_subject (fty_proto_t *alert, const std::string& priority, const std::string& extname, const std::string& language)
 {
+    std::shared_ptr<const AlertTemplates> templates = s_get_templates (language);
     if (streq (fty_proto_state (alert), "RESOLVED")) {
-        return s_generateEmailSubjectResolved (alert, extname);
+        return s_render (templates->subject_resolved, templates->language, alert, priority, extname);
     }
-    return s_generateEmailSubjectActive (alert, priority, extname);
+    return s_render (templates->subject_active, templates->language, alert, priority, extname);
 }
 
+// looked up again only when addresses change
+static EmailIpAddr s_ip_addr;
 
 std::string getIpAddr()
 {
-    std::string ipAddr = "From: ";
-    struct ifaddrs * ifAddrStruct = NULL;
-    struct ifaddrs * ifa = NULL;
-    void * tmpAddrPtr = NULL;
-
-    getifaddrs(&ifAddrStruct);
-
-    for (ifa = ifAddrStruct; ifa != NULL; ifa = ifa->ifa_next) {
-        if (!ifa->ifa_addr) {
-            continue;
-        }
-        // Check IP4 address
-        if (ifa->ifa_addr->sa_family == AF_INET) { 
-            tmpAddrPtr=&((struct sockaddr_in *)ifa->ifa_addr)->sin_addr;
-            char addressBuffer[INET_ADDRSTRLEN];
-            inet_ntop(AF_INET, tmpAddrPtr, addressBuffer, INET_ADDRSTRLEN);
-            if (strcmp(ifa->ifa_name, "eth0") == 0 || strcmp(ifa->ifa_name, "LAN1") == 0 )
-            {
-                ipAddr.append(addressBuffer);
-                break;
-            }
-        }
-        
-    }
-    ipAddr += "\r\n";
-    if (ifAddrStruct!=NULL) freeifaddrs(ifAddrStruct);
+    return s_ip_addr.header ();
+}
 
-    return  ipAddr;
+void
+sender_interfaces (const std::string& interfaces)
+{
+    s_ip_addr.interfaces (interfaces);
 }
 
 //  --------------------------------------------------------------------------
 //  Self test of this class
 
+// former rendering, for comparison: the template is translated each time
+// and the text is copied and searched again for each token
+static std::string
+s_replace_tokens (
+        const std::string& text,
+        const std::string& pattern,
+        const std::string& replacement)
+{
+    std::string result = text;
+    size_t pos = 0;
+    while( ( pos = result.find(pattern, pos) ) != std::string::npos){
+        result.replace(pos, pattern.length(), replacement);
+        pos += replacement.length();
+    }
+    return result;
+}
+
+static std::string
+s_replace_active (const std::string& json, fty_proto_t *alert, const std::string& priority, const std::string& extname)
+{
+    std::string result = s_translate (json);
+    result = s_replace_tokens (result, "__rulename__", fty_proto_rule (alert));
+    result = s_replace_tokens (result, "__assetname__", extname);
+    std::string description = s_translate (fty_proto_description (alert));
+    result = s_replace_tokens (result, "__description__", description.c_str ());
+    result = s_replace_tokens (result, "__priority__", priority);
+    result = s_replace_tokens (result, "__severity__", fty_proto_severity (alert));
+    result = s_replace_tokens (result, "__state__", fty_proto_state (alert));
+    return result;
+}
+
 void
 emailconfiguration_test (bool verbose)
 {
     printf (" * emailconfiguration: ");
-    // TODO
-    //  * replace_tokens
-    //  * generate_subject
-    //  * generate_body
+
+    //  @selftest
+    const char *SELFTEST_DIR_RO = "src/selftest-ro";
+    int rv = translation_initialize (FTY_EMAIL_ADDRESS, SELFTEST_DIR_RO, "test_");
+    if (rv != TE_OK)
+        log_warning ("Translation not initialized");
+    change_language (DEFAULT_LANGUAGE);
+
+    {
+        // test case 01 - tokens are replaced in one pass, values are not searched
+        EmailTemplate email_template ("__severity__ alert on __assetname__ (__unknown__)__state__");
+        assert (email_template.uses (EmailTemplate::Token::STATE));
+        assert (!email_template.uses (EmailTemplate::Token::DESCRIPTION));
+        EmailTemplate::Values values {{NULL, "rule", "__state__", "1", "CRITICAL", NULL, "ACTIVE"}};
+        assert (email_template.render (values) == "CRITICAL alert on __state__ (__unknown__)ACTIVE");
+        values [static_cast <size_t> (EmailTemplate::Token::SEVERITY)] = NULL;
+        assert (email_template.render (values) == " alert on __state__ (__unknown__)ACTIVE");
+        assert (EmailTemplate ().render (values) == "");
+    }
+
+    zmsg_t *msg = fty_proto_encode_alert (NULL, 1000, 600, "upsonbattery@ups-1", "ups-1",
+            "ACTIVE", "CRITICAL", "UPS is running on battery", NULL);
+    assert (msg);
+    fty_proto_t *alert = fty_proto_decode (&msg);
+    assert (alert);
+
+    {
+        // test case 02 - compiled templates render the same text as replacing tokens
+        assert (generate_body (alert, "1", "UPS 1") == s_replace_active (BODY_ACTIVE, alert, "1", "UPS 1"));
+        assert (generate_subject (alert, "1", "UPS 1") == s_replace_active (SUBJECT_ACTIVE, alert, "1", "UPS 1"));
+        assert (generate_body (alert, "1", "UPS 1").find ("Asset: UPS 1\n") != std::string::npos);
+
+        // test case 03 - description is translated once
+        uint64_t hits = translated_descriptions ().hits ();
+        uint64_t misses = translated_descriptions ().misses ();
+        generate_body (alert, "2", "UPS 1");
+        generate_body (alert, "3", "UPS 2");
+        assert (translated_descriptions ().hits () == hits + 2);
+        assert (translated_descriptions ().misses () == misses);
+
+        // test case 04 - and again after language changes
+        change_language (DEFAULT_LANGUAGE);
+        assert (translated_descriptions ().size () == 0);
+        generate_body (alert, "1", "UPS 1");
+        assert (translated_descriptions ().misses () == misses + 1);
+    }
+
+    {
+        // test case 05 - email in other language, the current one stays
+        std::string body = generate_body (alert, "1", "UPS 1", "cs_CZ");
+        assert (body.find ("Zdrojové pravidlo: upsonbattery@ups-1\n") != std::string::npos);
+        assert (body.find ("Popis alarmu: UPS is running on battery\n") != std::string::npos);
+        assert (generate_body (alert, "1", "UPS 1") == s_replace_active (BODY_ACTIVE, alert, "1", "UPS 1"));
+        assert (generate_body (alert, "1", "UPS 1", DEFAULT_LANGUAGE) == s_replace_active (BODY_ACTIVE, alert, "1", "UPS 1"));
+
+        // test case 06 - its templates and descriptions are kept too
+        uint64_t hits = translated_descriptions ().hits ();
+        assert (generate_body (alert, "1", "UPS 1", "cs_CZ") == body);
+        assert (translated_descriptions ().hits () == hits + 1);
+        assert (generate_subject (alert, "1", "UPS 1", "cs_CZ") == "CRITICAL alarm na UPS 1\nz pravidla upsonbattery@ups-1 je aktivní!");
+
+        // test case 07 - unknown language falls back to the current one
+        assert (generate_body (alert, "1", "UPS 1", "xx_XX") == generate_body (alert, "1", "UPS 1"));
+        assert (valid_language ("en_US"));
+        assert (valid_language ("cs-CZ"));
+        assert (!valid_language (""));
+        assert (!valid_language ("../../etc/passwd"));
+    }
+
+    {
+        // test case 08 - least recently used descriptions are dropped
+        DescriptionCache descriptions (2);
+        int translated = 0;
+        auto translate = [&translated] () { return std::to_string (++translated); };
+        assert (descriptions.get ("en_US", "a", translate) == "1");
+        assert (descriptions.get ("cs_CZ", "a", translate) == "2");
+        assert (descriptions.get ("en_US", "a", translate) == "1");
+        assert (descriptions.get ("en_US", "b", translate) == "3");
+        assert (descriptions.get ("en_US", "a", translate) == "1");
+        assert (descriptions.get ("cs_CZ", "a", translate) == "4");
+        assert (descriptions.size () == 2);
+        assert (descriptions.hits () == 2);
+        assert (descriptions.misses () == 4);
+        descriptions.clear ();
+        assert (descriptions.size () == 0);
+    }
+
+    {
+        // benchmark - alert email rendering before and after templates were compiled
+        // and descriptions cached
+        const int count = verbose ? 100000 : 10000;
+        size_t length = 0;
+        int64_t start = zclock_usecs ();
+        for (int i = 0; i != count; i++) {
+            length += s_replace_active (BODY_ACTIVE, alert, "1", "UPS 1").size ();
+            length += s_replace_active (SUBJECT_ACTIVE, alert, "1", "UPS 1").size ();
+        }
+        int64_t before = zclock_usecs () - start;
+
+        start = zclock_usecs ();
+        for (int i = 0; i != count; i++) {
+            length -= generate_body (alert, "1", "UPS 1").size ();
+            length -= generate_subject (alert, "1", "UPS 1").size ();
+        }
+        int64_t after = zclock_usecs () - start;
+        assert (length == 0);
+
+        double before_ns = before * 1000.0 / count;
+        double after_ns = after * 1000.0 / count;
+        log_info ("template benchmark: body and subject in %.0f ns before, %.0f ns compiled", before_ns, after_ns);
+        if (verbose)
+            printf ("\n   body and subject: replace_tokens %8.0f ns, compiled %8.0f ns\n * emailconfiguration: ", before_ns, after_ns);
+    }
+
+    fty_proto_destroy (&alert);
+    //  @end
+
     printf ("OK\n");
 }
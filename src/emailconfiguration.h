@@ -22,16 +22,173 @@
 #ifndef EMAILCONFIGURATION_H_INCLUDED
 #define EMAILCONFIGURATION_H_INCLUDED
 
+#include <array>
+#include <functional>
+#include <list>
+#include <map>
+#include <mutex>
 #include <string>
+#include <vector>
 
+/**
+ * \class EmailTemplate
+ *
+ * Translated alert template compiled to literals and __token__ placeholders,
+ * rendered in one pass to the buffer of the final size. Text of values is
+ * not searched for tokens.
+ */
+class EmailTemplate
+{
+    public:
+        enum class Token {
+            LITERAL,
+            RULENAME,
+            ASSETNAME,
+            PRIORITY,
+            SEVERITY,
+            DESCRIPTION,
+            STATE
+        };
+        static const size_t TOKENS = 7;
+
+        // values indexed by Token, NULL renders as empty
+        typedef std::array<const char*, TOKENS> Values;
+
+        explicit EmailTemplate (const std::string& text = "");
+
+        std::string render (const Values& values) const;
+
+        // is the token in the template?
+        bool uses (Token token) const;
+
+    protected:
+        struct Segment {
+            Token token;
+            std::string literal;
+        };
+
+        std::vector<Segment> _segments;
+        size_t _literal_size;       // of all literals
+};
+
+/**
+ * \class DescriptionCache
+ *
+ * Translated alert descriptions. Description is JSON translation key, the
+ * same few hundred of them come again and again, so translations are kept
+ * by language and key, the least recently used are dropped when capacity
+ * is reached.
+ */
+class DescriptionCache
+{
+    public:
+        static const size_t CAPACITY = 1024;
+
+        explicit DescriptionCache (size_t capacity = CAPACITY);
+
+        /**
+         * \brief translated description, translate is called on a miss
+         */
+        std::string get (
+                const std::string& language,
+                const std::string& description,
+                const std::function<std::string ()>& translate);
+
+        void clear ();
+
+        size_t size () const;
+        uint64_t hits () const;
+        uint64_t misses () const;
+
+    protected:
+        typedef std::pair<std::string, std::string> Key;    // language, description
+
+        struct Entry {
+            Key key;
+            std::string translated;
+        };
+
+        size_t _capacity;
+        std::list<Entry> _lru;                              // most recently used first
+        std::map<Key, std::list<Entry>::iterator> _index;
+        uint64_t _hits;
+        uint64_t _misses;
+        mutable std::mutex _mutex;
+
+    private:
+        DescriptionCache (const DescriptionCache&) = delete;
+        DescriptionCache& operator= (const DescriptionCache&) = delete;
+};
+
+/**
+ * \brief change language of translations (translation_change_language)
+ *
+ * Alert templates are compiled for the language and translated descriptions
+ * of the previous one are dropped.
+ *
+ * \return TE_OK or error of translation_change_language, default language
+ *         is used then
+ */
+int
+change_language (const char *language);
+
+/**
+ * \brief translate and compile alert templates for the current language
+ *
+ * Templates of other languages are dropped and compiled again on their
+ * first use.
+ */
+void
+compile_templates ();
+
+/**
+ * \brief is it a language name (en_US, cs-CZ, ...)?
+ */
+bool
+valid_language (const std::string& language);
+
+/**
+ * \brief cache of translated alert descriptions
+ */
+const DescriptionCache&
+translated_descriptions ();
+
+/**
+ * \brief body and subject of alert email
+ *
+ * Templates and translated descriptions are kept for each language, so
+ * translations of other than the current language are loaded only on
+ * a miss.
+ *
+ * \param language    language of the email, empty for the current one
+ */
 std::string
-generate_body (fty_proto_t *alert, const std::string& priority, const std::string& extname);
+generate_body (
+        fty_proto_t *alert,
+        const std::string& priority,
+        const std::string& extname,
+        const std::string& language = "");
 
 std::string
-generate_subject (fty_proto_t *alert, const std::string& priority, const std::string& extname);
+generate_subject (
+        fty_proto_t *alert,
+        const std::string& priority,
+        const std::string& extname,
+        const std::string& language = "");
 
+/**
+ * \brief "From: $address\r\n" line with IPv4 address of the first of
+ *        interfaces which has one
+ */
 std::string getIpAddr ();
 
+/**
+ * \brief set comma separated names of interfaces for getIpAddr,
+ *        in order of preference, default "eth0, LAN1"
+ */
+void
+sender_interfaces (const std::string& interfaces);
+
 void
 emailconfiguration_test (bool verbose);
 
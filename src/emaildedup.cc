@@ -0,0 +1,123 @@
+/*  =========================================================================
+    emaildedup - Suppression of duplicate alerts
+
+    Copyright (C) 2014 - 2020 Eaton
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License along
+    with this program; if not, write to the Free Software Foundation, Inc.,
+    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+    =========================================================================
+*/
+
+
+/*
+@header
+    emaildedup - Suppression of duplicate alerts
+@discuss
+    Alert agents publish the alert again on every evaluation, restart or
+    reconnect. Only the first notification within the window is sent.
+@end
+*/
+
+#include "fty_email_classes.h"
+
+EmailDedup::EmailDedup ():
+    _window {0},
+    _seen {},
+    _order {},
+    _suppressed {0}
+{
+}
+
+void
+EmailDedup::window (int64_t window)
+{
+    _window = window;
+    if (_window <= 0) {
+        _seen.clear ();
+        _order.clear ();
+    }
+}
+
+void
+EmailDedup::expire (int64_t now)
+{
+    while (!_order.empty () && now - _order.front ().first >= _window) {
+        auto it = _seen.find (_order.front ().second);
+        // newer notification of the alert is in the queue later
+        if (it != _seen.end () && it->second.since == _order.front ().first)
+            _seen.erase (it);
+        _order.pop_front ();
+    }
+}
+
+bool
+EmailDedup::duplicate (const std::string& alert, const std::string& fingerprint, int64_t now)
+{
+    if (_window <= 0)
+        return false;
+
+    expire (now);
+    auto it = _seen.find (alert);
+    if (it != _seen.end () && it->second.fingerprint == fingerprint) {
+        _suppressed++;
+        return true;
+    }
+
+    _seen [alert] = Seen {fingerprint, now};
+    _order.push_back (std::make_pair (now, alert));
+    return false;
+}
+
+//  --------------------------------------------------------------------------
+//  Self test of this class
+
+void
+emaildedup_test (bool verbose)
+{
+    printf (" * emaildedup: ");
+
+    //  @selftest
+    {
+        // test case 01 - same notification within window is a duplicate
+        EmailDedup dedup;
+        dedup.window (1000);
+        assert (!dedup.duplicate ("rule@asset", "ACTIVE/CRITICAL", 0));
+        assert (dedup.duplicate ("rule@asset", "ACTIVE/CRITICAL", 500));
+        assert (!dedup.duplicate ("rule@asset2", "ACTIVE/CRITICAL", 500));
+        assert (dedup.suppressed () == 1);
+
+        // test case 02 - and it's sent again after the window
+        assert (!dedup.duplicate ("rule@asset", "ACTIVE/CRITICAL", 1000));
+        assert (dedup.duplicate ("rule@asset", "ACTIVE/CRITICAL", 1999));
+
+        // test case 03 - change of state or severity is not a duplicate
+        assert (!dedup.duplicate ("rule@asset", "ACTIVE/WARNING", 2000));
+        assert (!dedup.duplicate ("rule@asset", "RESOLVED/WARNING", 2100));
+        assert (!dedup.duplicate ("rule@asset", "ACTIVE/WARNING", 2200));
+        assert (dedup.duplicate ("rule@asset", "ACTIVE/WARNING", 2300));
+
+        // test case 04 - old notifications are forgotten
+        assert (!dedup.duplicate ("rule@asset3", "ACTIVE/CRITICAL", 5000));
+        assert (dedup.size () == 1);
+
+        // test case 05 - zero window disables it
+        dedup.window (0);
+        assert (dedup.size () == 0);
+        assert (!dedup.duplicate ("rule@asset3", "ACTIVE/CRITICAL", 5000));
+        assert (!dedup.duplicate ("rule@asset3", "ACTIVE/CRITICAL", 5000));
+    }
+    //  @end
+
+    printf ("OK\n");
+}
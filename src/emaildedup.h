@@ -0,0 +1,82 @@
+/*  =========================================================================
+    emaildedup - Suppression of duplicate alerts
+
+    Copyright (C) 2014 - 2020 Eaton
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License along
+    with this program; if not, write to the Free Software Foundation, Inc.,
+    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+    =========================================================================
+*/
+
+
+#ifndef EMAILDEDUP_H_INCLUDED
+#define EMAILDEDUP_H_INCLUDED
+
+#include <deque>
+#include <map>
+#include <string>
+
+/**
+ * \class EmailDedup
+ *
+ * Remembers the last notification of each alert (rule, asset and contact).
+ * Notification with the same state and severity within the window after it
+ * is a duplicate, e.g. alert published again without any change.
+ */
+class EmailDedup
+{
+    public:
+        EmailDedup ();
+
+        /**
+         * \param window    duplicates are suppressed for (ms), 0 disables it
+         */
+        void window (int64_t window);
+
+        /**
+         * \brief is it a duplicate of the last notification of alert?
+         *
+         * Notification which is not a duplicate is remembered.
+         *
+         * \param alert         identity of the alert
+         * \param fingerprint   what makes notifications same (state, severity)
+         * \param now           monotonic time in ms (zclock_mono)
+         */
+        bool duplicate (const std::string& alert, const std::string& fingerprint, int64_t now);
+
+        size_t size () const { return _seen.size (); };
+
+        // number of suppressed duplicates
+        uint64_t suppressed () const { return _suppressed; };
+
+    protected:
+        struct Seen {
+            std::string fingerprint;
+            int64_t since;
+        };
+
+        void expire (int64_t now);
+
+        int64_t _window;
+        std::map<std::string, Seen> _seen;
+        // (since, alert) in order of since, to forget old notifications
+        std::deque<std::pair<int64_t, std::string>> _order;
+        uint64_t _suppressed;
+};
+
+//  Self test of this class
+void
+emaildedup_test (bool verbose);
+
+#endif // EMAILDEDUP_H_INCLUDED
@@ -0,0 +1,260 @@
+/*  =========================================================================
+    emaildigest - Digest of alerts sent to one contact
+
+    Copyright (C) 2014 - 2020 Eaton
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License along
+    with this program; if not, write to the Free Software Foundation, Inc.,
+    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+    =========================================================================
+*/
+
+
+/*
+@header
+    emaildigest - Digest of alerts sent to one contact
+@discuss
+    During alert storm a contact watching many assets gets an email for each
+    of them, which hits rate limits of smtp relays. Digest sends one email
+    per contact and window instead.
+
+    Subject is the subject of the first alert with the number of others, body
+    is the body of each alert, separated by a line.
+@end
+*/
+
+#include "fty_email_classes.h"
+
+#define DIGEST_SEPARATOR "\n\n----------------------------------------\n\n"
+
+EmailDigest::EmailDigest ():
+    _window {0},
+    _max {100},
+    _batches {},
+    _size {0},
+    _alerts {0},
+    _emails {0}
+{
+}
+
+EmailDigest::~EmailDigest ()
+{
+    for (auto& it : _batches)
+        for (auto job : it.second.jobs)
+            delete job;
+}
+
+void
+EmailDigest::policy (int64_t window, size_t max)
+{
+    _window = window;
+    _max = max > 0 ? max : 1;
+}
+
+void
+EmailDigest::add (const std::string& key, EmailJob *job, int64_t now)
+{
+    auto it = _batches.find (key);
+    if (it == _batches.end ())
+        it = _batches.insert (std::make_pair (key, Batch {now + _window, {}})).first;
+    Batch& batch = it->second;
+    batch.jobs.push_back (job);
+    if (batch.jobs.size () >= _max)
+        batch.deadline = now;
+    _size++;
+    _alerts++;
+}
+
+std::vector<EmailJob*>
+EmailDigest::expired (int64_t now)
+{
+    std::vector<EmailJob*> jobs;
+    for (auto it = _batches.begin (); it != _batches.end (); ) {
+        if (_window > 0 && it->second.deadline > now) {
+            ++it;
+            continue;
+        }
+        _size -= it->second.jobs.size ();
+        jobs.push_back (merge (it->second.jobs));
+        _emails++;
+        it = _batches.erase (it);
+    }
+    return jobs;
+}
+
+int
+EmailDigest::timeout (int64_t now) const
+{
+    if (_batches.empty ())
+        return -1;
+    if (_window <= 0)
+        return 0;
+    int64_t deadline = _batches.begin ()->second.deadline;
+    for (const auto& it : _batches)
+        if (it.second.deadline < deadline)
+            deadline = it.second.deadline;
+    return deadline > now ? static_cast <int> (deadline - now) : 0;
+}
+
+EmailJob *
+EmailDigest::merge (std::vector<EmailJob*>& jobs)
+{
+    assert (!jobs.empty ());
+    if (jobs.size () == 1) {
+        EmailJob *job = jobs [0];
+        jobs.clear ();
+        return job;
+    }
+
+    // the first alert carries the digest, it may be a digest already
+    EmailJob *job = jobs [0];
+    std::string count = " (+" + std::to_string (job->merged.size ()) + " more)";
+    if (!job->merged.empty ()
+    &&  job->subject.size () >= count.size ()
+    &&  job->subject.compare (job->subject.size () - count.size (), count.size (), count) == 0)
+        job->subject.erase (job->subject.size () - count.size ());
+    for (size_t i = 1; i != jobs.size (); i++) {
+        EmailJob *alert = jobs [i];
+        job->body += DIGEST_SEPARATOR;
+        job->body += alert->body;
+        if (alert->priority < job->priority)
+            job->priority = alert->priority;
+        // alert may be a digest already
+        for (auto other : alert->merged)
+            job->merged.push_back (other);
+        alert->merged.clear ();
+        job->merged.push_back (alert);
+    }
+    job->subject += " (+" + std::to_string (job->merged.size ()) + " more)";
+    // newer state of the first alert must not supersede the others in queue
+    job->alert.clear ();
+    jobs.clear ();
+    return job;
+}
+
+//  --------------------------------------------------------------------------
+//  Self test of this class
+
+static EmailJob *
+s_alert (const char *uuid, int priority, const char *to)
+{
+    EmailJob *job = new EmailJob ();
+    job->type = EmailJob::Type::SENDMAIL_ALERT;
+    job->uuid = uuid;
+    job->priority = priority;
+    job->to = to;
+    job->subject = std::string ("Alert ") + uuid;
+    job->body = std::string ("Body ") + uuid;
+    return job;
+}
+
+void
+emaildigest_test (bool verbose)
+{
+    printf (" * emaildigest: ");
+
+    //  @selftest
+    {
+        // test case 01 - alerts for one contact are merged when window closes
+        EmailDigest digest;
+        digest.policy (1000);
+        int64_t now = 0;
+        assert (digest.timeout (now) == -1);
+        digest.add ("joe@example.com\nen_US", s_alert ("1", 3, "joe@example.com"), now);
+        digest.add ("jane@example.com\nen_US", s_alert ("2", 4, "jane@example.com"), now + 100);
+        digest.add ("joe@example.com\nen_US", s_alert ("3", 2, "joe@example.com"), now + 200);
+        digest.add ("joe@example.com\nen_US", s_alert ("4", 5, "joe@example.com"), now + 300);
+        assert (digest.size () == 4);
+        assert (digest.timeout (now + 500) == 500);
+        assert (digest.expired (now + 999).empty ());
+
+        std::vector<EmailJob*> jobs = digest.expired (now + 1000);
+        assert (jobs.size () == 1);
+        EmailJob *job = jobs [0];
+        assert (job->to == "joe@example.com");
+        assert (job->subject == "Alert 1 (+2 more)");
+        assert (job->body == "Body 1" DIGEST_SEPARATOR "Body 3" DIGEST_SEPARATOR "Body 4");
+        assert (job->priority == 2);
+        assert (job->uuid == "1");
+        assert (job->merged.size () == 2);
+        assert (job->merged [0]->uuid == "3");
+        assert (digest.size () == 1);
+        delete job;
+
+        // test case 02 - single alert is sent as is
+        jobs = digest.expired (now + 1100);
+        assert (jobs.size () == 1);
+        assert (jobs [0]->uuid == "2");
+        assert (jobs [0]->subject == "Alert 2");
+        assert (jobs [0]->merged.empty ());
+        delete jobs [0];
+        assert (digest.size () == 0);
+        assert (digest.alerts () == 4);
+        assert (digest.emails () == 2);
+    }
+
+    {
+        // test case 03 - full digest is closed early
+        EmailDigest digest;
+        digest.policy (1000, 3);
+        for (int i = 0; i != 4; i++)
+            digest.add ("joe", s_alert (std::to_string (i).c_str (), 3, "joe@example.com"), 0);
+        assert (digest.timeout (0) == 0);
+        std::vector<EmailJob*> jobs = digest.expired (0);
+        assert (jobs.size () == 1);
+        assert (jobs [0]->merged.size () == 3);
+        delete jobs [0];
+
+        // test case 04 - zero window closes all digests
+        digest.add ("joe", s_alert ("5", 3, "joe@example.com"), 0);
+        digest.add ("jane", s_alert ("6", 3, "jane@example.com"), 0);
+        digest.policy (0);
+        assert (digest.timeout (0) == 0);
+        jobs = digest.expired (0);
+        assert (jobs.size () == 2);
+        for (auto job : jobs)
+            delete job;
+
+        // test case 05 - digest can be added to another digest
+        digest.add ("joe", s_alert ("8", 3, "joe@example.com"), 0);
+        digest.add ("joe", s_alert ("9", 3, "joe@example.com"), 0);
+        digest.policy (0);
+        jobs = digest.expired (0);
+        assert (jobs.size () == 1);
+        digest.policy (1000);
+        digest.add ("joe", s_alert ("10", 3, "joe@example.com"), 0);
+        digest.add ("joe", jobs [0], 0);
+        jobs = digest.expired (1000);
+        assert (jobs.size () == 1);
+        assert (jobs [0]->uuid == "10");
+        assert (jobs [0]->merged.size () == 2);
+        assert (jobs [0]->subject == "Alert 10 (+2 more)");
+
+        // test case 06 - digest carrying another digest counts all alerts once
+        digest.add ("joe", jobs [0], 0);
+        digest.add ("joe", s_alert ("11", 3, "joe@example.com"), 0);
+        jobs = digest.expired (2000);
+        assert (jobs.size () == 1);
+        assert (jobs [0]->uuid == "10");
+        assert (jobs [0]->merged.size () == 3);
+        assert (jobs [0]->subject == "Alert 10 (+3 more)");
+        delete jobs [0];
+
+        // test case 07 - waiting jobs are deleted with the digest
+        digest.policy (1000);
+        digest.add ("joe", s_alert ("7", 3, "joe@example.com"), 0);
+    }
+    //  @end
+
+    printf ("OK\n");
+}
@@ -0,0 +1,108 @@
+/*  =========================================================================
+    emaildigest - Digest of alerts sent to one contact
+
+    Copyright (C) 2014 - 2020 Eaton
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License along
+    with this program; if not, write to the Free Software Foundation, Inc.,
+    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+    =========================================================================
+*/
+
+
+#ifndef EMAILDIGEST_H_INCLUDED
+#define EMAILDIGEST_H_INCLUDED
+
+#include <map>
+#include <string>
+#include <vector>
+
+struct EmailJob;
+
+/**
+ * \class EmailDigest
+ *
+ * Alerts for one contact (and language) coming within the window are
+ * combined into one email. The window starts with the first alert, when it
+ * closes, the alerts are merged to the first one, which answers all of them.
+ * Digest of max alerts is closed earlier.
+ */
+class EmailDigest
+{
+    public:
+        EmailDigest ();
+
+        /**
+         * \brief jobs still waiting are deleted
+         */
+        ~EmailDigest ();
+
+        /**
+         * \param window    how long to collect alerts (ms), 0 closes all digests
+         * \param max       max number of alerts in one digest
+         */
+        void policy (int64_t window, size_t max = 100);
+
+        int64_t window () const { return _window; };
+
+        /**
+         * \brief add alert job to the digest of key, digest owns it
+         *
+         * \param now   monotonic time in ms (zclock_mono)
+         */
+        void add (const std::string& key, EmailJob *job, int64_t now);
+
+        /**
+         * \brief return jobs for closed digests, caller owns them
+         */
+        std::vector<EmailJob*> expired (int64_t now);
+
+        /**
+         * \brief ms until the next digest closes, -1 if there is none
+         */
+        int timeout (int64_t now) const;
+
+        /**
+         * \brief merge alert jobs to the first one, which takes ownership of others
+         */
+        static EmailJob *merge (std::vector<EmailJob*>& jobs);
+
+        size_t size () const { return _size; };
+
+        // alerts put to digests and emails made of them
+        uint64_t alerts () const { return _alerts; };
+        uint64_t emails () const { return _emails; };
+
+    protected:
+        struct Batch {
+            int64_t deadline;
+            std::vector<EmailJob*> jobs;
+        };
+
+        int64_t _window;
+        size_t _max;
+        std::map<std::string, Batch> _batches;
+        size_t _size;
+        uint64_t _alerts;
+        uint64_t _emails;
+
+    private:
+        EmailDigest (const EmailDigest&) = delete;
+        EmailDigest& operator= (const EmailDigest&) = delete;
+};
+
+//  Self test of this class
+void
+emaildigest_test (bool verbose);
+
+#endif // EMAILDIGEST_H_INCLUDED
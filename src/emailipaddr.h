@@ -0,0 +1,81 @@
+/*  =========================================================================
+    emailipaddr - Sender IP address refreshed on address changes
+
+    Copyright (C) 2014 - 2020 Eaton
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License along
+    with this program; if not, write to the Free Software Foundation, Inc.,
+    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+    =========================================================================
+*/
+
+
+#ifndef EMAILIPADDR_H_INCLUDED
+#define EMAILIPADDR_H_INCLUDED
+
+#include <mutex>
+#include <string>
+#include <vector>
+
+/**
+ * \class EmailIpAddr
+ *
+ * "From: $address" line put to each email, IPv4 address of the first of
+ * configured interfaces. The address is looked up once and again only
+ * after the kernel announces change of addresses (netlink RTM_NEWADDR or
+ * RTM_DELADDR), e.g. on DHCP renewal. Announcements are read without
+ * waiting when the line is asked for.
+ *
+ * Without netlink, the address is looked up each time. Thread safe.
+ */
+class EmailIpAddr
+{
+    public:
+        explicit EmailIpAddr (const std::string& interfaces = "eth0, LAN1");
+
+        ~EmailIpAddr ();
+
+        /**
+         * \brief set comma separated names of interfaces, in order of preference
+         */
+        void interfaces (const std::string& interfaces);
+
+        /**
+         * \brief "From: $address\r\n", address is empty if no interface has one
+         */
+        std::string header ();
+
+        // number of address lookups
+        uint64_t refreshes () const;
+
+    protected:
+        bool changed ();
+        void refresh ();
+
+        std::vector<std::string> _interfaces;
+        int _netlink;           // socket, -1 if not opened yet, -2 if it can't be
+        bool _stale;
+        std::string _header;
+        uint64_t _refreshes;
+        mutable std::mutex _mutex;
+
+    private:
+        EmailIpAddr (const EmailIpAddr&) = delete;
+        EmailIpAddr& operator= (const EmailIpAddr&) = delete;
+};
+
+//  Self test of this class
+void
+emailipaddr_test (bool verbose);
+
+#endif // EMAILIPADDR_H_INCLUDED
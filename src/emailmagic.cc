@@ -0,0 +1,252 @@
+/*  =========================================================================
+    emailmagic - Cache of MIME types of attachments
+
+    Copyright (C) 2014 - 2020 Eaton
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License along
+    with this program; if not, write to the Free Software Foundation, Inc.,
+    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+    =========================================================================
+*/
+
+
+/*
+@header
+    emailmagic - Cache of MIME types of attachments
+@discuss
+    libmagic opens and reads each file it's asked about, while reports and
+    exports attach the same files again and again. stat() is enough to find
+    out the file did not change since it was sniffed.
+@end
+*/
+
+#include "fty_email_classes.h"
+
+#include <sys/stat.h>
+
+const size_t EmailMagic::CAPACITY;
+
+// formats libmagic would tell anyway, text types are left to libmagic,
+// which finds out their charset
+static const struct {
+    const char *extension;
+    const char *type;
+} s_extensions [] = {
+    {"pdf", "application/pdf; charset=binary"},
+    {"zip", "application/zip; charset=binary"},
+    {"gz", "application/gzip; charset=binary"},
+    {"tgz", "application/gzip; charset=binary"},
+    {"bz2", "application/x-bzip2; charset=binary"},
+    {"xz", "application/x-xz; charset=binary"},
+    {"7z", "application/x-7z-compressed; charset=binary"},
+    {"tar", "application/x-tar; charset=binary"},
+    {"png", "image/png; charset=binary"},
+    {"jpg", "image/jpeg; charset=binary"},
+    {"jpeg", "image/jpeg; charset=binary"},
+    {"gif", "image/gif; charset=binary"},
+    {"xlsx", "application/vnd.openxmlformats-officedocument.spreadsheetml.sheet; charset=binary"},
+    {"docx", "application/vnd.openxmlformats-officedocument.wordprocessingml.document; charset=binary"},
+};
+
+bool
+EmailMagic::Key::operator< (const Key& other) const
+{
+    if (dev != other.dev)
+        return dev < other.dev;
+    if (ino != other.ino)
+        return ino < other.ino;
+    if (size != other.size)
+        return size < other.size;
+    return mtime < other.mtime;
+}
+
+EmailMagic::EmailMagic (size_t capacity):
+    _capacity {capacity > 0 ? capacity : 1},
+    _lru {},
+    _index {},
+    _extensions {0},
+    _hits {0},
+    _misses {0},
+    _mutex {}
+{
+}
+
+const char *
+EmailMagic::by_extension (const std::string& path)
+{
+    size_t dot = path.rfind ('.');
+    if (dot == std::string::npos || path.find ('/', dot) != std::string::npos)
+        return NULL;
+    std::string extension = path.substr (dot + 1);
+    for (auto& ch : extension)
+        ch = tolower (ch);
+    for (const auto& it : s_extensions) {
+        if (extension == it.extension)
+            return it.type;
+    }
+    return NULL;
+}
+
+std::string
+EmailMagic::type (magic_t magic, const std::string& path)
+{
+    const char *known = by_extension (path);
+    if (known) {
+        std::lock_guard<std::mutex> lock (_mutex);
+        _extensions++;
+        return known;
+    }
+
+    // only regular files can be told by stat
+    struct stat st;
+    bool cacheable = stat (path.c_str (), &st) == 0 && S_ISREG (st.st_mode);
+    Key key {0, 0, 0, 0};
+    if (cacheable) {
+        key = Key {st.st_dev, st.st_ino, st.st_size,
+            static_cast <int64_t> (st.st_mtim.tv_sec) * 1000000000 + st.st_mtim.tv_nsec};
+        std::lock_guard<std::mutex> lock (_mutex);
+        auto it = _index.find (key);
+        if (it != _index.end ()) {
+            _lru.splice (_lru.begin (), _lru, it->second);
+            _hits++;
+            return it->second->type;
+        }
+    }
+
+    // sniffed without the lock, each thread has its own cookie
+    const char *sniffed = magic_file (magic, path.c_str ());
+    std::string type = sniffed ? sniffed : "";
+
+    std::lock_guard<std::mutex> lock (_mutex);
+    _misses++;
+    if (!cacheable || type.empty () || _index.count (key))
+        return type;
+    _lru.push_front (Entry {key, type});
+    _index [key] = _lru.begin ();
+    if (_lru.size () > _capacity) {
+        _index.erase (_lru.back ().key);
+        _lru.pop_back ();
+    }
+    return type;
+}
+
+size_t
+EmailMagic::size () const
+{
+    std::lock_guard<std::mutex> lock (_mutex);
+    return _lru.size ();
+}
+
+uint64_t
+EmailMagic::extensions () const
+{
+    std::lock_guard<std::mutex> lock (_mutex);
+    return _extensions;
+}
+
+uint64_t
+EmailMagic::hits () const
+{
+    std::lock_guard<std::mutex> lock (_mutex);
+    return _hits;
+}
+
+uint64_t
+EmailMagic::misses () const
+{
+    std::lock_guard<std::mutex> lock (_mutex);
+    return _misses;
+}
+
+//  --------------------------------------------------------------------------
+//  Self test of this class
+
+static void
+s_write_file (const std::string& path, const std::string& content)
+{
+    FILE *f = fopen (path.c_str (), "w");
+    assert (f);
+    assert (fwrite (content.data (), 1, content.size (), f) == content.size ());
+    fclose (f);
+}
+
+void
+emailmagic_test (bool verbose)
+{
+    printf (" * emailmagic: ");
+
+    //  @selftest
+    const char *SELFTEST_DIR_RW = "src/selftest-rw";
+    std::string csv = std::string (SELFTEST_DIR_RW) + "/emailmagic.csv";
+    std::string log = std::string (SELFTEST_DIR_RW) + "/emailmagic.log";
+    std::string pdf = std::string (SELFTEST_DIR_RW) + "/emailmagic.PDF";
+
+    magic_t magic = magic_open (MAGIC_MIME | MAGIC_ERROR | MAGIC_NO_CHECK_COMPRESS | MAGIC_NO_CHECK_TAR);
+    assert (magic);
+    assert (magic_load (magic, NULL) == 0);
+    {
+        // test case 01 - known binary extension does not need the file
+        EmailMagic types;
+        assert (streq (EmailMagic::by_extension ("/tmp/report.tar.gz"), "application/gzip; charset=binary"));
+        assert (EmailMagic::by_extension ("/tmp/report.txt") == NULL);
+        assert (EmailMagic::by_extension ("/tmp/dir.pdf/report") == NULL);
+        assert (types.type (magic, pdf) == "application/pdf; charset=binary");
+        assert (types.extensions () == 1);
+        assert (types.misses () == 0);
+
+        // test case 02 - file is sniffed once until it changes
+        s_write_file (csv, "asset,state\nups-1,ACTIVE\n");
+        std::string type = types.type (magic, csv);
+        assert (type.compare (0, 5, "text/") == 0);
+        assert (types.type (magic, csv) == type);
+        assert (types.misses () == 1);
+        assert (types.hits () == 1);
+
+        s_write_file (csv, "\x89PNG\r\n\x1a\n");
+        assert (types.type (magic, csv) != type);
+        assert (types.misses () == 2);
+
+        // test case 03 - missing file is not cached
+        zsys_file_delete ("%s", log.c_str ());
+        assert (types.type (magic, log).empty ());
+        assert (types.type (magic, log).empty ());
+        assert (types.misses () == 4);
+        assert (types.size () == 2);
+    }
+
+    {
+        // test case 04 - the least recently used type is dropped
+        EmailMagic types (2);
+        s_write_file (csv, "asset,state\n");
+        s_write_file (log, "started\n");
+        std::string other = std::string (SELFTEST_DIR_RW) + "/emailmagic.txt";
+        s_write_file (other, "other\n");
+        types.type (magic, csv);
+        types.type (magic, log);
+        types.type (magic, csv);
+        types.type (magic, other);
+        assert (types.size () == 2);
+        assert (types.misses () == 3);
+        types.type (magic, csv);
+        assert (types.hits () == 2);
+        types.type (magic, log);
+        assert (types.misses () == 4);
+        zsys_file_delete ("%s", other.c_str ());
+    }
+    magic_close (magic);
+    zsys_file_delete ("%s", csv.c_str ());
+    zsys_file_delete ("%s", log.c_str ());
+    //  @end
+
+    printf ("OK\n");
+}
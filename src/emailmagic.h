@@ -0,0 +1,104 @@
+/*  =========================================================================
+    emailmagic - Cache of MIME types of attachments
+
+    Copyright (C) 2014 - 2020 Eaton
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License along
+    with this program; if not, write to the Free Software Foundation, Inc.,
+    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+    =========================================================================
+*/
+
+
+#ifndef EMAILMAGIC_H_INCLUDED
+#define EMAILMAGIC_H_INCLUDED
+
+#include <list>
+#include <map>
+#include <mutex>
+#include <string>
+#include <sys/types.h>
+
+/**
+ * \class EmailMagic
+ *
+ * MIME types of attachments. Known binary formats are told by extension,
+ * other files are sniffed by libmagic and the result is cached by device,
+ * inode, size and mtime of the file, so rewritten file is sniffed again.
+ * The least recently used types are dropped when capacity is reached.
+ *
+ * Thread safe, libmagic cookie is passed by the caller, as it's not.
+ */
+class EmailMagic
+{
+    public:
+        static const size_t CAPACITY = 1024;
+
+        explicit EmailMagic (size_t capacity = CAPACITY);
+
+        /**
+         * \brief MIME type of the file
+         *
+         * \param magic     libmagic cookie of calling thread, for a miss
+         * \return type or empty string if libmagic can't tell
+         */
+        std::string type (magic_t magic, const std::string& path);
+
+        /**
+         * \brief MIME type of known binary format by extension of path
+         *
+         * \return type or NULL
+         */
+        static const char *by_extension (const std::string& path);
+
+        size_t size () const;
+
+        // types told by extension, found in cache and sniffed by libmagic
+        uint64_t extensions () const;
+        uint64_t hits () const;
+        uint64_t misses () const;
+
+    protected:
+        struct Key {
+            dev_t dev;
+            ino_t ino;
+            off_t size;
+            int64_t mtime;      // ns
+
+            bool operator< (const Key& other) const;
+        };
+
+        struct Entry {
+            Key key;
+            std::string type;
+        };
+
+        size_t _capacity;
+        // the most recently used first
+        std::list<Entry> _lru;
+        std::map<Key, std::list<Entry>::iterator> _index;
+        uint64_t _extensions;
+        uint64_t _hits;
+        uint64_t _misses;
+        mutable std::mutex _mutex;
+
+    private:
+        EmailMagic (const EmailMagic&) = delete;
+        EmailMagic& operator= (const EmailMagic&) = delete;
+};
+
+//  Self test of this class
+void
+emailmagic_test (bool verbose);
+
+#endif // EMAILMAGIC_H_INCLUDED
@@ -0,0 +1,890 @@
+/*  =========================================================================
+    emailmime - Streaming MIME writer
+
+    Copyright (C) 2014 - 2020 Eaton
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License along
+    with this program; if not, write to the Free Software Foundation, Inc.,
+    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+    =========================================================================
+*/
+
+/*
+@header
+    emailmime - Streaming MIME writer
+@discuss
+    Reports come with attachments of tens of MB. Building the whole email
+    as a string needs the files, their encoding and the copy for transport
+    in memory at once. Here files are read and encoded piece by piece and
+    each BUFFER of output goes straight to msmtp or the SMTP connection.
+@end
+*/
+
+#include "fty_email_classes.h"
+
+#include <algorithm>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sstream>
+#include <openssl/evp.h>
+#include <cxxtools/base64stream.h>
+#include <cxxtools/quotedprintablestream.h>
+
+const size_t Base64Encoder::LINE;
+const size_t QuotedPrintableEncoder::LINE;
+const size_t EmailMime::BUFFER;
+
+static const char s_base64_alphabet [] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+static const char s_hex [] = "0123456789ABCDEF";
+
+// encode triplets of bytes to base64
+static void
+s_base64_triplets (const unsigned char *data, size_t triplets, char *out)
+{
+    for (size_t i = 0; i != triplets; i++, data += 3, out += 4) {
+        uint32_t v = data [0] << 16 | data [1] << 8 | data [2];
+        out [0] = s_base64_alphabet [v >> 18];
+        out [1] = s_base64_alphabet [(v >> 12) & 0x3f];
+        out [2] = s_base64_alphabet [(v >> 6) & 0x3f];
+        out [3] = s_base64_alphabet [v & 0x3f];
+    }
+}
+
+// the last line, up to 57 bytes, and the line break
+static void
+s_base64_line (const unsigned char *data, size_t size, std::string& out)
+{
+    char line [80];
+    size_t n = size / 3 * 4;
+    s_base64_triplets (data, size / 3, line);
+    size_t i = size / 3 * 3;
+    if (i + 1 == size) {
+        uint32_t v = data [i] << 16;
+        line [n++] = s_base64_alphabet [v >> 18];
+        line [n++] = s_base64_alphabet [(v >> 12) & 0x3f];
+        line [n++] = '=';
+        line [n++] = '=';
+    }
+    else
+    if (i + 2 == size) {
+        uint32_t v = data [i] << 16 | data [i + 1] << 8;
+        line [n++] = s_base64_alphabet [v >> 18];
+        line [n++] = s_base64_alphabet [(v >> 12) & 0x3f];
+        line [n++] = s_base64_alphabet [(v >> 6) & 0x3f];
+        line [n++] = '=';
+    }
+    line [n++] = '\n';
+    out.append (line, n);
+}
+
+// does quoted-printable keep the char as it is?
+static inline bool
+s_qp_literal (unsigned char ch)
+{
+    return ch >= 33 && ch <= 126 && ch != '=';
+}
+
+// ... or whitespace, which is kept unless it's at the end of line
+static inline bool
+s_qp_run_char (unsigned char ch)
+{
+    return s_qp_literal (ch) || ch == ' ' || ch == '\t';
+}
+
+//  --------------------------------------------------------------------------
+//  Kernels: encode whole line of 57 bytes to 76 chars, length of the run of
+//  chars quoted-printable keeps as they are and whitespace
+
+static void
+s_base64_full_line_scalar (const unsigned char *data, char *out)
+{
+    s_base64_triplets (data, 19, out);
+}
+
+static size_t
+s_qp_run_scalar (const char *data, size_t size)
+{
+    size_t i = 0;
+    while (i != size && s_qp_run_char (data [i]))
+        i++;
+    return i;
+}
+
+#if defined (__x86_64__) || defined (__i386__)
+#include <immintrin.h>
+
+// base64 of 12 bytes in 16 byte vector by shuffle and multiply, see
+// W. Mula, D. Lemire: Faster Base64 Encoding and Decoding Using AVX2
+// Instructions, ACM TOW 12 (3), 2018
+__attribute__ ((target ("ssse3"))) static inline __m128i
+s_base64_ssse3 (__m128i in)
+{
+    in = _mm_shuffle_epi8 (in, _mm_set_epi8 (10, 11, 9, 10, 7, 8, 6, 7, 4, 5, 3, 4, 1, 2, 0, 1));
+    __m128i t0 = _mm_mulhi_epu16 (_mm_and_si128 (in, _mm_set1_epi32 (0x0fc0fc00)), _mm_set1_epi32 (0x04000040));
+    __m128i t1 = _mm_mullo_epi16 (_mm_and_si128 (in, _mm_set1_epi32 (0x003f03f0)), _mm_set1_epi32 (0x01000010));
+    __m128i indices = _mm_or_si128 (t0, t1);
+
+    // offset from index to ASCII: 0..25 'A', 26..51 'a', 52..61 '0', 62 '+', 63 '/'
+    const __m128i offsets = _mm_setr_epi8 (65, 71, -4, -4, -4, -4, -4, -4, -4, -4, -4, -4, -19, -16, 0, 0);
+    __m128i range = _mm_subs_epu8 (indices, _mm_set1_epi8 (51));
+    range = _mm_sub_epi8 (range, _mm_cmpgt_epi8 (indices, _mm_set1_epi8 (25)));
+    return _mm_add_epi8 (indices, _mm_shuffle_epi8 (offsets, range));
+}
+
+__attribute__ ((target ("ssse3"))) static void
+s_base64_full_line_ssse3 (const unsigned char *data, char *out)
+{
+    // 16 bytes are loaded for 12, the last load ends at byte 52 of 57
+    for (int i = 0; i != 4; i++) {
+        __m128i in = _mm_loadu_si128 (reinterpret_cast <const __m128i*> (data + 12 * i));
+        _mm_storeu_si128 (reinterpret_cast <__m128i*> (out + 16 * i), s_base64_ssse3 (in));
+    }
+    s_base64_triplets (data + 48, 3, out + 64);
+}
+
+__attribute__ ((target ("avx2"))) static inline __m256i
+s_base64_avx2 (__m256i in)
+{
+    in = _mm256_shuffle_epi8 (in, _mm256_set_epi8 (
+            10, 11, 9, 10, 7, 8, 6, 7, 4, 5, 3, 4, 1, 2, 0, 1,
+            10, 11, 9, 10, 7, 8, 6, 7, 4, 5, 3, 4, 1, 2, 0, 1));
+    __m256i t0 = _mm256_mulhi_epu16 (_mm256_and_si256 (in, _mm256_set1_epi32 (0x0fc0fc00)), _mm256_set1_epi32 (0x04000040));
+    __m256i t1 = _mm256_mullo_epi16 (_mm256_and_si256 (in, _mm256_set1_epi32 (0x003f03f0)), _mm256_set1_epi32 (0x01000010));
+    __m256i indices = _mm256_or_si256 (t0, t1);
+
+    const __m256i offsets = _mm256_setr_epi8 (
+            65, 71, -4, -4, -4, -4, -4, -4, -4, -4, -4, -4, -19, -16, 0, 0,
+            65, 71, -4, -4, -4, -4, -4, -4, -4, -4, -4, -4, -19, -16, 0, 0);
+    __m256i range = _mm256_subs_epu8 (indices, _mm256_set1_epi8 (51));
+    range = _mm256_sub_epi8 (range, _mm256_cmpgt_epi8 (indices, _mm256_set1_epi8 (25)));
+    return _mm256_add_epi8 (indices, _mm256_shuffle_epi8 (offsets, range));
+}
+
+__attribute__ ((target ("avx2"))) static void
+s_base64_full_line_avx2 (const unsigned char *data, char *out)
+{
+    // 12 bytes to each 128 bit lane, the last load ends at byte 52 of 57
+    for (int i = 0; i != 2; i++) {
+        const unsigned char *p = data + 24 * i;
+        __m256i in = _mm256_inserti128_si256 (
+                _mm256_castsi128_si256 (_mm_loadu_si128 (reinterpret_cast <const __m128i*> (p))),
+                _mm_loadu_si128 (reinterpret_cast <const __m128i*> (p + 12)), 1);
+        _mm256_storeu_si256 (reinterpret_cast <__m256i*> (out + 32 * i), s_base64_avx2 (in));
+    }
+    s_base64_triplets (data + 48, 3, out + 64);
+}
+
+__attribute__ ((target ("sse2"))) static size_t
+s_qp_run_sse2 (const char *data, size_t size)
+{
+    size_t i = 0;
+    for (; i + 16 <= size; i += 16) {
+        __m128i v = _mm_loadu_si128 (reinterpret_cast <const __m128i*> (data + i));
+        // signed compare, bytes above 127 are negative
+        __m128i ok = _mm_and_si128 (_mm_cmpgt_epi8 (v, _mm_set1_epi8 (31)), _mm_cmplt_epi8 (v, _mm_set1_epi8 (127)));
+        ok = _mm_andnot_si128 (_mm_cmpeq_epi8 (v, _mm_set1_epi8 ('=')), ok);
+        ok = _mm_or_si128 (ok, _mm_cmpeq_epi8 (v, _mm_set1_epi8 ('\t')));
+        unsigned mask = _mm_movemask_epi8 (ok);
+        if (mask != 0xffff)
+            return i + __builtin_ctz (~mask);
+    }
+    return i + s_qp_run_scalar (data + i, size - i);
+}
+
+__attribute__ ((target ("avx2"))) static size_t
+s_qp_run_avx2 (const char *data, size_t size)
+{
+    size_t i = 0;
+    for (; i + 32 <= size; i += 32) {
+        __m256i v = _mm256_loadu_si256 (reinterpret_cast <const __m256i*> (data + i));
+        __m256i ok = _mm256_and_si256 (
+                _mm256_cmpgt_epi8 (v, _mm256_set1_epi8 (31)),
+                _mm256_cmpgt_epi8 (_mm256_set1_epi8 (127), v));
+        ok = _mm256_andnot_si256 (_mm256_cmpeq_epi8 (v, _mm256_set1_epi8 ('=')), ok);
+        ok = _mm256_or_si256 (ok, _mm256_cmpeq_epi8 (v, _mm256_set1_epi8 ('\t')));
+        uint32_t mask = _mm256_movemask_epi8 (ok);
+        if (mask != 0xffffffff)
+            return i + __builtin_ctz (~mask);
+    }
+    return i + s_qp_run_sse2 (data + i, size - i);
+}
+#endif
+
+struct Kernels {
+    const char *name;
+    void (*base64_full_line) (const unsigned char *data, char *out);
+    size_t (*qp_run) (const char *data, size_t size);
+};
+
+static const Kernels s_kernels [] = {
+    {"scalar", s_base64_full_line_scalar, s_qp_run_scalar},
+#if defined (__x86_64__) || defined (__i386__)
+    {"ssse3", s_base64_full_line_ssse3, s_qp_run_sse2},
+    {"avx2", s_base64_full_line_avx2, s_qp_run_avx2},
+#endif
+};
+
+// the best kernels the CPU can run
+static const Kernels *
+s_kernels_supported ()
+{
+#if defined (__x86_64__) || defined (__i386__)
+    __builtin_cpu_init ();
+    if (__builtin_cpu_supports ("avx2"))
+        return &s_kernels [2];
+    if (__builtin_cpu_supports ("ssse3"))
+        return &s_kernels [1];
+#endif
+    return &s_kernels [0];
+}
+
+static const Kernels *s_simd = s_kernels_supported ();
+
+const char *
+EmailMime::isa ()
+{
+    return s_simd->name;
+}
+
+Base64Encoder::Base64Encoder ():
+    _pending {}
+{
+}
+
+void
+Base64Encoder::update (const char *data, size_t size, std::string& out)
+{
+    if (!_pending.empty ()) {
+        size_t take = std::min (LINE - _pending.size (), size);
+        _pending.append (data, take);
+        data += take;
+        size -= take;
+        if (_pending.size () < LINE)
+            return;
+        size_t pos = out.size ();
+        out.resize (pos + 77);
+        s_simd->base64_full_line (reinterpret_cast <const unsigned char*> (_pending.data ()), &out [pos]);
+        out [pos + 76] = '\n';
+        _pending.clear ();
+    }
+
+    size_t lines = size / LINE;
+    size_t pos = out.size ();
+    out.resize (pos + lines * 77);
+    for (size_t i = 0; i != lines; i++, data += LINE, pos += 77) {
+        s_simd->base64_full_line (reinterpret_cast <const unsigned char*> (data), &out [pos]);
+        out [pos + 76] = '\n';
+    }
+    _pending.assign (data, size % LINE);
+}
+
+void
+Base64Encoder::final (std::string& out)
+{
+    if (!_pending.empty ())
+        s_base64_line (reinterpret_cast <const unsigned char*> (_pending.data ()), _pending.size (), out);
+    _pending.clear ();
+}
+
+QuotedPrintableEncoder::QuotedPrintableEncoder ():
+    _column {0},
+    _pending {'\0'}
+{
+}
+
+// soft line break if token does not fit, '=' needs the last column
+void
+QuotedPrintableEncoder::put (const char *token, size_t size, std::string& out)
+{
+    if (_column + size > LINE - 1) {
+        out += "=\n";
+        _column = 0;
+    }
+    out.append (token, size);
+    _column += size;
+}
+
+void
+QuotedPrintableEncoder::update (const char *data, size_t size, std::string& out)
+{
+    char encoded [3] = {'=', '\0', '\0'};
+    for (size_t i = 0; i != size; i++) {
+        // run of printable chars is copied up to the soft line break,
+        // whitespace at its end might be at the end of line
+        if (!_pending) {
+            size_t run = s_simd->qp_run (data + i, size - i);
+            while (run > 0 && (data [i + run - 1] == ' ' || data [i + run - 1] == '\t'))
+                run--;
+            while (run > 0) {
+                if (_column == LINE - 1) {
+                    out += "=\n";
+                    _column = 0;
+                }
+                size_t take = std::min (run, LINE - 1 - _column);
+                out.append (data + i, take);
+                _column += take;
+                i += take;
+                run -= take;
+            }
+            if (i == size)
+                break;
+        }
+
+        unsigned char ch = data [i];
+
+        // whitespace at the end of line must be encoded, CRLF is line break
+        if (_pending) {
+            char pending = _pending;
+            _pending = '\0';
+            if (ch == '\n') {
+                if (pending != '\r') {
+                    encoded [1] = s_hex [pending >> 4];
+                    encoded [2] = s_hex [pending & 0xf];
+                    put (encoded, 3, out);
+                }
+                out += '\n';
+                _column = 0;
+                continue;
+            }
+            if (pending == '\r')
+                put ("=0D", 3, out);
+            else
+                put (&pending, 1, out);
+        }
+
+        if (ch == ' ' || ch == '\t' || ch == '\r')
+            _pending = ch;
+        else
+        if (ch == '\n') {
+            out += '\n';
+            _column = 0;
+        }
+        else
+        if (s_qp_literal (ch))
+            put (data + i, 1, out);
+        else {
+            encoded [1] = s_hex [ch >> 4];
+            encoded [2] = s_hex [ch & 0xf];
+            put (encoded, 3, out);
+        }
+    }
+}
+
+void
+QuotedPrintableEncoder::final (std::string& out)
+{
+    if (_pending) {
+        char encoded [3] = {'=', s_hex [_pending >> 4], s_hex [_pending & 0xf]};
+        put (encoded, 3, out);
+    }
+    _pending = '\0';
+}
+
+EmailMime::EmailMime (const Sink& sink, EmailParts *parts):
+    _sink {sink},
+    _parts {parts},
+    _headers {},
+    _buffer {},
+    _boundary {},
+    _started {false}
+{
+    // neither base64 nor quoted-printable output contains "=_"
+    zuuid_t *uuid = zuuid_new ();
+    _boundary = std::string ("=_fty-email_") + zuuid_str (uuid);
+    zuuid_destroy (&uuid);
+    _buffer.reserve (BUFFER + BUFFER / 2);
+}
+
+void
+EmailMime::header (const std::string& name, const std::string& value)
+{
+    assert (!_started);
+    std::string line = name + ": " + value;
+    std::replace (line.begin (), line.end (), '\r', ' ');
+    std::replace (line.begin (), line.end (), '\n', ' ');
+    _headers += line + "\n";
+}
+
+void
+EmailMime::start ()
+{
+    _headers += "MIME-Version: 1.0\n";
+    _headers += "Content-Type: multipart/mixed; boundary=\"" + _boundary + "\"\n\n";
+    _sink (_headers.data (), _headers.size ());
+    _headers.clear ();
+    _started = true;
+}
+
+void
+EmailMime::part (const std::string& headers)
+{
+    if (!_started)
+        start ();
+    write ("--" + _boundary + "\n" + headers + "\n");
+}
+
+void
+EmailMime::write (const std::string& data)
+{
+    _buffer += data;
+    if (_buffer.size () >= BUFFER)
+        flush ();
+}
+
+void
+EmailMime::flush ()
+{
+    if (_buffer.empty ())
+        return;
+    _sink (_buffer.data (), _buffer.size ());
+    _buffer.clear ();
+}
+
+EmailMime::Encoding
+EmailMime::choose (const char *data, size_t size)
+{
+    size_t escaped = 0;
+    for (size_t i = 0; i < size; i++) {
+        i += s_simd->qp_run (data + i, size - i);
+        if (i == size)
+            break;
+        char ch = data [i];
+        if (ch != ' ' && ch != '\t' && ch != '\r' && ch != '\n')
+            escaped++;
+    }
+    // soft line break every 75 chars, base64 line break every 76
+    size_t qp = size + 2 * escaped;
+    qp += qp / 75 * 2;
+    size_t base64 = (size + 2) / 3 * 4;
+    base64 += base64 / 76;
+    return qp <= base64 ? Encoding::QUOTED_PRINTABLE : Encoding::BASE64;
+}
+
+static std::string
+s_encoding_header (EmailMime::Encoding encoding)
+{
+    return std::string ("Content-Transfer-Encoding: ")
+        + (encoding == EmailMime::Encoding::BASE64 ? "base64" : "quoted-printable") + "\n";
+}
+
+// encoded in pieces, so the buffer does not grow with the data
+template <typename Encoder>
+void
+EmailMime::encode (const char *data, size_t size, Encoder& encoder)
+{
+    const size_t piece = BUFFER / 4;
+    for (size_t pos = 0; pos < size; pos += piece) {
+        encoder.update (data + pos, std::min (piece, size - pos), _buffer);
+        if (_buffer.size () >= BUFFER)
+            flush ();
+    }
+    encoder.final (_buffer);
+}
+
+void
+EmailMime::text (const std::string& text, const std::string& mime_type)
+{
+    Encoding encoding = choose (text.data (), text.size ());
+    part ("Content-Type: " + mime_type + "\n" + s_encoding_header (encoding));
+
+    if (encoding == Encoding::QUOTED_PRINTABLE) {
+        QuotedPrintableEncoder encoder;
+        encode (text.data (), text.size (), encoder);
+    }
+    else {
+        Base64Encoder encoder;
+        encode (text.data (), text.size (), encoder);
+    }
+    write ("\n");
+}
+
+// read to chunk, returns 0 at the end of file
+static size_t
+s_read (int fd, const std::string& path, std::vector<char>& chunk)
+{
+    for (;;) {
+        ssize_t n = ::read (fd, chunk.data (), chunk.size ());
+        if (n >= 0)
+            return n;
+        if (errno != EINTR)
+            throw std::runtime_error ("Can't read attachment " + path + ": " + strerror (errno));
+    }
+}
+
+// read () rather than mmap, file truncated while it's sent would SIGBUS us
+template <typename Encoder>
+void
+EmailMime::encode_file (int fd, const std::string& path, std::vector<char>& chunk, size_t size, Encoder& encoder)
+{
+    while (size > 0) {
+        encoder.update (chunk.data (), size, _buffer);
+        if (_buffer.size () >= BUFFER)
+            flush ();
+        size = s_read (fd, path, chunk);
+    }
+    encoder.final (_buffer);
+}
+
+// closes the file when it goes out of scope
+struct FileGuard {
+    int fd;
+    ~FileGuard () {
+        if (fd != -1)
+            ::close (fd);
+    }
+};
+
+static std::string
+s_attachment_headers (const std::string& name, const std::string& mime_type, EmailMime::Encoding encoding)
+{
+    return "Content-Type: " + mime_type + "; name=\"" + name + "\"\n"
+        + s_encoding_header (encoding)
+        + "Content-Disposition: attachment; filename=\"" + name + "\"\n";
+}
+
+// encode the whole data to out
+template <typename Encoder>
+static void
+s_encode_all (const std::string& data, std::string& out)
+{
+    Encoder encoder;
+    encoder.update (data.data (), data.size (), out);
+    encoder.final (out);
+}
+
+void
+EmailMime::attach_cached (
+        int fd,
+        const std::string& path,
+        const struct stat& st,
+        const std::string& name,
+        const std::string& mime_type)
+{
+    EmailParts::File file = EmailParts::file (st, mime_type.compare (0, 4, "text") == 0);
+    EmailParts::PartPtr cached = _parts->find (file);
+    if (!cached) {
+        std::string content;
+        content.reserve (st.st_size);
+        std::vector<char> chunk (BUFFER / 4);
+        while (size_t size = s_read (fd, path, chunk))
+            content.append (chunk.data (), size);
+
+        EmailParts::Digest digest = EmailParts::digest (content.data (), content.size ());
+        cached = _parts->find (file, digest, content.size ());
+        if (!cached) {
+            // encoding is chosen by the first chunk, as for streamed file
+            EmailParts::Part part {Encoding::BASE64, {}};
+            if (file.text)
+                part.encoding = choose (content.data (), std::min (content.size (), chunk.size ()));
+            if (part.encoding == Encoding::QUOTED_PRINTABLE)
+                s_encode_all<QuotedPrintableEncoder> (content, part.data);
+            else
+                s_encode_all<Base64Encoder> (content, part.data);
+            cached = _parts->insert (file, digest, content.size (), std::move (part));
+        }
+    }
+
+    part (s_attachment_headers (name, mime_type, cached->encoding));
+    flush ();
+    const std::string& data = cached->data;
+    for (size_t pos = 0; pos < data.size (); pos += BUFFER)
+        _sink (data.data () + pos, std::min (BUFFER, data.size () - pos));
+    write ("\n");
+}
+
+void
+EmailMime::attach (const std::string& path, const std::string& name, const std::string& mime_type)
+{
+    FileGuard file {::open (path.c_str (), O_RDONLY | O_CLOEXEC)};
+    std::vector<char> chunk (BUFFER / 4);
+    size_t size = 0;
+    if (file.fd == -1)
+        log_warning ("Can't open attachment %s: %s", path.c_str (), strerror (errno));
+    else {
+        struct stat st;
+        if (_parts && fstat (file.fd, &st) == 0 && S_ISREG (st.st_mode) && _parts->cacheable (st.st_size)) {
+            attach_cached (file.fd, path, st, name, mime_type);
+            return;
+        }
+        posix_fadvise (file.fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+        size = s_read (file.fd, path, chunk);
+    }
+
+    Encoding encoding = Encoding::BASE64;
+    if (mime_type.compare (0, 4, "text") == 0)
+        encoding = choose (chunk.data (), size);
+    part (s_attachment_headers (name, mime_type, encoding));
+
+    if (encoding == Encoding::QUOTED_PRINTABLE) {
+        QuotedPrintableEncoder encoder;
+        encode_file (file.fd, path, chunk, size, encoder);
+    }
+    else {
+        Base64Encoder encoder;
+        encode_file (file.fd, path, chunk, size, encoder);
+    }
+    write ("\n");
+}
+
+void
+EmailMime::finish ()
+{
+    if (!_started)
+        start ();
+    write ("--" + _boundary + "--\n");
+    flush ();
+}
+
+//  --------------------------------------------------------------------------
+//  Self test of this class
+
+static std::string
+s_base64 (const std::string& data, size_t piece)
+{
+    Base64Encoder encoder;
+    std::string out;
+    for (size_t pos = 0; pos < data.size (); pos += piece)
+        encoder.update (data.data () + pos, std::min (piece, data.size () - pos), out);
+    encoder.final (out);
+    return out;
+}
+
+static std::string
+s_quoted_printable (const std::string& text, size_t piece)
+{
+    QuotedPrintableEncoder encoder;
+    std::string out;
+    for (size_t pos = 0; pos < text.size (); pos += piece)
+        encoder.update (text.data () + pos, std::min (piece, text.size () - pos), out);
+    encoder.final (out);
+    return out;
+}
+
+// part between the headers of part containing marker and the next boundary
+static std::string
+s_part_content (const std::string& email, const std::string& marker, const std::string& boundary)
+{
+    size_t start = email.find (marker);
+    assert (start != std::string::npos);
+    start = email.find ("\n\n", start);
+    assert (start != std::string::npos);
+    start += 2;
+    size_t end = email.find ("--" + boundary, start);
+    assert (end != std::string::npos);
+    return email.substr (start, end - start);
+}
+
+void
+emailmime_test (bool verbose)
+{
+    printf (" * emailmime: ");
+
+    //  @selftest
+    const char *SELFTEST_DIR_RW = "src/selftest-rw";
+
+    {
+        // test case 01 - base64 does not depend on how data is split
+        assert (s_base64 ("", 1) == "");
+        assert (s_base64 ("f", 1) == "Zg==\n");
+        assert (s_base64 ("fo", 1) == "Zm8=\n");
+        assert (s_base64 ("foobar", 4) == "Zm9vYmFy\n");
+
+        std::string data;
+        for (int i = 0; i != 1000; i++)
+            data.push_back (static_cast <char> (i * 7 + i / 13));
+        std::string whole = s_base64 (data, data.size ());
+        for (size_t piece : {1, 2, 56, 57, 58, 100})
+            assert (s_base64 (data, piece) == whole);
+
+        size_t line = 0;
+        for (const char ch : whole) {
+            line = ch == '\n' ? 0 : line + 1;
+            assert (line <= 76);
+        }
+        std::string joined = whole;
+        joined.erase (std::remove (joined.begin (), joined.end (), '\n'), joined.end ());
+        std::string expected (4 * ((data.size () + 2) / 3) + 1, '\0');
+        EVP_EncodeBlock (reinterpret_cast <unsigned char*> (&expected [0]),
+                reinterpret_cast <const unsigned char*> (data.data ()), data.size ());
+        expected.resize (expected.size () - 1);
+        assert (joined == expected);
+    }
+
+    {
+        // test case 02 - quoted-printable
+        assert (s_quoted_printable ("a=b \nc\t", 1) == "a=3Db=20\nc=09");
+        assert (s_quoted_printable ("line\r\nx\ry  z", 3) == "line\nx=0Dy  z");
+        assert (s_quoted_printable ("\xc3\xa9t\xc3\xa9", 2) == "=C3=A9t=C3=A9");
+
+        std::string text (200, 'a');
+        std::string encoded = s_quoted_printable (text, 7);
+        assert (encoded == s_quoted_printable (text, 200));
+        size_t line = 0;
+        for (size_t i = 0; i != encoded.size (); i++) {
+            if (encoded [i] == '\n') {
+                assert (encoded [i - 1] == '=');
+                line = 0;
+            }
+            else
+                assert (++line <= 76);
+        }
+        encoded.erase (std::remove (encoded.begin (), encoded.end (), '\n'), encoded.end ());
+        encoded.erase (std::remove (encoded.begin (), encoded.end (), '='), encoded.end ());
+        assert (encoded == text);
+    }
+
+    {
+        // test case 03 - headers come first in one piece, big attachment in bounded pieces
+        std::string path = std::string (SELFTEST_DIR_RW) + "/emailmime.bin";
+        std::string data;
+        for (int i = 0; i != 3 * 1024 * 1024; i++)
+            data.push_back (static_cast <char> (i ^ (i >> 8)));
+        FILE *f = fopen (path.c_str (), "w");
+        assert (f);
+        assert (fwrite (data.data (), 1, data.size (), f) == data.size ());
+        fclose (f);
+
+        std::vector<std::string> pieces;
+        size_t max_piece = 0;
+        EmailMime mime ([&] (const char *data, size_t size) {
+            pieces.push_back (std::string (data, size));
+            max_piece = std::max (max_piece, size);
+        });
+        mime.header ("To", "joe@example.com");
+        mime.header ("Subject", "report\r\nBcc: eve@example.com");
+        mime.text ("Hello,\nreport is attached.\n");
+        mime.attach (path, "report.bin", "application/octet-stream; charset=binary");
+        mime.attach (std::string (SELFTEST_DIR_RW) + "/missing.txt", "missing.txt", "text/plain");
+        mime.finish ();
+
+        assert (pieces.size () > 10);
+        assert (max_piece < 2 * EmailMime::BUFFER);
+        const std::string& headers = pieces [0];
+        assert (headers.find ("To: joe@example.com\n") == 0);
+        assert (headers.find ("Subject: report  Bcc: eve@example.com\n") != std::string::npos);
+        assert (headers.find ("boundary=\"" + mime.boundary () + "\"") != std::string::npos);
+        assert (headers.substr (headers.size () - 2) == "\n\n");
+
+        std::string email;
+        for (const auto& it : pieces)
+            email += it;
+        assert (s_part_content (email, "quoted-printable", mime.boundary ()) == "Hello,\nreport is attached.\n\n");
+        assert (s_part_content (email, "filename=\"report.bin\"", mime.boundary ()) == s_base64 (data, data.size ()) + "\n");
+
+        // test case 04 - file which can't be opened is attached empty
+        assert (s_part_content (email, "filename=\"missing.txt\"", mime.boundary ()) == "\n");
+        assert (email.substr (email.size () - mime.boundary ().size () - 5) == "--" + mime.boundary () + "--\n");
+        zsys_file_delete ("%s", path.c_str ());
+    }
+
+    {
+        // test case 05 - vector kernels give the same output as scalar ones
+        std::string data;
+        std::string text;
+        uint32_t seed = 1;
+        for (int i = 0; i != 100000; i++) {
+            seed = seed * 1103515245 + 12345;
+            data.push_back (static_cast <char> (seed >> 24));
+            text.push_back ((seed >> 16) % 8 ? static_cast <char> ('a' + (seed >> 8) % 26) : " \t\r\n=\x80\x01~" [(seed >> 8) % 8]);
+        }
+        const Kernels *best = s_simd;
+        s_simd = &s_kernels [0];
+        std::string base64 = s_base64 (data, 1000);
+        std::string qp = s_quoted_printable (text, 1000);
+        for (const Kernels *kernels = &s_kernels [0]; kernels <= best; kernels++) {
+            s_simd = kernels;
+            assert (s_base64 (data, 777) == base64);
+            assert (s_quoted_printable (text, 777) == qp);
+        }
+        s_simd = best;
+
+        // test case 06 - shorter encoding is chosen
+        std::string ascii = "UPS ups-1 is on battery, load 45 %.\n";
+        std::string cyrillic = "\xd0\x98\xd0\x91\xd0\x9f \xd1\x80\xd0\xb0\xd0\xb1\xd0\xbe\xd1\x82\xd0\xb0\xd0\xb5\xd1\x82\n";
+        assert (EmailMime::choose (ascii.data (), ascii.size ()) == EmailMime::Encoding::QUOTED_PRINTABLE);
+        assert (EmailMime::choose (cyrillic.data (), cyrillic.size ()) == EmailMime::Encoding::BASE64);
+        assert (EmailMime::choose ("", 0) == EmailMime::Encoding::QUOTED_PRINTABLE);
+        std::string email;
+        EmailMime mime ([&email] (const char *data, size_t size) { email.append (data, size); });
+        mime.text (cyrillic);
+        mime.finish ();
+        assert (email.find ("Content-Transfer-Encoding: base64\n\n" + s_base64 (cyrillic, 1)) != std::string::npos);
+    }
+
+    {
+        // benchmark - encoders throughput against cxxtools streams used by MimeMultipart
+        const size_t size = verbose ? 64 * 1024 * 1024 : 4 * 1024 * 1024;
+        std::string data (size, '\0');
+        uint32_t seed = 1;
+        for (auto& ch : data) {
+            seed = seed * 1103515245 + 12345;
+            ch = static_cast <char> (seed >> 24);
+        }
+        std::string text;
+        while (text.size () < size)
+            text += "Alert ups-1@ups-1 is ACTIVE: on battery, load 45 %, runtime 1200 s.\n";
+        text.resize (size);
+        // bytes per us is MB/s
+        auto rate = [size] (int64_t usecs) { return size / static_cast <double> (usecs > 0 ? usecs : 1); };
+
+        const Kernels *best = s_simd;
+        for (const Kernels *kernels = &s_kernels [0]; kernels <= best; kernels++) {
+            s_simd = kernels;
+            std::string out;
+            out.reserve (size * 2);
+            int64_t start = zclock_usecs ();
+            Base64Encoder base64;
+            base64.update (data.data (), size, out);
+            base64.final (out);
+            double base64_rate = rate (zclock_usecs () - start);
+
+            out.clear ();
+            start = zclock_usecs ();
+            QuotedPrintableEncoder qp;
+            qp.update (text.data (), size, out);
+            qp.final (out);
+            double qp_rate = rate (zclock_usecs () - start);
+
+            log_info ("mime benchmark: %s base64 %.0f MB/s, quoted-printable %.0f MB/s", kernels->name, base64_rate, qp_rate);
+            if (verbose)
+                printf ("\n   %-8s base64 %6.0f MB/s, quoted-printable %6.0f MB/s", kernels->name, base64_rate, qp_rate);
+        }
+        s_simd = best;
+
+        std::ostringstream out;
+        int64_t start = zclock_usecs ();
+        {
+            cxxtools::Base64ostream base64 (out);
+            base64.write (data.data (), size);
+            base64.end ();
+        }
+        double base64_rate = rate (zclock_usecs () - start);
+
+        out.str ("");
+        start = zclock_usecs ();
+        {
+            cxxtools::QuotedPrintable_ostream qp (out);
+            qp.write (text.data (), size);
+            qp.flush ();
+        }
+        double qp_rate = rate (zclock_usecs () - start);
+
+        log_info ("mime benchmark: cxxtools base64 %.0f MB/s, quoted-printable %.0f MB/s", base64_rate, qp_rate);
+        if (verbose)
+            printf ("\n   %-8s base64 %6.0f MB/s, quoted-printable %6.0f MB/s\n * emailmime: ", "cxxtools", base64_rate, qp_rate);
+    }
+
+    //  @end
+
+    printf ("OK\n");
+}
@@ -0,0 +1,212 @@
+/*  =========================================================================
+    emailmime - Streaming MIME writer
+
+    Copyright (C) 2014 - 2020 Eaton
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License along
+    with this program; if not, write to the Free Software Foundation, Inc.,
+    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+    =========================================================================
+*/
+
+#ifndef EMAILMIME_H_INCLUDED
+#define EMAILMIME_H_INCLUDED
+
+#include <functional>
+#include <string>
+#include <vector>
+#include <sys/stat.h>
+
+class EmailParts;
+
+/**
+ * \class Base64Encoder
+ *
+ * Base64 (RFC 2045) of data coming in pieces, lines of 76 characters.
+ * Whole lines are encoded by SSSE3 or AVX2 code if the CPU has it.
+ */
+class Base64Encoder
+{
+    public:
+        static const size_t LINE = 57;  // input bytes per output line
+
+        Base64Encoder ();
+
+        /**
+         * \brief encode next piece of data, append the result to out
+         */
+        void update (const char *data, size_t size, std::string& out);
+
+        /**
+         * \brief encode the rest with padding, append the result to out
+         */
+        void final (std::string& out);
+
+    protected:
+        std::string _pending;   // less than a line
+};
+
+/**
+ * \class QuotedPrintableEncoder
+ *
+ * Quoted-printable (RFC 2045) of text coming in pieces. Line breaks stay
+ * line breaks, longer lines get soft breaks. Runs of printable characters
+ * are found by SSE2 or AVX2 code if the CPU has it.
+ */
+class QuotedPrintableEncoder
+{
+    public:
+        static const size_t LINE = 76;
+
+        QuotedPrintableEncoder ();
+
+        /**
+         * \brief encode next piece of text, append the result to out
+         */
+        void update (const char *data, size_t size, std::string& out);
+
+        /**
+         * \brief encode the rest, append the result to out
+         */
+        void final (std::string& out);
+
+    protected:
+        void put (const char *token, size_t size, std::string& out);
+
+        size_t _column;
+        char _pending;          // space, tab or CR waiting for the next char
+};
+
+/**
+ * \class EmailMime
+ *
+ * Writes multipart/mixed email to the sink as it's being built, so memory
+ * is bounded by BUFFER no matter how big the attachments are. Headers are
+ * passed to the sink in one piece before anything else, the rest in pieces
+ * of about BUFFER bytes.
+ *
+ * Line breaks are LF, transports convert them to CRLF.
+ */
+class EmailMime
+{
+    public:
+        typedef std::function<void (const char *data, size_t size)> Sink;
+
+        enum class Encoding {
+            QUOTED_PRINTABLE,
+            BASE64
+        };
+
+        static const size_t BUFFER = 65536;
+
+        /**
+         * \brief encoding giving shorter output for the text
+         *
+         * Mostly ASCII text is shorter as quoted-printable, text in other
+         * scripts (UTF-8 takes 2 or more bytes per char) as base64.
+         */
+        static Encoding choose (const char *data, size_t size);
+
+        /**
+         * \brief name of instruction set used by encoders (scalar, ssse3, avx2)
+         */
+        static const char *isa ();
+
+        /**
+         * \param parts   cache of encoded attachments, NULL to encode them each time
+         */
+        explicit EmailMime (const Sink& sink, EmailParts *parts = NULL);
+
+        /**
+         * \brief add header, line breaks in value are replaced by spaces
+         *
+         * Must be called before the first part.
+         */
+        void header (const std::string& name, const std::string& value);
+
+        /**
+         * \brief add text part, encoded as quoted-printable or base64,
+         *        whichever is shorter
+         */
+        void text (
+                const std::string& text,
+                const std::string& mime_type = "text/plain; charset=UTF-8");
+
+        /**
+         * \brief add file as attachment, text/... types are encoded as
+         *        quoted-printable or base64 according to the beginning of
+         *        the file, anything else as base64
+         *
+         * File which can't be opened is attached empty, with a warning.
+         * With cache of parts, small enough files are encoded as a whole
+         * and kept for next emails.
+         *
+         * \param name  file name in the email
+         *
+         * \throws std::runtime_error if reading of the file fails
+         */
+        void attach (
+                const std::string& path,
+                const std::string& name,
+                const std::string& mime_type);
+
+        /**
+         * \brief write the closing boundary and the rest of buffer
+         */
+        void finish ();
+
+        const std::string& boundary () const { return _boundary; };
+
+    protected:
+        void start ();
+        void part (const std::string& headers);
+        void write (const std::string& data);
+        void flush ();
+
+        template <typename Encoder>
+        void encode (const char *data, size_t size, Encoder& encoder);
+
+        // attach file from or via the cache of parts
+        void attach_cached (
+                int fd,
+                const std::string& path,
+                const struct stat& st,
+                const std::string& name,
+                const std::string& mime_type);
+
+        // encode chunk already read and the rest of file
+        template <typename Encoder>
+        void encode_file (
+                int fd,
+                const std::string& path,
+                std::vector<char>& chunk,
+                size_t size,
+                Encoder& encoder);
+
+        Sink _sink;
+        EmailParts *_parts;
+        std::string _headers;
+        std::string _buffer;
+        std::string _boundary;
+        bool _started;
+
+    private:
+        EmailMime (const EmailMime&) = delete;
+        EmailMime& operator= (const EmailMime&) = delete;
+};
+
+//  Self test of this class
+void
+emailmime_test (bool verbose);
+
+#endif // EMAILMIME_H_INCLUDED
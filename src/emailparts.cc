@@ -0,0 +1,436 @@
+/*  =========================================================================
+    emailparts - Cache of encoded attachments
+
+    Copyright (C) 2014 - 2020 Eaton
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License along
+    with this program; if not, write to the Free Software Foundation, Inc.,
+    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+    =========================================================================
+*/
+
+
+/*
+@header
+    emailparts - Cache of encoded attachments
+@discuss
+    Report goes to all its recipients as separate SENDMAIL requests, each of
+    them used to read the file and encode it again. The part is found by
+    file version from stat(), or by the content if the file was rewritten
+    with the same data or copied, and encoded only if both miss.
+
+    Content is keyed by SHA-256, a weaker hash could serve other report to
+    the recipient on collision. It's still faster than base64 encoding.
+@end
+*/
+
+#include "fty_email_classes.h"
+
+#include <set>
+#include <openssl/evp.h>
+
+const size_t EmailParts::BUDGET;
+
+// versions of one file with the same content, e.g. report rewritten daily
+#define EMAILPARTS_MAX_FILES 16
+
+bool
+EmailParts::File::operator< (const File& other) const
+{
+    if (dev != other.dev)
+        return dev < other.dev;
+    if (ino != other.ino)
+        return ino < other.ino;
+    if (size != other.size)
+        return size < other.size;
+    if (mtime != other.mtime)
+        return mtime < other.mtime;
+    return text < other.text;
+}
+
+bool
+EmailParts::Content::operator< (const Content& other) const
+{
+    if (digest != other.digest)
+        return digest < other.digest;
+    if (size != other.size)
+        return size < other.size;
+    return text < other.text;
+}
+
+EmailParts::EmailParts (size_t budget):
+    _budget {budget},
+    _bytes {0},
+    _lru {},
+    _parts {},
+    _files {},
+    _hits {0},
+    _misses {0},
+    _evictions {0},
+    _mutex {}
+{
+}
+
+void
+EmailParts::budget (size_t budget)
+{
+    std::lock_guard<std::mutex> lock (_mutex);
+    _budget = budget;
+    evict (_budget);
+}
+
+size_t
+EmailParts::budget () const
+{
+    std::lock_guard<std::mutex> lock (_mutex);
+    return _budget;
+}
+
+bool
+EmailParts::cacheable (size_t size) const
+{
+    std::lock_guard<std::mutex> lock (_mutex);
+    // base64 with line breaks
+    size_t encoded = (size + 2) / 3 * 4;
+    encoded += encoded / 76 + 1;
+    return _budget > 0 && encoded <= _budget / 4;
+}
+
+EmailParts::File
+EmailParts::file (const struct stat& st, bool text)
+{
+    return File {st.st_dev, st.st_ino, st.st_size,
+        static_cast <int64_t> (st.st_mtim.tv_sec) * 1000000000 + st.st_mtim.tv_nsec, text};
+}
+
+EmailParts::Digest
+EmailParts::digest (const char *data, size_t size)
+{
+    Digest digest;
+    unsigned int length = 0;
+    if (!EVP_Digest (data, size, digest.data (), &length, EVP_sha256 (), NULL) || length != digest.size ())
+        throw std::runtime_error ("Cannot compute SHA-256 of attachment");
+    return digest;
+}
+
+// called with the lock held
+EmailParts::PartPtr
+EmailParts::use (std::map<Content, Entry>::iterator it, const File& file)
+{
+    if (!_files.count (file)) {
+        std::vector<File>& files = it->second.files;
+        if (files.size () == EMAILPARTS_MAX_FILES) {
+            _files.erase (files.front ());
+            files.erase (files.begin ());
+        }
+        files.push_back (file);
+        _files [file] = it->first;
+    }
+    _lru.splice (_lru.begin (), _lru, it->second.lru);
+    _hits++;
+    return it->second.part;
+}
+
+// called with the lock held
+void
+EmailParts::forget (const File& file)
+{
+    auto it = _files.find (file);
+    if (it == _files.end ())
+        return;
+    auto entry = _parts.find (it->second);
+    if (entry != _parts.end ()) {
+        std::vector<File>& files = entry->second.files;
+        for (auto f = files.begin (); f != files.end (); ++f) {
+            if (!(*f < file) && !(file < *f)) {
+                files.erase (f);
+                break;
+            }
+        }
+    }
+    _files.erase (it);
+}
+
+// called with the lock held
+void
+EmailParts::evict (size_t budget)
+{
+    while (!_lru.empty () && _bytes > budget) {
+        auto it = _parts.find (_lru.back ());
+        for (const auto& file : it->second.files)
+            _files.erase (file);
+        _bytes -= it->second.part->data.size ();
+        _parts.erase (it);
+        _lru.pop_back ();
+        _evictions++;
+    }
+}
+
+EmailParts::PartPtr
+EmailParts::find (const File& file)
+{
+    std::lock_guard<std::mutex> lock (_mutex);
+    auto it = _files.find (file);
+    if (it == _files.end ())
+        return NULL;
+    return use (_parts.find (it->second), file);
+}
+
+EmailParts::PartPtr
+EmailParts::find (const File& file, const Digest& digest, size_t size)
+{
+    std::lock_guard<std::mutex> lock (_mutex);
+    auto it = _parts.find (Content {digest, size, file.text});
+    if (it == _parts.end ())
+        return NULL;
+    return use (it, file);
+}
+
+EmailParts::PartPtr
+EmailParts::insert (const File& file, const Digest& digest, size_t size, Part&& part)
+{
+    std::lock_guard<std::mutex> lock (_mutex);
+    Content content {digest, size, file.text};
+    auto it = _parts.find (content);
+    if (it != _parts.end ())
+        return use (it, file);
+
+    _misses++;
+    PartPtr added = std::make_shared<const Part> (std::move (part));
+    if (added->data.size () > _budget / 4)
+        return added;
+
+    // file version may point to other content, e.g. rewritten within mtime resolution
+    forget (file);
+    _lru.push_front (content);
+    _parts [content] = Entry {added, _lru.begin (), {file}};
+    _files [file] = content;
+    _bytes += added->data.size ();
+    evict (_budget);
+    return added;
+}
+
+size_t
+EmailParts::size () const
+{
+    std::lock_guard<std::mutex> lock (_mutex);
+    return _parts.size ();
+}
+
+size_t
+EmailParts::bytes () const
+{
+    std::lock_guard<std::mutex> lock (_mutex);
+    return _bytes;
+}
+
+uint64_t
+EmailParts::hits () const
+{
+    std::lock_guard<std::mutex> lock (_mutex);
+    return _hits;
+}
+
+uint64_t
+EmailParts::misses () const
+{
+    std::lock_guard<std::mutex> lock (_mutex);
+    return _misses;
+}
+
+uint64_t
+EmailParts::evictions () const
+{
+    std::lock_guard<std::mutex> lock (_mutex);
+    return _evictions;
+}
+
+//  --------------------------------------------------------------------------
+//  Self test of this class
+
+static void
+s_write_file (const std::string& path, const std::string& content)
+{
+    FILE *f = fopen (path.c_str (), "w");
+    assert (f);
+    assert (fwrite (content.data (), 1, content.size (), f) == content.size ());
+    fclose (f);
+}
+
+// email with attachments, boundary replaced, so emails can be compared
+static std::string
+s_email (EmailParts *parts, const std::vector<std::string>& paths)
+{
+    std::string email;
+    EmailMime mime ([&email] (const char *data, size_t size) { email.append (data, size); }, parts);
+    mime.header ("Subject", "report");
+    mime.text ("report is attached");
+    for (const auto& path : paths)
+        mime.attach (path, "report", path.find (".txt") != std::string::npos ? "text/plain; charset=us-ascii" : "application/octet-stream");
+    mime.finish ();
+
+    size_t pos;
+    while ((pos = email.find (mime.boundary ())) != std::string::npos)
+        email.replace (pos, mime.boundary ().size (), "BOUNDARY");
+    return email;
+}
+
+static EmailParts::File
+s_file (ino_t ino, int64_t mtime)
+{
+    return EmailParts::File {1, ino, 100, mtime, false};
+}
+
+static EmailParts::Digest
+s_digest (int n)
+{
+    EmailParts::Digest digest {};
+    digest [0] = static_cast <unsigned char> (n);
+    return digest;
+}
+
+void
+emailparts_test (bool verbose)
+{
+    printf (" * emailparts: ");
+
+    //  @selftest
+    const char *SELFTEST_DIR_RW = "src/selftest-rw";
+
+    {
+        // test case 01 - digest depends on every byte and the length
+        std::string data;
+        for (int i = 0; i != 1000; i++)
+            data.push_back (static_cast <char> (i * 7));
+        EmailParts::Digest digest = EmailParts::digest (data.data (), data.size ());
+        assert (digest == EmailParts::digest (data.data (), data.size ()));
+        std::set<EmailParts::Digest> digests {digest};
+        for (size_t i : {0, 7, 31, 32, 500, 999}) {
+            std::string changed = data;
+            changed [i] ^= 1;
+            digests.insert (EmailParts::digest (changed.data (), changed.size ()));
+        }
+        for (size_t size : {0, 1, 8, 31, 32, 33, 999})
+            digests.insert (EmailParts::digest (data.data (), size));
+        // unaligned data
+        digests.insert (EmailParts::digest (data.data () + 1, 998));
+        assert (digests.size () == 15);
+        // SHA-256 of empty content
+        assert (EmailParts::digest ("", 0) [0] == 0xe3);
+        assert (EmailParts::digest ("", 0) [31] == 0x55);
+    }
+
+    {
+        // test case 02 - part is found by file version or content
+        EmailParts parts (4000);
+        assert (parts.cacheable (700));
+        assert (!parts.cacheable (800));
+        assert (!parts.find (s_file (1, 0)));
+        assert (!parts.find (s_file (1, 0), s_digest (42), 100));
+        EmailParts::PartPtr part = parts.insert (s_file (1, 0), s_digest (42), 100, EmailParts::Part {EmailMime::Encoding::BASE64, std::string (500, 'a')});
+        assert (part->data.size () == 500);
+        assert (parts.find (s_file (1, 0)) == part);
+        assert (!parts.find (s_file (1, 1)));
+        assert (parts.find (s_file (2, 0), s_digest (42), 100) == part);
+        assert (parts.find (s_file (2, 0)) == part);
+        // text is encoded differently
+        EmailParts::File text = s_file (1, 0);
+        text.text = true;
+        assert (!parts.find (text));
+        assert (parts.size () == 1);
+        assert (parts.bytes () == 500);
+        assert (parts.hits () == 3);
+        assert (parts.misses () == 1);
+
+        // test case 03 - the same content added meanwhile is reused
+        assert (parts.insert (s_file (3, 0), s_digest (42), 100, EmailParts::Part {EmailMime::Encoding::BASE64, "other"}) == part);
+        assert (parts.size () == 1);
+
+        // test case 04 - least recently used parts are dropped over budget
+        parts.insert (s_file (4, 0), s_digest (43), 100, EmailParts::Part {EmailMime::Encoding::BASE64, std::string (1000, 'b')});
+        parts.insert (s_file (5, 0), s_digest (44), 100, EmailParts::Part {EmailMime::Encoding::BASE64, std::string (1000, 'c')});
+        parts.insert (s_file (6, 0), s_digest (45), 100, EmailParts::Part {EmailMime::Encoding::BASE64, std::string (1000, 'd')});
+        assert (parts.find (s_file (1, 0)));
+        parts.insert (s_file (7, 0), s_digest (46), 100, EmailParts::Part {EmailMime::Encoding::BASE64, std::string (1000, 'e')});
+        assert (parts.evictions () == 1);
+        assert (!parts.find (s_file (4, 0)));
+        assert (parts.find (s_file (1, 0)));
+        assert (parts.bytes () == 3500);
+        // dropped part is still valid for its user
+        assert (part->data == std::string (500, 'a'));
+
+        // test case 05 - too big part is not kept
+        EmailParts::PartPtr big = parts.insert (s_file (8, 0), s_digest (47), 100, EmailParts::Part {EmailMime::Encoding::BASE64, std::string (1001, 'f')});
+        assert (big->data.size () == 1001);
+        assert (!parts.find (s_file (8, 0)));
+
+        // test case 06 - zero budget disables the cache
+        parts.budget (0);
+        assert (parts.size () == 0);
+        assert (parts.bytes () == 0);
+        assert (!parts.cacheable (0));
+    }
+
+    {
+        // test case 07 - file version with other content points to the new part only
+        EmailParts parts (4000);
+        parts.insert (s_file (1, 0), s_digest (1), 100, EmailParts::Part {EmailMime::Encoding::BASE64, std::string (900, 'a')});
+        EmailParts::PartPtr part = parts.insert (s_file (1, 0), s_digest (2), 100, EmailParts::Part {EmailMime::Encoding::BASE64, std::string (900, 'b')});
+        assert (parts.find (s_file (1, 0)) == part);
+        // dropping the old content keeps the new mapping
+        parts.budget (1000);
+        assert (parts.evictions () == 1);
+        assert (parts.find (s_file (1, 0)) == part);
+    }
+
+    {
+        // test case 08 - cached attachments give the same email as streamed ones
+        std::string bin = std::string (SELFTEST_DIR_RW) + "/emailparts.bin";
+        std::string copy = std::string (SELFTEST_DIR_RW) + "/emailparts-copy.bin";
+        std::string txt = std::string (SELFTEST_DIR_RW) + "/emailparts.txt";
+        std::string data;
+        for (int i = 0; i != 300000; i++)
+            data.push_back (static_cast <char> (i * 13 ^ (i >> 7)));
+        s_write_file (bin, data);
+        s_write_file (copy, data);
+        s_write_file (txt, "date;load\n2020-01-01;45 %\n");
+
+        EmailParts parts;
+        std::string streamed = s_email (NULL, {bin, txt});
+        assert (s_email (&parts, {bin, txt}) == streamed);
+        assert (parts.misses () == 2);
+        assert (parts.hits () == 0);
+
+        // test case 09 - repeated send reuses encoded parts
+        assert (s_email (&parts, {bin, txt}) == streamed);
+        assert (parts.hits () == 2);
+
+        // test case 10 - copy of the file is found by content
+        assert (s_email (&parts, {copy}) == s_email (NULL, {copy}));
+        assert (parts.hits () == 3);
+        assert (parts.misses () == 2);
+
+        // test case 11 - rewritten file is encoded again
+        data.push_back ('\n');
+        s_write_file (bin, data);
+        assert (s_email (&parts, {bin}) == s_email (NULL, {bin}));
+        assert (parts.misses () == 3);
+
+        zsys_file_delete ("%s", bin.c_str ());
+        zsys_file_delete ("%s", copy.c_str ());
+        zsys_file_delete ("%s", txt.c_str ());
+    }
+    //  @end
+
+    printf ("OK\n");
+}
@@ -0,0 +1,167 @@
+/*  =========================================================================
+    emailparts - Cache of encoded attachments
+
+    Copyright (C) 2014 - 2020 Eaton
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License along
+    with this program; if not, write to the Free Software Foundation, Inc.,
+    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+    =========================================================================
+*/
+
+
+#ifndef EMAILPARTS_H_INCLUDED
+#define EMAILPARTS_H_INCLUDED
+
+#include <array>
+#include <list>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+#include <sys/stat.h>
+
+/**
+ * \class EmailParts
+ *
+ * Attachments already encoded for email, so the same report sent to many
+ * recipients, or again and again, is read and encoded once. Parts are kept
+ * by content (SHA-256 and size), file versions (device, inode, size and mtime)
+ * point to their content, so unchanged file is not even read again and its
+ * copy under other name shares the part.
+ *
+ * Least recently used parts are dropped to keep encoded data within the
+ * budget. Thread safe, parts are shared by workers.
+ */
+class EmailParts
+{
+    public:
+        static const size_t BUDGET = 16 * 1024 * 1024;
+
+        typedef std::array<unsigned char, 32> Digest;
+
+        struct Part {
+            EmailMime::Encoding encoding;
+            std::string data;       // encoded content of the part
+        };
+        // part stays valid while it's written, even if it's dropped
+        typedef std::shared_ptr<const Part> PartPtr;
+
+        // version of file and whether it's encoded as text
+        struct File {
+            dev_t dev;
+            ino_t ino;
+            off_t size;
+            int64_t mtime;      // ns
+            bool text;
+
+            bool operator< (const File& other) const;
+        };
+
+        /**
+         * \param budget    max size of encoded data (bytes), 0 disables the cache
+         */
+        explicit EmailParts (size_t budget = BUDGET);
+
+        /**
+         * \brief set the budget, parts over it are dropped
+         */
+        void budget (size_t budget);
+        size_t budget () const;
+
+        /**
+         * \brief is file of the size worth caching?
+         *
+         * One part may take a quarter of the budget at most, so a big
+         * report does not drop all the others.
+         */
+        bool cacheable (size_t size) const;
+
+        static File file (const struct stat& st, bool text);
+
+        /**
+         * \brief SHA-256 of the content, so other content is never served
+         *        for the same digest
+         */
+        static Digest digest (const char *data, size_t size);
+
+        /**
+         * \brief part of the file version
+         *
+         * \return part or NULL if the file was not seen
+         */
+        PartPtr find (const File& file);
+
+        /**
+         * \brief part with the content, remembered for the file version
+         *
+         * \return part or NULL if the content was not seen
+         */
+        PartPtr find (const File& file, const Digest& digest, size_t size);
+
+        /**
+         * \brief add encoded part of the file version
+         *
+         * \return the part, or the same one added meanwhile by other thread
+         */
+        PartPtr insert (const File& file, const Digest& digest, size_t size, Part&& part);
+
+        // number of parts and their encoded size
+        size_t size () const;
+        size_t bytes () const;
+
+        // parts found by file version or content, encoded and dropped
+        uint64_t hits () const;
+        uint64_t misses () const;
+        uint64_t evictions () const;
+
+    protected:
+        struct Content {
+            Digest digest;
+            size_t size;
+            bool text;
+
+            bool operator< (const Content& other) const;
+        };
+
+        struct Entry {
+            PartPtr part;
+            std::list<Content>::iterator lru;
+            std::vector<File> files;        // versions of files with the content
+        };
+
+        PartPtr use (std::map<Content, Entry>::iterator it, const File& file);
+        void forget (const File& file);
+        void evict (size_t budget);
+
+        size_t _budget;
+        size_t _bytes;
+        std::list<Content> _lru;            // most recently used first
+        std::map<Content, Entry> _parts;
+        std::map<File, Content> _files;
+        uint64_t _hits;
+        uint64_t _misses;
+        uint64_t _evictions;
+        mutable std::mutex _mutex;
+
+    private:
+        EmailParts (const EmailParts&) = delete;
+        EmailParts& operator= (const EmailParts&) = delete;
+};
+
+//  Self test of this class
+void
+emailparts_test (bool verbose);
+
+#endif // EMAILPARTS_H_INCLUDED
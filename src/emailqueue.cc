@@ -0,0 +1,309 @@
+/*  =========================================================================
+    emailqueue - Priority queue of emails waiting for a worker
+
+    Copyright (C) 2014 - 2020 Eaton
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License along
+    with this program; if not, write to the Free Software Foundation, Inc.,
+    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+    =========================================================================
+*/
+
+/*
+@header
+    emailqueue - Priority queue of emails waiting for a worker
+@discuss
+    Big SENDMAIL jobs (reports with attachments) should not delay critical
+    alerts. Next job is the head of lane with the lowest
+
+        lane - wait / aging
+
+    lower lane wins the tie. As heads are the oldest jobs of their lanes,
+    only LANES jobs are compared.
+
+    When alerts pile up in the queue, only the latest state of each one is
+    worth sending. Newer job replaces the waiting one in its queue position,
+    so it's not delayed by coming later.
+@end
+*/
+
+#include "fty_email_classes.h"
+
+const int EmailQueue::LANES;
+const int EmailQueue::BULK;
+
+EmailQueue::EmailQueue (int64_t aging):
+    _aging {aging},
+    _supersede {Supersede::MERGE},
+    _alerts {},
+    _size {0},
+    _superseded {0}
+{
+    for (int i = 0; i != LANES; i++)
+        _stats [i] = LaneStats {0, 0, 0, 0, 0};
+}
+
+EmailQueue::~EmailQueue ()
+{
+    for (int i = 0; i != LANES; i++)
+        for (auto& entry : _lanes [i])
+            delete entry.job;
+}
+
+int
+EmailQueue::lane (const EmailJob& job)
+{
+    if (job.priority >= 1 && job.priority < LANES)
+        return job.priority - 1;
+    return BULK;
+}
+
+// job takes over requests of waiting job for the same alert
+static void
+s_supersede (EmailJob *job, EmailJob *old, EmailQueue::Supersede policy)
+{
+    if (job->state == "RESOLVED" && old->state != "RESOLVED" && !old->discard) {
+        if (policy == EmailQueue::Supersede::DROP)
+            job->discard = true;
+        else
+            job->body += "\n\n" + old->body;
+    }
+    else
+    if (old->discard && job->state == "RESOLVED")
+        job->discard = true;
+
+    for (auto other : old->merged)
+        job->merged.push_back (other);
+    old->merged.clear ();
+    job->merged.push_back (old);
+}
+
+void
+EmailQueue::push (EmailJob *job, int64_t now)
+{
+    int i = lane (*job);
+    if (!job->alert.empty ()) {
+        auto it = _alerts.find (job->alert);
+        if (it != _alerts.end () && lane (*it->second->job) == i) {
+            log_debug ("emailqueue: %s supersedes %s", job->uuid.c_str (), it->second->job->uuid.c_str ());
+            s_supersede (job, it->second->job, _supersede);
+            it->second->job = job;
+            _superseded++;
+            return;
+        }
+    }
+
+    _lanes [i].push_back (Entry {job, now});
+    if (!job->alert.empty ())
+        _alerts [job->alert] = &_lanes [i].back ();
+    _stats [i].depth++;
+    _stats [i].enqueued++;
+    _size++;
+}
+
+EmailJob *
+EmailQueue::pop (int64_t now, bool bulk)
+{
+    int best = -1;
+    int64_t best_score = 0;
+    for (int i = 0; i != LANES; i++) {
+        if (_lanes [i].empty () || (!bulk && i == BULK))
+            continue;
+        int64_t score = i;
+        if (_aging > 0)
+            score -= (now - _lanes [i].front ().since) / _aging;
+        if (best == -1 || score < best_score) {
+            best = i;
+            best_score = score;
+        }
+    }
+    if (best == -1)
+        return NULL;
+
+    Entry entry = _lanes [best].front ();
+    auto it = _alerts.find (entry.job->alert);
+    if (it != _alerts.end () && it->second == &_lanes [best].front ())
+        _alerts.erase (it);
+    _lanes [best].pop_front ();
+    _size--;
+
+    LaneStats& stats = _stats [best];
+    int64_t wait = now - entry.since;
+    stats.depth--;
+    stats.dequeued++;
+    stats.wait_total += wait;
+    if (wait > stats.wait_max)
+        stats.wait_max = wait;
+    return entry.job;
+}
+
+//  --------------------------------------------------------------------------
+//  Self test of this class
+
+static EmailJob *
+s_job (int priority, const char *uuid)
+{
+    EmailJob *job = new EmailJob ();
+    job->type = priority == 0 ? EmailJob::Type::SENDMAIL : EmailJob::Type::SENDMAIL_ALERT;
+    job->priority = priority;
+    job->uuid = uuid;
+    return job;
+}
+
+static EmailJob *
+s_alert (const char *uuid, const char *state, const char *body)
+{
+    EmailJob *job = s_job (3, uuid);
+    job->alert = "rule@asset\njoe@example.com";
+    job->state = state;
+    job->body = body;
+    return job;
+}
+
+static void
+s_assert_pop (EmailQueue& queue, int64_t now, const char *uuid, bool bulk = true)
+{
+    EmailJob *job = queue.pop (now, bulk);
+    assert (job);
+    assert (job->uuid == uuid);
+    delete job;
+}
+
+void
+emailqueue_test (bool verbose)
+{
+    printf (" * emailqueue: ");
+
+    //  @selftest
+    {
+        // test case 01 - higher priority first, FIFO within the lane
+        EmailQueue queue (0);
+        queue.push (s_job (0, "bulk1"), 0);
+        queue.push (s_job (5, "P5"), 0);
+        queue.push (s_job (3, "P3a"), 0);
+        queue.push (s_job (1, "P1"), 0);
+        queue.push (s_job (3, "P3b"), 0);
+        queue.push (s_job (0, "bulk2"), 0);
+        assert (queue.size () == 6);
+        EmailJob job;
+        job.priority = 1;
+        assert (EmailQueue::lane (job) == 0);
+        job.priority = 0;
+        assert (EmailQueue::lane (job) == EmailQueue::BULK);
+
+        s_assert_pop (queue, 10, "P1");
+        s_assert_pop (queue, 10, "P3a");
+        s_assert_pop (queue, 10, "P3b");
+        s_assert_pop (queue, 10, "P5");
+
+        // test case 02 - bulk lane can be skipped
+        assert (queue.pop (10, false) == NULL);
+        s_assert_pop (queue, 10, "bulk1");
+        s_assert_pop (queue, 10, "bulk2");
+        assert (queue.empty ());
+        assert (queue.pop (10) == NULL);
+
+        // test case 03 - per lane stats
+        const EmailQueue::LaneStats& stats = queue.stats (2);
+        assert (stats.depth == 0);
+        assert (stats.enqueued == 2);
+        assert (stats.dequeued == 2);
+        assert (stats.wait_total == 20);
+        assert (stats.wait_max == 10);
+        assert (queue.stats (EmailQueue::BULK).enqueued == 2);
+    }
+
+    {
+        // test case 04 - aging, old bulk job beats new alerts
+        EmailQueue queue (1000);
+        queue.push (s_job (0, "bulk"), 0);
+        queue.push (s_job (5, "P5"), 2500);
+        queue.push (s_job (2, "P2"), 4500);
+        // bulk: 5 - 4 = 1, P5: 4 - 2 = 2, P2: 1 - 0 = 1, tie goes to P2
+        s_assert_pop (queue, 4500, "P2");
+        s_assert_pop (queue, 4500, "bulk");
+        s_assert_pop (queue, 4500, "P5");
+
+        // test case 05 - waiting jobs are deleted with the queue
+        queue.push (s_job (1, "P1"), 0);
+        queue.push (s_job (0, "bulk"), 0);
+    }
+
+    {
+        // test case 06 - repeated alert supersedes the waiting one in its place
+        EmailQueue queue (0);
+        queue.push (s_alert ("A1", "ACTIVE", "active"), 0);
+        queue.push (s_job (3, "other"), 0);
+        queue.push (s_alert ("A2", "ACTIVE", "active again"), 10);
+        assert (queue.size () == 2);
+        assert (queue.superseded () == 1);
+        EmailJob *job = queue.pop (20);
+        assert (job->uuid == "A2");
+        assert (job->body == "active again");
+        assert (job->merged.size () == 1);
+        assert (job->merged [0]->uuid == "A1");
+        assert (queue.stats (2).wait_max == 20);
+        delete job;
+        s_assert_pop (queue, 20, "other");
+
+        // test case 07 - RESOLVED email mentions superseded ACTIVE alert
+        queue.push (s_alert ("A3", "ACTIVE", "active"), 0);
+        queue.push (s_alert ("A4", "ACTIVE", "active again"), 0);
+        queue.push (s_alert ("R1", "RESOLVED", "resolved"), 0);
+        job = queue.pop (0);
+        assert (job->uuid == "R1");
+        assert (!job->discard);
+        assert (job->body == "resolved\n\nactive again");
+        assert (job->merged.size () == 2);
+        delete job;
+
+        // test case 08 - or nothing is sent with DROP policy
+        queue.supersede (EmailQueue::Supersede::DROP);
+        queue.push (s_alert ("A5", "ACTIVE", "active"), 0);
+        queue.push (s_alert ("R2", "RESOLVED", "resolved"), 0);
+        queue.push (s_alert ("R3", "RESOLVED", "resolved again"), 0);
+        job = queue.pop (0);
+        assert (job->uuid == "R3");
+        assert (job->discard);
+        assert (job->merged.size () == 2);
+        delete job;
+
+        // test case 09 - alert taken by worker is not superseded
+        queue.push (s_alert ("A6", "ACTIVE", "active"), 0);
+        job = queue.pop (0);
+        queue.push (s_alert ("R4", "RESOLVED", "resolved"), 0);
+        s_assert_pop (queue, 0, "R4");
+        assert (queue.empty ());
+        delete job;
+
+        // test case 10 - digest is not superseded by its first alert
+        std::vector<EmailJob*> alerts {s_alert ("D1", "ACTIVE", "first"), s_alert ("D2", "ACTIVE", "second")};
+        alerts [1]->alert = "other@asset\njoe@example.com";
+        queue.push (EmailDigest::merge (alerts), 0);
+        queue.push (s_alert ("D3", "ACTIVE", "first again"), 0);
+        assert (queue.size () == 2);
+        job = queue.pop (0);
+        assert (job->uuid == "D1");
+        assert (job->merged.size () == 1);
+        assert (job->body.find ("second") != std::string::npos);
+        delete job;
+        s_assert_pop (queue, 0, "D3");
+
+        // test case 11 - superseded jobs are deleted with the queue
+        queue.push (s_alert ("A7", "ACTIVE", "active"), 0);
+        queue.push (s_alert ("A8", "ACTIVE", "active"), 0);
+    }
+    //  @end
+
+    printf ("OK\n");
+}
@@ -0,0 +1,128 @@
+/*  =========================================================================
+    emailqueue - Priority queue of emails waiting for a worker
+
+    Copyright (C) 2014 - 2020 Eaton
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License along
+    with this program; if not, write to the Free Software Foundation, Inc.,
+    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+    =========================================================================
+*/
+
+#ifndef EMAILQUEUE_H_INCLUDED
+#define EMAILQUEUE_H_INCLUDED
+
+#include <deque>
+#include <map>
+#include <string>
+
+struct EmailJob;
+
+/**
+ * \class EmailQueue
+ *
+ * Jobs waiting for delivery, in lanes by priority. Alerts P1 .. P5 go to
+ * lanes 0 .. 4, SENDMAIL (or anything without priority) to the bulk lane.
+ * Each lane is FIFO, the lane with the highest priority wins, but waiting
+ * job gets one lane higher every aging ms, so low lanes don't starve.
+ *
+ * Alert job waiting in the same lane as newer job for the same alert (see
+ * EmailJob::alert) is superseded: the newer one takes its place and answers
+ * its request. Superseded ACTIVE alert is mentioned in RESOLVED email, or
+ * both are dropped, according to the policy.
+ */
+class EmailQueue
+{
+    public:
+        static const int LANES = 6;
+        static const int BULK = LANES - 1;
+
+        enum class Supersede {
+            MERGE,      // RESOLVED email mentions superseded ACTIVE alert
+            DROP        // alert resolved before it was sent is not sent at all
+        };
+
+        struct LaneStats {
+            size_t depth;           // jobs waiting now
+            uint64_t enqueued;      // jobs put to lane
+            uint64_t dequeued;      // jobs taken from lane
+            int64_t wait_total;     // total wait time of dequeued jobs (ms)
+            int64_t wait_max;       // max wait time of dequeued job (ms)
+        };
+
+        /**
+         * \param aging     promote waiting job by one lane after (ms), 0 disables aging
+         */
+        explicit EmailQueue (int64_t aging = 30000);
+
+        /**
+         * \brief jobs still waiting are deleted
+         */
+        ~EmailQueue ();
+
+        void aging (int64_t aging) { _aging = aging; };
+        void supersede (Supersede policy) { _supersede = policy; };
+
+        /**
+         * \brief lane of the job
+         */
+        static int lane (const EmailJob& job);
+
+        /**
+         * \brief add job, queue owns it
+         *
+         * \param now   monotonic time in ms (zclock_mono)
+         */
+        void push (EmailJob *job, int64_t now);
+
+        /**
+         * \brief take the job to deliver next, caller owns it
+         *
+         * \param bulk  if false, bulk lane is skipped
+         * \return job or NULL if there is no (allowed) one
+         */
+        EmailJob *pop (int64_t now, bool bulk = true);
+
+        bool empty () const { return _size == 0; };
+        size_t size () const { return _size; };
+
+        const LaneStats& stats (int lane) const { return _stats [lane]; };
+
+        // number of superseded jobs
+        uint64_t superseded () const { return _superseded; };
+
+    protected:
+        struct Entry {
+            EmailJob *job;
+            int64_t since;
+        };
+
+        int64_t _aging;
+        Supersede _supersede;
+        std::deque<Entry> _lanes [LANES];
+        // waiting alerts, deque keeps references valid on push_back/pop_front
+        std::map<std::string, Entry*> _alerts;
+        LaneStats _stats [LANES];
+        size_t _size;
+        uint64_t _superseded;
+
+    private:
+        EmailQueue (const EmailQueue&) = delete;
+        EmailQueue& operator= (const EmailQueue&) = delete;
+};
+
+//  Self test of this class
+void
+emailqueue_test (bool verbose);
+
+#endif // EMAILQUEUE_H_INCLUDED
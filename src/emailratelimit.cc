@@ -0,0 +1,203 @@
+/*  =========================================================================
+    emailratelimit - Token bucket rate limits of recipients
+
+    Copyright (C) 2014 - 2020 Eaton
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License along
+    with this program; if not, write to the Free Software Foundation, Inc.,
+    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+    =========================================================================
+*/
+
+
+/*
+@header
+    emailratelimit - Token bucket rate limits of recipients
+@discuss
+    SMS gateways (and some relays) throttle or blacklist senders which send
+    too much, and alert storm can easily get our account suspended. Emails
+    over the limit wait (or are added to the digest) instead.
+
+    Tokens are refilled lazily, when the bucket is used.
+@end
+*/
+
+#include "fty_email_classes.h"
+
+const size_t EmailRateLimit::MAX_BUCKETS;
+
+EmailRateLimit::EmailRateLimit ():
+    _recipient {0, 1},
+    _domain {0, 1},
+    _recipients {},
+    _domains {}
+{
+}
+
+void
+EmailRateLimit::recipient (int rate, int burst)
+{
+    _recipient = Limit {rate, burst > 0 ? burst : 1};
+    if (rate <= 0)
+        _recipients.clear ();
+}
+
+void
+EmailRateLimit::domain (int rate, int burst)
+{
+    _domain = Limit {rate, burst > 0 ? burst : 1};
+    if (rate <= 0)
+        _domains.clear ();
+}
+
+int64_t
+EmailRateLimit::refill (const Limit& limit, Bucket& bucket, int64_t now)
+{
+    if (now > bucket.last) {
+        bucket.tokens += (now - bucket.last) * limit.rate / 60000.0;
+        if (bucket.tokens > limit.burst)
+            bucket.tokens = limit.burst;
+        bucket.last = now;
+    }
+    if (bucket.tokens >= 1.0)
+        return 0;
+    return static_cast <int64_t> ((1.0 - bucket.tokens) * 60000.0 / limit.rate) + 1;
+}
+
+void
+EmailRateLimit::prune (const Limit& limit, std::map<std::string, Bucket>& buckets, int64_t now)
+{
+    if (buckets.size () < MAX_BUCKETS)
+        return;
+    // full bucket is the same as new one
+    for (auto it = buckets.begin (); it != buckets.end (); ) {
+        refill (limit, it->second, now);
+        if (it->second.tokens >= limit.burst)
+            it = buckets.erase (it);
+        else
+            ++it;
+    }
+}
+
+int64_t
+EmailRateLimit::take (const std::string& recipient, int64_t now)
+{
+    Bucket *by_recipient = NULL;
+    Bucket *by_domain = NULL;
+    int64_t wait = 0;
+
+    if (_recipient.rate > 0) {
+        prune (_recipient, _recipients, now);
+        auto it = _recipients.find (recipient);
+        if (it == _recipients.end ())
+            it = _recipients.insert (std::make_pair (recipient, Bucket {double (_recipient.burst), now, 0, 0})).first;
+        by_recipient = &it->second;
+        wait = refill (_recipient, *by_recipient, now);
+    }
+
+    size_t at = recipient.rfind ('@');
+    if (_domain.rate > 0 && at != std::string::npos) {
+        std::string domain = recipient.substr (at + 1);
+        for (auto& c : domain)
+            c = tolower (c);
+        prune (_domain, _domains, now);
+        auto it = _domains.find (domain);
+        if (it == _domains.end ())
+            it = _domains.insert (std::make_pair (domain, Bucket {double (_domain.burst), now, 0, 0})).first;
+        by_domain = &it->second;
+        int64_t domain_wait = refill (_domain, *by_domain, now);
+        if (domain_wait > wait)
+            wait = domain_wait;
+    }
+
+    for (auto bucket : {by_recipient, by_domain}) {
+        if (!bucket)
+            continue;
+        if (wait > 0)
+            bucket->deferred++;
+        else {
+            bucket->tokens -= 1.0;
+            bucket->allowed++;
+        }
+    }
+    return wait;
+}
+
+//  --------------------------------------------------------------------------
+//  Self test of this class
+
+void
+emailratelimit_test (bool verbose)
+{
+    printf (" * emailratelimit: ");
+
+    //  @selftest
+    {
+        // test case 01 - no limits by default
+        EmailRateLimit limit;
+        for (int i = 0; i != 100; i++)
+            assert (limit.take ("joe@example.com", 0) == 0);
+        assert (limit.recipients ().empty ());
+        assert (limit.domains ().empty ());
+    }
+
+    {
+        // test case 02 - recipient limit, burst and refill
+        EmailRateLimit limit;
+        limit.recipient (6, 2);
+        assert (limit.take ("joe@example.com", 0) == 0);
+        assert (limit.take ("joe@example.com", 0) == 0);
+        // 6 per minute is one token in 10 s
+        assert (limit.take ("joe@example.com", 0) == 10001);
+        assert (limit.take ("jane@example.com", 0) == 0);
+        assert (limit.take ("joe@example.com", 5000) == 5001);
+        assert (limit.take ("joe@example.com", 10000) == 0);
+        const EmailRateLimit::Bucket& bucket = limit.recipients ().at ("joe@example.com");
+        assert (bucket.allowed == 3);
+        assert (bucket.deferred == 2);
+
+        // test case 03 - bucket does not grow over burst
+        assert (limit.take ("joe@example.com", 1000000) == 0);
+        assert (limit.take ("joe@example.com", 1000000) == 0);
+        assert (limit.take ("joe@example.com", 1000000) > 0);
+    }
+
+    {
+        // test case 04 - domain limit is shared by its recipients
+        EmailRateLimit limit;
+        limit.recipient (60, 10);
+        limit.domain (60, 2);
+        assert (limit.take ("1234@sms.example.com", 0) == 0);
+        assert (limit.take ("5678@SMS.example.com", 0) == 0);
+        assert (limit.take ("9999@sms.example.com", 0) == 1001);
+        assert (limit.take ("joe@example.com", 0) == 0);
+        assert (limit.domains ().at ("sms.example.com").deferred == 1);
+        // deferred email took no token from recipient
+        assert (limit.recipients ().at ("9999@sms.example.com").tokens == 10);
+        assert (limit.take ("9999@sms.example.com", 1001) == 0);
+    }
+
+    {
+        // test case 05 - full buckets are pruned
+        EmailRateLimit limit;
+        limit.recipient (60, 1);
+        for (size_t i = 0; i != EmailRateLimit::MAX_BUCKETS; i++)
+            limit.take (std::to_string (i) + "@example.com", 0);
+        assert (limit.recipients ().size () == EmailRateLimit::MAX_BUCKETS);
+        limit.take ("joe@example.com", 2000);
+        assert (limit.recipients ().size () == 1);
+    }
+    //  @end
+
+    printf ("OK\n");
+}
@@ -0,0 +1,93 @@
+/*  =========================================================================
+    emailratelimit - Token bucket rate limits of recipients
+
+    Copyright (C) 2014 - 2020 Eaton
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License along
+    with this program; if not, write to the Free Software Foundation, Inc.,
+    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+    =========================================================================
+*/
+
+
+#ifndef EMAILRATELIMIT_H_INCLUDED
+#define EMAILRATELIMIT_H_INCLUDED
+
+#include <map>
+#include <string>
+
+/**
+ * \class EmailRateLimit
+ *
+ * Token bucket for each recipient address and each recipient domain. Email
+ * takes one token from both buckets of its recipient, bucket gets rate
+ * tokens per minute up to burst. Email which finds any of them empty has to
+ * wait.
+ */
+class EmailRateLimit
+{
+    public:
+        struct Bucket {
+            double tokens;      // tokens available at last
+            int64_t last;       // last refill (ms)
+            uint64_t allowed;   // emails let through
+            uint64_t deferred;  // emails told to wait
+        };
+
+        EmailRateLimit ();
+
+        /**
+         * \brief set limits, rate 0 disables limit
+         *
+         * \param rate      emails per minute
+         * \param burst     max emails sent at once, at least 1
+         */
+        void recipient (int rate, int burst);
+        void domain (int rate, int burst);
+
+        /**
+         * \brief take token for email to recipient
+         *
+         * \param now   monotonic time in ms (zclock_mono)
+         * \return 0 if email can be sent now, otherwise ms to wait for
+         *         the token, nothing is taken then
+         */
+        int64_t take (const std::string& recipient, int64_t now);
+
+        const std::map<std::string, Bucket>& recipients () const { return _recipients; };
+        const std::map<std::string, Bucket>& domains () const { return _domains; };
+
+        // buckets of more keys than this are pruned when full
+        static const size_t MAX_BUCKETS = 10000;
+
+    protected:
+        struct Limit {
+            int rate;
+            int burst;
+        };
+
+        // refill the bucket, return ms until it has a token
+        static int64_t refill (const Limit& limit, Bucket& bucket, int64_t now);
+        static void prune (const Limit& limit, std::map<std::string, Bucket>& buckets, int64_t now);
+
+        Limit _recipient;
+        Limit _domain;
+        std::map<std::string, Bucket> _recipients;
+        std::map<std::string, Bucket> _domains;
+};
+
+//  Self test of this class
+void
+emailratelimit_test (bool verbose);
+
+#endif // EMAILRATELIMIT_H_INCLUDED
@@ -0,0 +1,229 @@
+/*  =========================================================================
+    emailrelays - Health of SMTP relays and choice of the best one
+
+    Copyright (C) 2014 - 2020 Eaton
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License along
+    with this program; if not, write to the Free Software Foundation, Inc.,
+    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+    =========================================================================
+*/
+
+
+/*
+@header
+    emailrelays - Health of SMTP relays and choice of the best one
+@discuss
+    With one relay all notifications stall when it's slow or down. Averages
+    are exponential with alpha ALPHA, failure is a connection class error
+    (see smtp_error_is_transient), other errors mean the relay works.
+@end
+*/
+
+#include <algorithm>
+#include <cmath>
+
+#include "fty_email_classes.h"
+
+#define ALPHA 0.2
+
+const int64_t EmailRelays::INITIAL_LATENCY;
+const int64_t EmailRelays::FAILURES_HALF_LIFE;
+
+EmailRelays::EmailRelays ():
+    _relays {}
+{
+}
+
+void
+EmailRelays::configure (const std::string& list, const std::string& port)
+{
+    std::vector<Relay> relays;
+    size_t pos = 0;
+    while (pos <= list.size ()) {
+        size_t end = list.find (',', pos);
+        if (end == std::string::npos)
+            end = list.size ();
+        std::string item = list.substr (pos, end - pos);
+        pos = end + 1;
+
+        size_t first = item.find_first_not_of (" \t");
+        if (first == std::string::npos)
+            continue;
+        item = item.substr (first, item.find_last_not_of (" \t") - first + 1);
+
+        int weight = 1;
+        size_t eq = item.find ('=');
+        if (eq != std::string::npos) {
+            weight = atoi (item.c_str () + eq + 1);
+            if (weight < 1) {
+                log_warning ("emailrelays: invalid weight of %s, using 1", item.c_str ());
+                weight = 1;
+            }
+            item.resize (eq);
+        }
+        // host:port, [ipv6]:port or [ipv6]
+        std::string host;
+        std::string relay_port;
+        if (!smtp_split_address (item, port, host, relay_port)) {
+            log_warning ("emailrelays: invalid relay %s, IPv6 address must be in brackets", item.c_str ());
+            continue;
+        }
+        std::string address = host.find (':') == std::string::npos ? host : "[" + host + "]";
+        address += ":" + relay_port;
+
+        Relay relay {address, host, relay_port, weight, double (INITIAL_LATENCY), 0.0, 0, 0, 0};
+        for (const auto& old : _relays)
+            if (old.address == address) {
+                relay = old;
+                relay.weight = weight;
+            }
+        relays.push_back (relay);
+    }
+    _relays.swap (relays);
+}
+
+// failures average decayed since the last result
+static double
+s_failures (const EmailRelays::Relay& relay, int64_t now)
+{
+    if (now <= relay.last)
+        return relay.failures;
+    return relay.failures * std::pow (0.5, double (now - relay.last) / EmailRelays::FAILURES_HALF_LIFE);
+}
+
+double
+EmailRelays::score (const Relay& relay, int64_t now) const
+{
+    return relay.latency * (1.0 + 10.0 * s_failures (relay, now)) / relay.weight;
+}
+
+std::string
+EmailRelays::select (
+        int64_t now,
+        const std::string& exclude,
+        std::function<bool(const std::string&)> filter) const
+{
+    std::vector<std::pair<double, size_t>> order;
+    for (size_t i = 0; i != _relays.size (); i++) {
+        double s = score (_relays [i], now);
+        // excluded relay is the last resort
+        if (_relays [i].address == exclude)
+            s = HUGE_VAL;
+        order.push_back (std::make_pair (s, i));
+    }
+    // stable, so list order breaks ties
+    std::stable_sort (order.begin (), order.end (),
+        [] (const std::pair<double, size_t>& a, const std::pair<double, size_t>& b) {
+            return a.first < b.first;
+        });
+    for (const auto& it : order)
+        if (!filter || filter (_relays [it.second].address))
+            return _relays [it.second].address;
+    return "";
+}
+
+void
+EmailRelays::result (const std::string& address, SmtpError error, int64_t latency, int64_t now)
+{
+    for (auto& relay : _relays) {
+        if (relay.address != address)
+            continue;
+        relay.failures = s_failures (relay, now);
+        if (smtp_error_is_transient (error)) {
+            relay.failures = relay.failures * (1 - ALPHA) + ALPHA;
+            relay.failed++;
+        }
+        else {
+            relay.failures = relay.failures * (1 - ALPHA);
+            relay.latency = relay.latency * (1 - ALPHA) + latency * ALPHA;
+            relay.sent++;
+        }
+        relay.last = now;
+        return;
+    }
+}
+
+//  --------------------------------------------------------------------------
+//  Self test of this class
+
+void
+emailrelays_test (bool verbose)
+{
+    printf (" * emailrelays: ");
+
+    //  @selftest
+    {
+        // test case 01 - list parsing
+        EmailRelays relays;
+        relays.configure (" mail1.example.com, mail2.example.com:2525=3,,[::1], [::1]:26 ", "25");
+        assert (relays.size () == 4);
+        assert (relays.relays () [0].address == "mail1.example.com:25");
+        assert (relays.relays () [1].address == "mail2.example.com:2525");
+        assert (relays.relays () [1].weight == 3);
+        assert (relays.relays () [2].address == "[::1]:25");
+        assert (relays.relays () [2].host == "::1");
+        assert (relays.relays () [2].port == "25");
+        assert (relays.relays () [3].address == "[::1]:26");
+        assert (relays.relays () [3].host == "::1");
+        assert (relays.relays () [3].port == "26");
+        assert (relays.relays () [1].host == "mail2.example.com");
+        assert (relays.relays () [1].port == "2525");
+
+        // bare IPv6 address is refused
+        relays.configure ("::1, mail1.example.com", "25");
+        assert (relays.size () == 1);
+        assert (relays.relays () [0].host == "mail1.example.com");
+    }
+
+    {
+        // test case 02 - first relay is used while it's fine
+        EmailRelays relays;
+        relays.configure ("a, b", "25");
+        assert (relays.select (0, "", NULL) == "a:25");
+        relays.result ("a:25", SmtpError::Succeeded, 100, 0);
+        assert (relays.select (0, "", NULL) == "a:25");
+        // recipient refused, but the relay works
+        relays.result ("a:25", SmtpError::NoRecipient, 100, 0);
+        assert (relays.select (0, "", NULL) == "a:25");
+
+        // test case 03 - failures move emails to other relay
+        for (int i = 0; i != 3; i++)
+            relays.result ("a:25", SmtpError::ServerUnreachable, 5000, 0);
+        assert (relays.relays () [0].failed == 3);
+        assert (relays.select (0, "", NULL) == "b:25");
+
+        // test case 04 - and back when they are forgotten
+        assert (relays.select (10 * EmailRelays::FAILURES_HALF_LIFE, "", NULL) == "a:25");
+
+        // test case 05 - filter and exclude
+        auto only_a = [] (const std::string& address) { return address == "a:25"; };
+        assert (relays.select (0, "", only_a) == "a:25");
+        assert (relays.select (0, "b:25", NULL) == "a:25");
+        assert (relays.select (0, "b:25", [] (const std::string&) { return false; }) == "");
+
+        // test case 06 - faster relay wins, stats are kept on reconfigure
+        relays.configure ("b, a", "25");
+        for (int i = 0; i != 10; i++)
+            relays.result ("b:25", SmtpError::Succeeded, 50, 20 * EmailRelays::FAILURES_HALF_LIFE);
+        assert (relays.relays () [1].sent == 2);
+        assert (relays.select (20 * EmailRelays::FAILURES_HALF_LIFE, "", NULL) == "b:25");
+
+        // test case 07 - weight
+        relays.configure ("b, a=100", "25");
+        assert (relays.select (20 * EmailRelays::FAILURES_HALF_LIFE, "", NULL) == "a:25");
+    }
+    //  @end
+
+    printf ("OK\n");
+}
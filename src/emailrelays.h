@@ -0,0 +1,106 @@
+/*  =========================================================================
+    emailrelays - Health of SMTP relays and choice of the best one
+
+    Copyright (C) 2014 - 2020 Eaton
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License along
+    with this program; if not, write to the Free Software Foundation, Inc.,
+    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+    =========================================================================
+*/
+
+
+#ifndef EMAILRELAYS_H_INCLUDED
+#define EMAILRELAYS_H_INCLUDED
+
+#include <functional>
+#include <string>
+#include <vector>
+
+/**
+ * \class EmailRelays
+ *
+ * SMTP relays emails can be sent through, in order of preference. Each
+ * relay has moving average of delivery latency and of connection failures,
+ * new email goes to the relay with the best score
+ *
+ *      latency * (1 + 10 * failures) / weight
+ *
+ * Relay without any delivery has latency of INITIAL_LATENCY, so the first
+ * one is used until it gets slower or fails, failures are forgotten in time.
+ */
+class EmailRelays
+{
+    public:
+        struct Relay {
+            std::string address;    // host:port or [ipv6]:port
+            std::string host;       // without brackets
+            std::string port;
+            int weight;
+            double latency;         // moving average of delivery time (ms)
+            double failures;        // moving average of connection failures (0 .. 1)
+            int64_t last;           // time of the last result
+            uint64_t sent;
+            uint64_t failed;
+        };
+
+        static const int64_t INITIAL_LATENCY = 1000;
+        static const int64_t FAILURES_HALF_LIFE = 60000;
+
+        EmailRelays ();
+
+        /**
+         * \brief set relays, statistics of relays in both old and new list are kept
+         *
+         * \param list  comma separated host[:port][=weight], IPv6 address in brackets,
+         *              invalid items are skipped with a warning
+         * \param port  default port
+         */
+        void configure (const std::string& list, const std::string& port);
+
+        /**
+         * \brief the best relay accepted by filter
+         *
+         * \param exclude   address of relay to avoid (failed last time), if there is another
+         * \param filter    is relay usable (circuit breaker)
+         * \return address of the relay or empty string if there is none
+         */
+        std::string select (
+                int64_t now,
+                const std::string& exclude,
+                std::function<bool(const std::string&)> filter) const;
+
+        /**
+         * \brief record the result of delivery via relay
+         *
+         * \param latency   duration of delivery (ms)
+         */
+        void result (const std::string& address, SmtpError error, int64_t latency, int64_t now);
+
+        /**
+         * \brief score of the relay, lower is better
+         */
+        double score (const Relay& relay, int64_t now) const;
+
+        const std::vector<Relay>& relays () const { return _relays; };
+        size_t size () const { return _relays.size (); };
+
+    protected:
+        std::vector<Relay> _relays;
+};
+
+//  Self test of this class
+void
+emailrelays_test (bool verbose);
+
+#endif // EMAILRELAYS_H_INCLUDED
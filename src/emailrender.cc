@@ -0,0 +1,203 @@
+/*  =========================================================================
+    emailrender - Cache of rendered alert emails
+
+    Copyright (C) 2014 - 2020 Eaton
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License along
+    with this program; if not, write to the Free Software Foundation, Inc.,
+    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+    =========================================================================
+*/
+
+
+/*
+@header
+    emailrender - Cache of rendered alert emails
+@discuss
+    Contacts of the asset get their SENDMAIL_ALERT messages one after another,
+    so rendered email is needed only for a few seconds. Entries are forgotten
+    in order of insertion, when they are older than ttl or there are more of
+    them than capacity.
+@end
+*/
+
+#include "fty_email_classes.h"
+
+EmailRenders::EmailRenders (int64_t ttl, size_t capacity):
+    _ttl {ttl},
+    _capacity {capacity > 0 ? capacity : 1},
+    _renders {},
+    _order {},
+    _hits {0},
+    _misses {0}
+{
+}
+
+std::string
+EmailRenders::key (
+        fty_proto_t *alert,
+        const std::string& priority,
+        const std::string& extname,
+        const std::string& language)
+{
+    // description goes last, it's the only one which may have line breaks
+    std::string key = language;
+    for (const std::string& part : {
+            priority,
+            extname,
+            std::string (fty_proto_rule (alert)),
+            std::string (fty_proto_name (alert)),
+            std::string (fty_proto_state (alert)),
+            std::string (fty_proto_severity (alert)),
+            std::string (fty_proto_description (alert))})
+        key += "\n" + part;
+    return key;
+}
+
+void
+EmailRenders::expire (int64_t now)
+{
+    while (!_order.empty () && (now - _order.front ().first >= _ttl || _renders.size () > _capacity)) {
+        auto it = _renders.find (_order.front ().second);
+        if (it != _renders.end () && it->second.since == _order.front ().first)
+            _renders.erase (it);
+        _order.pop_front ();
+    }
+}
+
+EmailRenders::Render
+EmailRenders::get (const std::string& key, int64_t now, const std::function<Render ()>& render)
+{
+    expire (now);
+    auto it = _renders.find (key);
+    if (it != _renders.end ()) {
+        _hits++;
+        return it->second.render;
+    }
+
+    _misses++;
+    Render result = render ();
+    if (_ttl > 0) {
+        _renders [key] = Entry {result, now};
+        _order.push_back (std::make_pair (now, key));
+        expire (now);
+    }
+    return result;
+}
+
+void
+EmailRenders::clear ()
+{
+    _renders.clear ();
+    _order.clear ();
+}
+
+//  --------------------------------------------------------------------------
+//  Self test of this class
+
+static fty_proto_t *
+s_alert (const char *state, const char *description)
+{
+    zmsg_t *msg = fty_proto_encode_alert (NULL, 1000, 600, "rule", "asset", state, "CRITICAL", description, NULL);
+    assert (msg);
+    fty_proto_t *alert = fty_proto_decode (&msg);
+    assert (alert);
+    return alert;
+}
+
+void
+emailrender_test (bool verbose)
+{
+    printf (" * emailrender: ");
+
+    //  @selftest
+    {
+        // test case 01 - key has everything the email depends on but contact
+        fty_proto_t *alert = s_alert ("ACTIVE", "Load is high");
+        fty_proto_t *resolved = s_alert ("RESOLVED", "Load is high");
+        fty_proto_t *other = s_alert ("ACTIVE", "Load is\nhigh");
+        std::string key = EmailRenders::key (alert, "1", "UPS 1", "en_US");
+        assert (key == EmailRenders::key (alert, "1", "UPS 1", "en_US"));
+        assert (key != EmailRenders::key (alert, "2", "UPS 1", "en_US"));
+        assert (key != EmailRenders::key (alert, "1", "UPS 2", "en_US"));
+        assert (key != EmailRenders::key (alert, "1", "UPS 1", "fr_FR"));
+        assert (key != EmailRenders::key (resolved, "1", "UPS 1", "en_US"));
+        assert (key != EmailRenders::key (other, "1", "UPS 1", "en_US"));
+        fty_proto_destroy (&other);
+        fty_proto_destroy (&resolved);
+        fty_proto_destroy (&alert);
+    }
+
+    {
+        // test case 02 - email is rendered once for all contacts
+        EmailRenders renders (1000, 2);
+        int rendered = 0;
+        auto render = [&] () {
+            rendered++;
+            return EmailRenders::Render {"subject " + std::to_string (rendered), "body"};
+        };
+        for (int i = 0; i != 5; i++) {
+            EmailRenders::Render email = renders.get ("alert1", 100 + i, render);
+            assert (email.subject == "subject 1");
+            assert (email.body == "body");
+        }
+        assert (rendered == 1);
+        assert (renders.hits () == 4);
+        assert (renders.misses () == 1);
+
+        // test case 03 - and again after ttl
+        assert (renders.get ("alert1", 1100, render).subject == "subject 2");
+        assert (renders.size () == 1);
+
+        // test case 04 - oldest emails are forgotten over capacity
+        renders.get ("alert2", 1101, render);
+        renders.get ("alert3", 1102, render);
+        assert (renders.size () == 2);
+        assert (renders.get ("alert1", 1103, render).subject == "subject 5");
+        assert (renders.get ("alert3", 1104, render).subject == "subject 4");
+
+        // test case 05 - failed render is not cached
+        auto failing = [&] () -> EmailRenders::Render {
+            throw std::runtime_error ("no template");
+        };
+        try {
+            renders.get ("alert4", 1105, failing);
+            assert (false);
+        }
+        catch (const std::runtime_error& e) {
+        }
+        assert (renders.get ("alert4", 1106, render).subject == "subject 6");
+
+        // test case 06 - cleared cache renders again
+        renders.clear ();
+        assert (renders.size () == 0);
+        assert (renders.get ("alert4", 1107, render).subject == "subject 7");
+    }
+
+    {
+        // test case 07 - zero ttl disables caching
+        EmailRenders renders (0);
+        int rendered = 0;
+        auto render = [&] () {
+            rendered++;
+            return EmailRenders::Render {"subject", "body"};
+        };
+        renders.get ("alert", 0, render);
+        renders.get ("alert", 0, render);
+        assert (rendered == 2);
+        assert (renders.size () == 0);
+    }
+    //  @end
+
+    printf ("OK\n");
+}
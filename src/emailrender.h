@@ -0,0 +1,106 @@
+/*  =========================================================================
+    emailrender - Cache of rendered alert emails
+
+    Copyright (C) 2014 - 2020 Eaton
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License along
+    with this program; if not, write to the Free Software Foundation, Inc.,
+    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+    =========================================================================
+*/
+
+
+#ifndef EMAILRENDER_H_INCLUDED
+#define EMAILRENDER_H_INCLUDED
+
+#include <deque>
+#include <functional>
+#include <map>
+#include <string>
+
+/**
+ * \class EmailRenders
+ *
+ * Alert is sent to every contact of the asset as separate SENDMAIL_ALERT
+ * message, each of them renders the same subject and body from templates
+ * and translations. Rendered email is kept for a short time under the key
+ * of everything it depends on, so the next contacts only get their To.
+ */
+class EmailRenders
+{
+    public:
+        struct Render {
+            std::string subject;
+            std::string body;
+        };
+
+        /**
+         * \param ttl       rendered email is kept for (ms)
+         * \param capacity  max number of rendered emails kept
+         */
+        explicit EmailRenders (int64_t ttl = 10000, size_t capacity = 256);
+
+        /**
+         * \brief key of alert email, all it depends on but the contact
+         */
+        static std::string key (
+                fty_proto_t *alert,
+                const std::string& priority,
+                const std::string& extname,
+                const std::string& language);
+
+        /**
+         * \brief rendered email for the key, render is called if there is none
+         *
+         * Exceptions of render are passed to the caller, nothing is cached.
+         *
+         * \param now   monotonic time in ms (zclock_mono)
+         */
+        Render get (const std::string& key, int64_t now, const std::function<Render ()>& render);
+
+        /**
+         * \brief forget all rendered emails, e.g. when language changes
+         */
+        void clear ();
+
+        size_t size () const { return _renders.size (); };
+
+        uint64_t hits () const { return _hits; };
+        uint64_t misses () const { return _misses; };
+
+    protected:
+        struct Entry {
+            Render render;
+            int64_t since;
+        };
+
+        void expire (int64_t now);
+
+        int64_t _ttl;
+        size_t _capacity;
+        std::map<std::string, Entry> _renders;
+        // (since, key) in order of since, to forget old emails
+        std::deque<std::pair<int64_t, std::string>> _order;
+        uint64_t _hits;
+        uint64_t _misses;
+
+    private:
+        EmailRenders (const EmailRenders&) = delete;
+        EmailRenders& operator= (const EmailRenders&) = delete;
+};
+
+//  Self test of this class
+void
+emailrender_test (bool verbose);
+
+#endif // EMAILRENDER_H_INCLUDED
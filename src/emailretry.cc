@@ -0,0 +1,238 @@
+/*  =========================================================================
+    emailretry - Scheduler of delivery retries
+
+    Copyright (C) 2014 - 2020 Eaton
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License along
+    with this program; if not, write to the Free Software Foundation, Inc.,
+    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+    =========================================================================
+*/
+
+/*
+@header
+    emailretry - Scheduler of delivery retries
+@discuss
+    Timer wheel has slots of tick ms. Job expiring in N ticks is put to slot
+    (current + N) % slots with N / slots full rounds to wait, every tick moves
+    to the next slot and expires its jobs with no rounds left.
+
+    Delay is "equal jitter" backoff: half of min (initial * 2^(attempts-1),
+    max_interval) plus random part up to the other half.
+@end
+*/
+
+#include "fty_email_classes.h"
+
+EmailRetry::EmailRetry (int64_t tick, size_t slots):
+    _initial {30000},
+    _max_interval {600000},
+    _max_age {3600000},
+    _tick {tick > 0 ? tick : 1},
+    _wheel (slots > 0 ? slots : 1),
+    _current {0},
+    _last_tick {0},
+    _size {0}
+{
+}
+
+EmailRetry::~EmailRetry ()
+{
+    for (auto& slot : _wheel)
+        for (auto& timer : slot)
+            delete timer.job;
+}
+
+void
+EmailRetry::policy (int64_t initial, int64_t max_interval, int64_t max_age)
+{
+    _initial = initial > 0 ? initial : 1;
+    _max_interval = max_interval > _initial ? max_interval : _initial;
+    _max_age = max_age;
+}
+
+int64_t
+EmailRetry::backoff (int attempts) const
+{
+    int64_t delay = _initial;
+    for (int i = 1; i < attempts && delay < _max_interval; i++)
+        delay *= 2;
+    return delay < _max_interval ? delay : _max_interval;
+}
+
+bool
+EmailRetry::schedule (EmailJob *job, int64_t now)
+{
+    if (_max_age <= 0)
+        return false;
+    if (!smtp_error_is_transient (static_cast <SmtpError> (job->code)))
+        return false;
+    if (zclock_time () - job->created >= _max_age)
+        return false;
+
+    int64_t delay = backoff (job->attempts);
+    delay = delay / 2 + randof (delay / 2 + 1);
+    add (job, delay, now);
+    return true;
+}
+
+void
+EmailRetry::add (EmailJob *job, int64_t delay, int64_t now)
+{
+    if (_size == 0)
+        _last_tick = now;
+
+    // count the delay from the last tick
+    int64_t ticks = (now - _last_tick + delay + _tick - 1) / _tick;
+    if (ticks < 1)
+        ticks = 1;
+
+    size_t slots = _wheel.size ();
+    size_t slot = (_current + ticks) % slots;
+    _wheel [slot].push_back (Timer {job, static_cast <size_t> ((ticks - 1) / slots)});
+    _size++;
+}
+
+std::vector<EmailJob*>
+EmailRetry::expired (int64_t now)
+{
+    std::vector<EmailJob*> jobs;
+    while (_size > 0 && now - _last_tick >= _tick) {
+        _last_tick += _tick;
+        _current = (_current + 1) % _wheel.size ();
+
+        auto& slot = _wheel [_current];
+        for (auto it = slot.begin (); it != slot.end (); ) {
+            if (it->rounds > 0) {
+                it->rounds--;
+                ++it;
+                continue;
+            }
+            jobs.push_back (it->job);
+            it = slot.erase (it);
+            _size--;
+        }
+    }
+    return jobs;
+}
+
+int
+EmailRetry::timeout (int64_t now) const
+{
+    if (_size == 0)
+        return -1;
+    int64_t timeout = _last_tick + _tick - now;
+    return timeout > 0 ? static_cast <int> (timeout) : 0;
+}
+
+//  --------------------------------------------------------------------------
+//  Self test of this class
+
+static EmailJob *
+s_failed_job (SmtpError error, int attempts)
+{
+    EmailJob *job = new EmailJob ();
+    job->ok = false;
+    job->code = static_cast <uint32_t> (error);
+    job->attempts = attempts;
+    return job;
+}
+
+void
+emailretry_test (bool verbose)
+{
+    printf (" * emailretry: ");
+
+    //  @selftest
+    {
+        // test case 01 - exponential backoff is capped
+        EmailRetry retry;
+        retry.policy (20, 80, 10000);
+        assert (retry.backoff (1) == 20);
+        assert (retry.backoff (2) == 40);
+        assert (retry.backoff (3) == 80);
+        assert (retry.backoff (100) == 80);
+    }
+
+    {
+        // test case 02 - transient failure is retried after the delay
+        EmailRetry retry (10, 8);
+        retry.policy (40, 1000, 10000);
+        int64_t now = 1000;
+        EmailJob *job = s_failed_job (SmtpError::ServerUnreachable, 1);
+        assert (retry.schedule (job, now));
+        assert (retry.size () == 1);
+        assert (retry.timeout (now) == 10);
+
+        // delay is 20..40 ms
+        assert (retry.expired (now + 15).empty ());
+        std::vector<EmailJob*> jobs = retry.expired (now + 40);
+        assert (jobs.size () == 1);
+        assert (jobs [0] == job);
+        assert (retry.size () == 0);
+        assert (retry.timeout (now + 40) == -1);
+        delete job;
+
+        // test case 03 - permanent failures and old jobs are not retried
+        job = s_failed_job (SmtpError::AuthFailed, 1);
+        assert (!retry.schedule (job, now));
+        delete job;
+
+        job = s_failed_job (SmtpError::DNSFailed, 1);
+        job->created = zclock_time () - 20000;
+        assert (!retry.schedule (job, now));
+        delete job;
+
+        retry.policy (40, 1000, 0);
+        job = s_failed_job (SmtpError::DNSFailed, 1);
+        assert (!retry.schedule (job, now));
+        delete job;
+    }
+
+    {
+        // test case 04 - delays longer than the wheel take more rounds
+        EmailRetry retry (10, 8);
+        retry.policy (1000, 1000, 10000);
+        int64_t now = 0;
+        for (int i = 0; i != 100; i++)
+            assert (retry.schedule (s_failed_job (SmtpError::ServerUnreachable, 1), now));
+        assert (retry.size () == 100);
+
+        size_t count = 0;
+        for (int64_t t = 0; t <= 1010; t += 10) {
+            std::vector<EmailJob*> jobs = retry.expired (t);
+            // delay is 500..1000 ms
+            assert (t >= 500 || jobs.empty ());
+            count += jobs.size ();
+            for (auto job : jobs)
+                delete job;
+        }
+        assert (count == 100);
+        assert (retry.size () == 0);
+
+        // test case 05 - deferred job expires after its delay
+        EmailJob *job = s_failed_job (SmtpError::Succeeded, 0);
+        retry.defer (job, 35, now);
+        assert (retry.expired (now + 30).empty ());
+        std::vector<EmailJob*> jobs = retry.expired (now + 40);
+        assert (jobs.size () == 1);
+        assert (jobs [0] == job);
+        delete job;
+
+        // test case 06 - jobs still waiting are deleted with the scheduler
+        assert (retry.schedule (s_failed_job (SmtpError::ServerUnreachable, 3), now));
+    }
+    //  @end
+
+    printf ("OK\n");
+}
@@ -0,0 +1,122 @@
+/*  =========================================================================
+    emailretry - Scheduler of delivery retries
+
+    Copyright (C) 2014 - 2020 Eaton
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License along
+    with this program; if not, write to the Free Software Foundation, Inc.,
+    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+    =========================================================================
+*/
+
+#ifndef EMAILRETRY_H_INCLUDED
+#define EMAILRETRY_H_INCLUDED
+
+#include <list>
+#include <vector>
+
+/**
+ * \class EmailRetry
+ *
+ * Holds jobs which failed with transient error (see smtp_error_is_transient)
+ * until their next attempt. Delay grows exponentially with the number of
+ * attempts, with random jitter, so emails failed in one burst are not
+ * retried in one burst again. Job is given up when it's older than max age.
+ *
+ * Jobs are kept in hashed timer wheel, so scheduling and expiry costs O(1)
+ * per job no matter how many of them are waiting. Owner calls expired ()
+ * regularly, timeout () says how long it can sleep.
+ */
+class EmailRetry
+{
+    public:
+        /**
+         * \param tick      resolution of the timer wheel in ms
+         * \param slots     number of slots of the timer wheel
+         */
+        explicit EmailRetry (int64_t tick = 1000, size_t slots = 512);
+
+        /**
+         * \brief delete all waiting jobs
+         */
+        ~EmailRetry ();
+
+        /**
+         * \brief set retry policy
+         *
+         * \param initial       delay before the first retry in ms
+         * \param max_interval  max delay between retries in ms
+         * \param max_age       give up when job is older (ms), 0 disables retries
+         */
+        void policy (int64_t initial, int64_t max_interval, int64_t max_age);
+
+        /**
+         * \brief schedule next attempt of the failed job
+         *
+         * \return true if the job was scheduled, EmailRetry owns it then,
+         *         false if job must not be retried (permanent error or too old)
+         */
+        bool schedule (EmailJob *job, int64_t now);
+
+        /**
+         * \brief hold the job for delay ms, not counted as an attempt
+         */
+        void defer (EmailJob *job, int64_t delay, int64_t now) { add (job, delay, now); };
+
+        /**
+         * \brief return jobs ready for the next attempt, caller owns them
+         *
+         * \param now   monotonic time in ms (zclock_mono)
+         */
+        std::vector<EmailJob*> expired (int64_t now);
+
+        /**
+         * \brief ms until the next job can expire, -1 if there is none
+         */
+        int timeout (int64_t now) const;
+
+        /**
+         * \brief delay before next attempt of the job, without jitter
+         */
+        int64_t backoff (int attempts) const;
+
+        size_t size () const { return _size; };
+
+    protected:
+        struct Timer {
+            EmailJob *job;
+            size_t rounds;  // full turns of the wheel before expiry
+        };
+
+        void add (EmailJob *job, int64_t delay, int64_t now);
+
+        int64_t _initial;
+        int64_t _max_interval;
+        int64_t _max_age;
+
+        int64_t _tick;
+        std::vector<std::list<Timer>> _wheel;
+        size_t _current;        // slot of the last tick
+        int64_t _last_tick;     // time of the last tick
+        size_t _size;
+
+    private:
+        EmailRetry (const EmailRetry&) = delete;
+        EmailRetry& operator= (const EmailRetry&) = delete;
+};
+
+//  Self test of this class
+void
+emailretry_test (bool verbose);
+
+#endif // EMAILRETRY_H_INCLUDED
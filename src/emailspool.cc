@@ -0,0 +1,641 @@
+/*  =========================================================================
+    emailspool - Durable journal of emails waiting for delivery
+
+    Copyright (C) 2014 - 2020 Eaton
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License along
+    with this program; if not, write to the Free Software Foundation, Inc.,
+    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+    =========================================================================
+*/
+
+/*
+@header
+    emailspool - Durable journal of emails waiting for delivery
+@discuss
+    Journal is a sequence of records
+
+        [size:4][checksum:4][op:1][id:8][job]
+
+    where size is the length of everything after checksum and checksum is
+    FNV-1a of the same bytes. op is 'A' for accepted job followed by the
+    serialized EmailJob, or 'D' for the delivered one without any job.
+    Numbers are stored in host byte order, journal is not meant to be moved
+    between machines.
+
+    DONE records are not synced, so an email can be delivered twice after a
+    crash, but it's never lost.
+@end
+*/
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <cerrno>
+#include <cstring>
+#include <iterator>
+
+#include "fty_email_classes.h"
+
+// rewrite the journal when it's bigger and at least half of it is delivered
+#define SPOOL_COMPACT_SIZE (1024*1024)
+
+static uint32_t
+s_checksum (const char *data, size_t size)
+{
+    uint32_t hash = 2166136261u;
+    for (size_t i = 0; i != size; i++) {
+        hash ^= static_cast <unsigned char> (data [i]);
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+static void
+s_put_u32 (std::string& buf, uint32_t value)
+{
+    buf.append (reinterpret_cast <const char*> (&value), sizeof (value));
+}
+
+static void
+s_put_u64 (std::string& buf, uint64_t value)
+{
+    buf.append (reinterpret_cast <const char*> (&value), sizeof (value));
+}
+
+static void
+s_put_str (std::string& buf, const std::string& value)
+{
+    s_put_u32 (buf, value.size ());
+    buf.append (value);
+}
+
+//  Reads values stored by s_put_* functions, any read past the end of
+//  buffer fails and makes all next reads fail too.
+struct s_reader_t {
+    const std::string& buf;
+    size_t pos;
+    bool ok;
+
+    bool get (void *value, size_t size) {
+        if (!ok || buf.size () - pos < size)
+            return ok = false;
+        memcpy (value, buf.data () + pos, size);
+        pos += size;
+        return true;
+    }
+
+    bool get_str (std::string& value) {
+        uint32_t size = 0;
+        if (!get (&size, sizeof (size)) || buf.size () - pos < size)
+            return ok = false;
+        value.assign (buf, pos, size);
+        pos += size;
+        return true;
+    }
+};
+
+static std::string
+s_record (char op, uint64_t id, const std::string& job)
+{
+    std::string payload;
+    payload += op;
+    s_put_u64 (payload, id);
+    payload += job;
+
+    std::string record;
+    s_put_u32 (record, payload.size ());
+    s_put_u32 (record, s_checksum (payload.data (), payload.size ()));
+    record += payload;
+    return record;
+}
+
+static std::string
+s_job_encode (const EmailJob& job)
+{
+    std::string buf;
+    buf += static_cast <char> (job.type);
+    s_put_u64 (buf, job.created);
+    s_put_u32 (buf, job.priority);
+    s_put_str (buf, job.alert);
+    s_put_str (buf, job.state);
+    buf += static_cast <char> (job.discard);
+    s_put_str (buf, job.sender);
+    s_put_str (buf, job.uuid);
+    s_put_str (buf, job.to);
+    s_put_str (buf, job.subject);
+    s_put_str (buf, job.body);
+
+    if (!job.mail) {
+        s_put_u32 (buf, 0);
+        return buf;
+    }
+    s_put_u32 (buf, zmsg_size (job.mail));
+    for (zframe_t *frame = zmsg_first (job.mail); frame; frame = zmsg_next (job.mail))
+        s_put_str (buf, std::string (reinterpret_cast <char*> (zframe_data (frame)), zframe_size (frame)));
+    return buf;
+}
+
+static bool
+s_job_decode (const std::string& buf, EmailJob& job)
+{
+    s_reader_t reader {buf, 0, true};
+    char type = 0;
+    reader.get (&type, 1);
+    if (type < static_cast <char> (EmailJob::Type::SENDMAIL) || type > static_cast <char> (EmailJob::Type::SENDSMS_ALERT))
+        return false;
+    job.type = static_cast <EmailJob::Type> (type);
+    reader.get (&job.created, sizeof (job.created));
+    reader.get (&job.priority, sizeof (job.priority));
+    reader.get_str (job.alert);
+    reader.get_str (job.state);
+    char discard = 0;
+    reader.get (&discard, 1);
+    job.discard = discard != 0;
+    reader.get_str (job.sender);
+    reader.get_str (job.uuid);
+    reader.get_str (job.to);
+    reader.get_str (job.subject);
+    reader.get_str (job.body);
+
+    uint32_t frames = 0;
+    reader.get (&frames, sizeof (frames));
+    if (frames > 0) {
+        zmsg_destroy (&job.mail);
+        job.mail = zmsg_new ();
+        std::string frame;
+        for (uint32_t i = 0; i != frames && reader.get_str (frame); i++)
+            zmsg_addmem (job.mail, frame.data (), frame.size ());
+    }
+    return reader.ok;
+}
+
+static void
+s_sync_directory (const std::string& directory)
+{
+    int fd = open (directory.c_str (), O_RDONLY | O_DIRECTORY);
+    if (fd == -1)
+        return;
+    fsync (fd);
+    close (fd);
+}
+
+EmailSpool::EmailSpool (const std::string& directory):
+    _directory {directory},
+    _path {directory + "/journal"},
+    _fd {-1},
+    _size {0},
+    _uncommitted {0},
+    _next_id {1},
+    _live {},
+    _live_size {0}
+{
+    if (zsys_dir_create ("%s", _directory.c_str ()) == -1)
+        throw std::runtime_error ("spool: cannot create directory " + _directory + ": " + strerror (errno));
+
+    _fd = open (_path.c_str (), O_RDWR | O_CREAT | O_APPEND | O_CLOEXEC, 0600);
+    if (_fd == -1)
+        throw std::runtime_error ("spool: cannot open " + _path + ": " + strerror (errno));
+
+    std::string journal;
+    char buf [65536];
+    ssize_t r;
+    while ((r = pread (_fd, buf, sizeof (buf), journal.size ())) > 0)
+        journal.append (buf, r);
+    if (r == -1) {
+        int err = errno;
+        close (_fd);
+        throw std::runtime_error ("spool: cannot read " + _path + ": " + strerror (err));
+    }
+
+    s_reader_t reader {journal, 0, true};
+    size_t valid = 0;
+    while (reader.pos < journal.size ()) {
+        uint32_t size = 0;
+        uint32_t checksum = 0;
+        reader.get (&size, sizeof (size));
+        reader.get (&checksum, sizeof (checksum));
+        if (!reader.ok || journal.size () - reader.pos < size || size < 9
+         || s_checksum (journal.data () + reader.pos, size) != checksum)
+            break;
+
+        char op = journal [reader.pos];
+        uint64_t id;
+        memcpy (&id, journal.data () + reader.pos + 1, sizeof (id));
+        if (op == 'A') {
+            _live [id] = journal.substr (reader.pos + 9, size - 9);
+            _live_size += size + 8;
+        }
+        else
+        if (op == 'D') {
+            auto it = _live.find (id);
+            if (it != _live.end ()) {
+                _live_size -= it->second.size () + 17;
+                _live.erase (it);
+            }
+        }
+        if (id >= _next_id)
+            _next_id = id + 1;
+        reader.pos += size;
+        valid = reader.pos;
+    }
+
+    _size = journal.size ();
+    if (valid != _size) {
+        log_warning ("spool: ignoring %zu damaged bytes at the end of %s", _size - valid, _path.c_str ());
+        if (ftruncate (_fd, valid) == -1)
+            log_error ("spool: cannot truncate %s: %s", _path.c_str (), strerror (errno));
+        _size = valid;
+    }
+    log_info ("spool: %s has %zu undelivered emails", _path.c_str (), _live.size ());
+    s_sync_directory (_directory);
+}
+
+EmailSpool::~EmailSpool ()
+{
+    if (_fd != -1) {
+        if (_uncommitted > 0)
+            fdatasync (_fd);
+        close (_fd);
+    }
+}
+
+std::vector<EmailJob*>
+EmailSpool::replay ()
+{
+    std::vector<EmailJob*> jobs;
+    for (auto it = _live.begin (); it != _live.end (); ) {
+        EmailJob *job = new EmailJob ();
+        if (!s_job_decode (it->second, *job)) {
+            log_error ("spool: cannot decode email %" PRIu64 ", dropping it", it->first);
+            delete job;
+            _live_size -= it->second.size () + 17;
+            it = _live.erase (it);
+            continue;
+        }
+        job->spool_id = it->first;
+        jobs.push_back (job);
+        ++it;
+    }
+    // old journal is still valid, it's compacted by done () later
+    try {
+        compact ();
+    }
+    catch (const std::exception &e) {
+        log_error ("%s", e.what ());
+    }
+    return jobs;
+}
+
+void
+EmailSpool::append (EmailJob& job)
+{
+    uint64_t id = _next_id;
+    std::string data = s_job_encode (job);
+    write_record (s_record ('A', id, data));
+
+    _next_id++;
+    _live_size += data.size () + 17;
+    _live [id] = std::move (data);
+    _uncommitted++;
+    job.spool_id = id;
+}
+
+void
+EmailSpool::commit ()
+{
+    if (_uncommitted == 0)
+        return;
+    if (fdatasync (_fd) == -1)
+        throw std::runtime_error ("spool: cannot sync " + _path + ": " + strerror (errno));
+    _uncommitted = 0;
+}
+
+void
+EmailSpool::done (const EmailJob& job)
+{
+    auto it = _live.find (job.spool_id);
+    if (job.spool_id == 0 || it == _live.end ())
+        return;
+    _live_size -= it->second.size () + 17;
+    _live.erase (it);
+
+    try {
+        if (_live.empty ()) {
+            // nothing to replay, start from scratch
+            if (ftruncate (_fd, 0) == -1)
+                throw std::runtime_error ("spool: cannot truncate " + _path + ": " + strerror (errno));
+            _size = 0;
+            _uncommitted = 0;
+            return;
+        }
+
+        write_record (s_record ('D', job.spool_id, ""));
+        if (_size > SPOOL_COMPACT_SIZE && _live_size * 2 < _size)
+            compact ();
+    }
+    catch (const std::exception &e) {
+        log_error ("%s", e.what ());
+    }
+}
+
+void
+EmailSpool::write_record (const std::string& record)
+{
+    const char *data = record.data ();
+    size_t size = record.size ();
+    while (size > 0) {
+        ssize_t r = write (_fd, data, size);
+        if (r == -1 && errno == EINTR)
+            continue;
+        if (r == -1) {
+            int err = errno;
+            // don't leave partial record followed by valid ones
+            if (ftruncate (_fd, _size) == -1)
+                log_error ("spool: cannot truncate %s: %s", _path.c_str (), strerror (errno));
+            throw std::runtime_error ("spool: cannot write " + _path + ": " + strerror (err));
+        }
+        data += r;
+        size -= r;
+    }
+    _size += record.size ();
+}
+
+//  Rewrite the journal with undelivered jobs only. New journal is synced and
+//  renamed over the old one, so a crash leaves either of them complete.
+void
+EmailSpool::compact ()
+{
+    if (_size == _live_size)
+        return;
+
+    std::string tmp = _path + ".tmp";
+    int fd = open (tmp.c_str (), O_WRONLY | O_CREAT | O_TRUNC | O_APPEND | O_CLOEXEC, 0600);
+    if (fd == -1)
+        throw std::runtime_error ("spool: cannot open " + tmp + ": " + strerror (errno));
+
+    std::string buf;
+    size_t size = 0;
+    std::string error;
+    for (auto it = _live.begin (); error.empty () && it != _live.end (); ++it) {
+        buf += s_record ('A', it->first, it->second);
+        if (buf.size () >= 65536 || std::next (it) == _live.end ()) {
+            ssize_t r = write (fd, buf.data (), buf.size ());
+            if (r == -1)
+                error = strerror (errno);
+            else
+            if (static_cast <size_t> (r) != buf.size ())
+                error = "short write, " + std::to_string (r) + " of " + std::to_string (buf.size ()) + " bytes written";
+            size += buf.size ();
+            buf.clear ();
+        }
+    }
+    if (error.empty () && fdatasync (fd) == -1)
+        error = strerror (errno);
+    if (!error.empty ()) {
+        close (fd);
+        unlink (tmp.c_str ());
+        throw std::runtime_error ("spool: cannot write " + tmp + ": " + error);
+    }
+    if (rename (tmp.c_str (), _path.c_str ()) == -1) {
+        int err = errno;
+        close (fd);
+        unlink (tmp.c_str ());
+        throw std::runtime_error ("spool: cannot rename " + tmp + ": " + strerror (err));
+    }
+    s_sync_directory (_directory);
+
+    log_debug ("spool: compacted %s from %zu to %zu bytes", _path.c_str (), _size, size);
+    close (_fd);
+    _fd = fd;
+    _size = size;
+    _uncommitted = 0;
+}
+
+//  --------------------------------------------------------------------------
+//  Self test of this class
+
+static EmailJob *
+s_test_job (const char *uuid)
+{
+    EmailJob *job = new EmailJob ();
+    job->type = EmailJob::Type::SENDMAIL_ALERT;
+    job->sender = "alert-producer";
+    job->uuid = uuid;
+    job->priority = 2;
+    job->alert = "rule@asset\njoe@example.com";
+    job->state = "ACTIVE";
+    job->to = "joe@example.com";
+    job->subject = "Subject";
+    job->body = "body";
+    return job;
+}
+
+void
+emailspool_test (bool verbose)
+{
+    printf (" * emailspool: ");
+
+    //  @selftest
+    const char *SELFTEST_DIR_RW = "src/selftest-rw";
+    std::string directory = std::string (SELFTEST_DIR_RW) + "/spool";
+    std::string journal = directory + "/journal";
+    zsys_file_delete ("%s", journal.c_str ());
+
+    {
+        // test case 01 - undelivered jobs are replayed
+        EmailSpool *spool = new EmailSpool (directory);
+        assert (spool->live () == 0);
+        assert (spool->replay ().empty ());
+
+        EmailJob *job1 = s_test_job ("UUID1");
+        EmailJob *job2 = new EmailJob ();
+        job2->uuid = "UUID2";
+        job2->mail = fty_email_encode ("UUID2", "foo@bar", "Subject", NULL, "body", "/etc/hosts", NULL);
+        char *uuid = zmsg_popstr (job2->mail);
+        zstr_free (&uuid);
+        EmailJob *job3 = s_test_job ("UUID3");
+
+        spool->append (*job1);
+        spool->append (*job2);
+        spool->append (*job3);
+        assert (spool->uncommitted () == 3);
+        spool->commit ();
+        assert (spool->uncommitted () == 0);
+        assert (job1->spool_id != 0 && job1->spool_id != job2->spool_id);
+
+        spool->done (*job1);
+        assert (spool->live () == 2);
+        delete spool;
+        int64_t created3 = job3->created;
+        delete job1;
+        delete job3;
+
+        spool = new EmailSpool (directory);
+        assert (spool->live () == 2);
+        std::vector<EmailJob*> jobs = spool->replay ();
+        assert (jobs.size () == 2);
+        assert (jobs [0]->type == EmailJob::Type::SENDMAIL);
+        assert (jobs [0]->uuid == "UUID2");
+        assert (jobs [0]->spool_id == job2->spool_id);
+        assert (jobs [0]->mail);
+        assert (zmsg_size (jobs [0]->mail) == 5);
+        char *to = zmsg_popstr (jobs [0]->mail);
+        assert (streq (to, "foo@bar"));
+        zstr_free (&to);
+        assert (jobs [1]->type == EmailJob::Type::SENDMAIL_ALERT);
+        assert (jobs [1]->sender == "alert-producer");
+        assert (jobs [1]->uuid == "UUID3");
+        assert (jobs [1]->created == created3);
+        assert (jobs [1]->priority == 2);
+        assert (jobs [1]->alert == "rule@asset\njoe@example.com");
+        assert (jobs [1]->state == "ACTIVE");
+        assert (jobs [1]->to == "joe@example.com");
+        assert (jobs [1]->subject == "Subject");
+        assert (jobs [1]->body == "body");
+        assert (!jobs [1]->mail);
+        delete job2;
+
+        // replay compacted the journal
+        assert (spool->size () < 1024);
+
+        // test case 02 - journal is truncated when everything is delivered
+        for (auto job : jobs) {
+            spool->done (*job);
+            delete job;
+        }
+        assert (spool->live () == 0);
+        assert (spool->size () == 0);
+        delete spool;
+    }
+
+    {
+        // test case 03 - damaged record at the end is ignored
+        EmailSpool *spool = new EmailSpool (directory);
+        EmailJob *job = s_test_job ("UUID4");
+        spool->append (*job);
+        spool->commit ();
+        delete spool;
+        delete job;
+
+        FILE *f = fopen (journal.c_str (), "a");
+        assert (f);
+        fwrite ("\x40\x00\x00\x00garbage", 1, 11, f);
+        fclose (f);
+
+        spool = new EmailSpool (directory);
+        std::vector<EmailJob*> jobs = spool->replay ();
+        assert (jobs.size () == 1);
+        assert (jobs [0]->uuid == "UUID4");
+
+        // next append does not follow the garbage
+        job = s_test_job ("UUID5");
+        spool->append (*job);
+        spool->commit ();
+        delete spool;
+        delete job;
+        delete jobs [0];
+
+        spool = new EmailSpool (directory);
+        jobs = spool->replay ();
+        assert (jobs.size () == 2);
+        for (auto job : jobs) {
+            spool->done (*job);
+            delete job;
+        }
+        delete spool;
+    }
+
+    {
+        // test case 04 - journal full of delivered emails is compacted
+        EmailSpool *spool = new EmailSpool (directory);
+        EmailJob *keep = s_test_job ("KEEP");
+        spool->append (*keep);
+        EmailJob *job = s_test_job ("UUID");
+        job->body = std::string (4096, 'x');
+        for (int i = 0; i != 512; i++) {
+            spool->append (*job);
+            spool->done (*job);
+        }
+        spool->commit ();
+        assert (spool->live () == 1);
+        assert (spool->size () < SPOOL_COMPACT_SIZE);
+        delete job;
+        spool->done (*keep);
+        delete keep;
+        delete spool;
+    }
+
+    {
+        // test case 05 - jobs are replayed even if the journal can't be compacted
+        EmailSpool *spool = new EmailSpool (directory);
+        EmailJob *job1 = s_test_job ("UUID1");
+        EmailJob *job2 = s_test_job ("UUID2");
+        spool->append (*job1);
+        spool->append (*job2);
+        spool->done (*job1);
+        spool->commit ();
+        delete spool;
+        delete job1;
+        delete job2;
+
+        // new journal can't be created
+        std::string tmp = journal + ".tmp";
+        assert (mkdir (tmp.c_str (), 0700) == 0);
+        spool = new EmailSpool (directory);
+        size_t size = spool->size ();
+        std::vector<EmailJob*> jobs = spool->replay ();
+        assert (jobs.size () == 1);
+        assert (jobs [0]->uuid == "UUID2");
+        assert (spool->size () == size);
+        assert (rmdir (tmp.c_str ()) == 0);
+
+        spool->done (*jobs [0]);
+        assert (spool->size () == 0);
+        delete jobs [0];
+        delete spool;
+    }
+
+    if (verbose) {
+        // benchmark - sustained enqueue rate with group commit vs fsync per email,
+        // fsync per email is slow on real disks, so only in verbose run
+        const int count = 10000;
+        EmailJob *job = s_test_job ("BENCH");
+        job->body = std::string (1024, 'x');
+
+        for (int batch : {1, 16, 128}) {
+            EmailSpool *spool = new EmailSpool (directory);
+            int64_t start = zclock_usecs ();
+            for (int i = 0; i != count; i++) {
+                spool->append (*job);
+                if (spool->uncommitted () == static_cast <size_t> (batch))
+                    spool->commit ();
+            }
+            spool->commit ();
+            int64_t usecs = zclock_usecs () - start;
+            if (usecs == 0)
+                usecs = 1;
+            log_info ("spool benchmark: %d emails, commit per %d: %.0f emails/s",
+                    count, batch, count * 1000000.0 / usecs);
+            printf ("\n   commit per %3d emails: %8.0f emails/s", batch, count * 1000000.0 / usecs);
+            delete spool;
+            zsys_file_delete ("%s", journal.c_str ());
+        }
+        printf ("\n * emailspool: ");
+        delete job;
+    }
+    //  @end
+
+    printf ("OK\n");
+}
@@ -0,0 +1,120 @@
+/*  =========================================================================
+    emailspool - Durable journal of emails waiting for delivery
+
+    Copyright (C) 2014 - 2020 Eaton
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License along
+    with this program; if not, write to the Free Software Foundation, Inc.,
+    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+    =========================================================================
+*/
+
+#ifndef EMAILSPOOL_H_INCLUDED
+#define EMAILSPOOL_H_INCLUDED
+
+#include <string>
+#include <map>
+#include <vector>
+
+/**
+ * \class EmailSpool
+ *
+ * Append-only journal of accepted emails stored in directory/journal. Every
+ * accepted email is appended, delivered one is marked as done, so emails
+ * which were not delivered when fty-email stopped can be replayed on the
+ * next start.
+ *
+ * Appended records are not synced immediately, the owner calls commit () once
+ * for a whole batch of them (group commit) and must not consider the job
+ * durable before that. The journal is truncated when nothing is waiting for
+ * delivery, or rewritten when it grows with mostly delivered emails.
+ */
+class EmailSpool
+{
+    public:
+        /**
+         * \brief open or create the journal and read undelivered emails
+         *
+         * Incomplete or damaged records at the end of journal (crash
+         * during append) are ignored.
+         *
+         * \throws std::runtime_error if the journal can't be opened
+         */
+        explicit EmailSpool (const std::string& directory);
+
+        ~EmailSpool ();
+
+        /**
+         * \brief return jobs undelivered by previous run, caller owns them
+         */
+        std::vector<EmailJob*> replay ();
+
+        /**
+         * \brief append the job to the journal and set its spool_id
+         *
+         * \throws std::runtime_error if the write fails
+         */
+        void append (EmailJob& job);
+
+        /**
+         * \brief sync all appended jobs to the disk
+         *
+         * \throws std::runtime_error if the sync fails
+         */
+        void commit ();
+
+        /**
+         * \brief mark the job as delivered (or failed for good)
+         */
+        void done (const EmailJob& job);
+
+        const std::string& directory () const { return _directory; };
+
+        /**
+         * \brief number of jobs appended since the last commit
+         */
+        size_t uncommitted () const { return _uncommitted; };
+
+        /**
+         * \brief number of jobs waiting for delivery
+         */
+        size_t live () const { return _live.size (); };
+
+        /**
+         * \brief size of journal in bytes
+         */
+        size_t size () const { return _size; };
+
+    protected:
+        void write_record (const std::string& record);
+        void compact ();
+
+        std::string _directory;
+        std::string _path;
+        int _fd;
+        size_t _size;
+        size_t _uncommitted;
+        uint64_t _next_id;
+        std::map<uint64_t, std::string> _live;  // id -> serialized job
+        size_t _live_size;
+
+    private:
+        EmailSpool (const EmailSpool&) = delete;
+        EmailSpool& operator= (const EmailSpool&) = delete;
+};
+
+//  Self test of this class
+void
+emailspool_test (bool verbose);
+
+#endif // EMAILSPOOL_H_INCLUDED
@@ -0,0 +1,649 @@
+/*  =========================================================================
+    emailworker - Delivery worker for fty_email_server
+
+    Copyright (C) 2014 - 2020 Eaton
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License along
+    with this program; if not, write to the Free Software Foundation, Inc.,
+    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+    =========================================================================
+*/
+
+/*
+@header
+    emailworker - Delivery worker for fty_email_server
+@discuss
+    SMTP delivery can block for a long time (msmtp waiting for an unreachable
+    server, slow TLS handshake, ...). fty_email_server hands every accepted
+    email to a pool of these workers, so it stays responsive to its pipe and
+    to malamute while emails are being delivered.
+
+    Each worker owns its copy of Smtp, so no libmagic handle or pooled SMTP
+    session is shared between threads.
+@end
+*/
+
+#include <algorithm>
+#include <mutex>
+#include <vector>
+#include <fcntl.h>
+#include <unistd.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+
+#include "fty_email_classes.h"
+
+EmailJob::EmailJob ():
+    type {Type::SENDMAIL},
+    sender {},
+    uuid {},
+    batch {0},
+    batch_item {0},
+    spool_id {0},
+    created {zclock_time ()},
+    attempts {0},
+    server {},
+    latency {0},
+    failovers {0},
+    priority {0},
+    alert {},
+    state {},
+    language {},
+    discard {false},
+    mail {NULL},
+    to {},
+    subject {},
+    body {},
+    merged {},
+    ok {false},
+    code {static_cast <uint32_t> (SmtpError::Unknown)},
+    reason {}
+{
+}
+
+EmailJob::~EmailJob ()
+{
+    zmsg_destroy (&mail);
+    for (auto job : merged)
+        delete job;
+}
+
+void
+emailjob_deliver (const Smtp& smtp, EmailJob& job)
+{
+    job.server = smtp.address ();
+    job.latency = 0;
+    if (job.discard) {
+        job.ok = true;
+        job.code = static_cast <uint32_t> (SmtpError::Succeeded);
+        job.reason = "OK";
+        return;
+    }
+    int64_t start = zclock_mono ();
+    try {
+        if (job.type == EmailJob::Type::SENDMAIL) {
+            if (job.mail) {
+                // keep the message for next attempt
+                zmsg_t *mail = zmsg_dup (job.mail);
+                smtp.sendmail (&mail);
+            }
+            else {
+                std::string data = getIpAddr () + job.body;
+                log_debug ("smtp.sendmail (%s)", data.c_str ());
+                smtp.sendmail (data);
+            }
+        }
+        else
+            smtp.sendmail (job.to, job.subject, job.body);
+
+        job.ok = true;
+        job.code = static_cast <uint32_t> (SmtpError::Succeeded);
+        job.reason = "OK";
+    }
+    catch (const std::exception &e) {
+        log_debug ("delivery of %s failed: %s", job.uuid.c_str (), e.what ());
+        job.ok = false;
+        job.code = static_cast <uint32_t> (msmtp_stderr2code (e.what ()));
+        job.reason = e.what ();
+    }
+    job.latency = zclock_mono () - start;
+}
+
+void
+emailworker_actor (zsock_t *pipe, void *args)
+{
+    Smtp *smtp = NULL;
+    int cancel = args ? *static_cast <int*> (args) : -1;
+    zpoller_t *poller = zpoller_new (pipe, NULL);
+
+    zsock_signal (pipe, 0);
+    while (!zsys_interrupted) {
+
+        void *which = zpoller_wait (poller, 1000);
+        if (which == NULL) {
+            if (zpoller_terminated (poller))
+                break;
+            if (smtp)
+                smtp->expire_sessions ();
+            continue;
+        }
+
+        char *cmd = NULL;
+        void *ptr = NULL;
+        if (zsock_recv (pipe, "sp", &cmd, &ptr) == -1)
+            break;
+
+        if (streq (cmd, "$TERM")) {
+            zstr_free (&cmd);
+            break;
+        }
+        else
+        if (streq (cmd, "SMTP")) {
+            delete smtp;
+            smtp = static_cast <Smtp*> (ptr);
+            smtp->cancel_fd (cancel);
+        }
+        else
+        if (streq (cmd, "JOB")) {
+            EmailJob *job = static_cast <EmailJob*> (ptr);
+            // relay chosen by the owner
+            if (smtp && !job->server.empty ())
+                smtp->address (job->server);
+            if (smtp)
+                emailjob_deliver (*smtp, *job);
+            else {
+                job->ok = false;
+                job->code = static_cast <uint32_t> (SmtpError::Unknown);
+                job->reason = "email worker is not configured";
+            }
+            job->attempts++;
+            zsock_send (pipe, "sp", "DONE", job);
+        }
+        else
+            log_error ("emailworker: unhandled command %s", cmd);
+        zstr_free (&cmd);
+    }
+
+    delete smtp;
+    zpoller_destroy (&poller);
+}
+
+EmailWorkerPool::EmailWorkerPool (zpoller_t *poller):
+    _poller {poller},
+    _size {0},
+    _smtp {},
+    _workers {},
+    _busy {},
+    _queue {},
+    _admission {}
+{
+    if (pipe2 (_cancel, O_CLOEXEC) == -1)
+        throw std::runtime_error ("Cannot create pipe for email workers: " + std::string (strerror (errno)));
+}
+
+EmailWorkerPool::~EmailWorkerPool ()
+{
+    // don't wait for slow servers, aborted jobs stay in the spool
+    if (!_busy.empty ())
+        log_warning ("emailworker: aborting %zu deliveries in progress", _busy.size ());
+    if (::write (_cancel [1], "x", 1) == -1)
+        log_error ("emailworker: cannot abort deliveries: %s", strerror (errno));
+    while (!_workers.empty ())
+        stop_worker (_workers.back ());
+    if (!_queue.empty ())
+        log_warning ("emailworker: dropping %zu undelivered emails", _queue.size ());
+    ::close (_cancel [0]);
+    ::close (_cancel [1]);
+}
+
+void
+EmailWorkerPool::resize (size_t count)
+{
+    _size = count;
+    while (_workers.size () < _size)
+        start_worker ();
+
+    for (size_t i = _workers.size (); i > 0 && _workers.size () > _size; i--) {
+        zactor_t *worker = _workers [i - 1];
+        if (_busy.count (worker) == 0)
+            stop_worker (worker);
+    }
+    dispatch ();
+}
+
+void
+EmailWorkerPool::configure (const Smtp& smtp)
+{
+    _smtp.reset (new Smtp (smtp));
+    for (auto worker : _workers)
+        zsock_send (worker, "sp", "SMTP", new Smtp (smtp));
+}
+
+void
+EmailWorkerPool::submit (EmailJob *job)
+{
+    _queue.push (job, zclock_mono ());
+    dispatch ();
+}
+
+bool
+EmailWorkerPool::owns (void *which) const
+{
+    return std::find (_workers.begin (), _workers.end (), which) != _workers.end ();
+}
+
+EmailJob *
+EmailWorkerPool::recv (void *which)
+{
+    zactor_t *worker = static_cast <zactor_t*> (which);
+    char *cmd = NULL;
+    void *ptr = NULL;
+    if (zsock_recv (worker, "sp", &cmd, &ptr) == -1)
+        return NULL;
+
+    EmailJob *job = NULL;
+    if (streq (cmd, "DONE")) {
+        auto it = _busy.find (worker);
+        if (it != _busy.end () && it->second == ptr) {
+            job = it->second;
+            _busy.erase (it);
+        }
+        else
+            log_error ("emailworker: unexpected job from worker");
+    }
+    else
+        log_error ("emailworker: unexpected command %s from worker", cmd);
+    zstr_free (&cmd);
+
+    if (_workers.size () > _size && _busy.count (worker) == 0)
+        stop_worker (worker);
+    dispatch ();
+    return job;
+}
+
+void
+EmailWorkerPool::dispatch ()
+{
+    // keep one worker for alerts
+    size_t bulk = 0;
+    for (const auto& it : _busy)
+        if (EmailQueue::lane (*it.second) == EmailQueue::BULK)
+            bulk++;
+
+    for (auto worker : _workers) {
+        if (_queue.empty ())
+            break;
+        if (_busy.count (worker) == 1)
+            continue;
+        EmailJob *job = NULL;
+        while (!job && !_queue.empty ()) {
+            job = _queue.pop (zclock_mono (), _workers.size () < 2 || bulk + 1 < _workers.size ());
+            if (!job)
+                break;
+            if (_admission && !_admission (job))
+                job = NULL;
+        }
+        if (!job)
+            break;
+        if (EmailQueue::lane (*job) == EmailQueue::BULK)
+            bulk++;
+        _busy [worker] = job;
+        zsock_send (worker, "sp", "JOB", job);
+    }
+}
+
+void
+EmailWorkerPool::start_worker ()
+{
+    zactor_t *worker = zactor_new (emailworker_actor, &_cancel [0]);
+    if (!worker)
+        throw std::runtime_error ("Cannot start email worker");
+    if (_smtp)
+        zsock_send (worker, "sp", "SMTP", new Smtp (*_smtp));
+    zpoller_add (_poller, worker);
+    _workers.push_back (worker);
+}
+
+void
+EmailWorkerPool::stop_worker (zactor_t *worker)
+{
+    zpoller_remove (_poller, worker);
+    _workers.erase (std::find (_workers.begin (), _workers.end (), worker));
+    // the job is still referenced by the worker, so delete it once it's gone
+    EmailJob *job = NULL;
+    auto it = _busy.find (worker);
+    if (it != _busy.end ()) {
+        job = it->second;
+        _busy.erase (it);
+    }
+    zactor_destroy (&worker);
+    delete job;
+}
+
+//  --------------------------------------------------------------------------
+//  Self test of this class
+
+static EmailJob *
+s_wait_done (zactor_t *worker)
+{
+    char *cmd = NULL;
+    void *ptr = NULL;
+    int r = zsock_recv (worker, "sp", &cmd, &ptr);
+    assert (r == 0);
+    assert (streq (cmd, "DONE"));
+    zstr_free (&cmd);
+    return static_cast <EmailJob*> (ptr);
+}
+
+void
+emailworker_test (bool verbose)
+{
+    printf (" * emailworker: ");
+
+    //  @selftest
+    std::mutex sent_mutex;
+    std::vector <std::string> sent;
+    auto fn = [&sent_mutex, &sent] (const std::string& data) {
+        std::lock_guard <std::mutex> lock (sent_mutex);
+        sent.push_back (data);
+    };
+
+    {
+        // test case 01 - job is not delivered by not configured worker
+        zactor_t *worker = zactor_new (emailworker_actor, NULL);
+        assert (worker);
+
+        EmailJob *job = new EmailJob ();
+        job->uuid = "UUID";
+        job->body = "To: foo@bar\n\nbody";
+        zsock_send (worker, "sp", "JOB", job);
+        assert (s_wait_done (worker) == job);
+        assert (!job->ok);
+        assert (job->code == static_cast <uint32_t> (SmtpError::Unknown));
+        delete job;
+
+        // test case 02 - SENDMAIL job is encoded and delivered by worker
+        Smtp *smtp = new Smtp ();
+        smtp->sendmail_set_test_fn (fn);
+        zsock_send (worker, "sp", "SMTP", smtp);
+
+        job = new EmailJob ();
+        job->type = EmailJob::Type::SENDMAIL;
+        job->uuid = "UUID";
+        job->mail = fty_email_encode ("UUID", "foo@bar", "Subject", NULL, "body", NULL);
+        char *uuid = zmsg_popstr (job->mail);
+        zstr_free (&uuid);
+        zsock_send (worker, "sp", "JOB", job);
+        assert (s_wait_done (worker) == job);
+        assert (job->ok);
+        assert (job->code == 0);
+        assert (job->reason == "OK");
+        delete job;
+        {
+            std::lock_guard <std::mutex> lock (sent_mutex);
+            assert (sent.size () == 1);
+            assert (sent [0].find ("foo@bar") != std::string::npos);
+            sent.clear ();
+        }
+
+        // test case 03 - alert job
+        job = new EmailJob ();
+        job->type = EmailJob::Type::SENDMAIL_ALERT;
+        job->uuid = "UUID2";
+        job->to = "joe@example.com";
+        job->subject = "Subject";
+        job->body = "body";
+        zsock_send (worker, "sp", "JOB", job);
+        assert (s_wait_done (worker) == job);
+        assert (job->ok);
+        delete job;
+        {
+            std::lock_guard <std::mutex> lock (sent_mutex);
+            assert (sent.size () == 1);
+            assert (sent [0].find ("joe@example.com") != std::string::npos);
+            sent.clear ();
+        }
+
+        // test case 04 - delivery errors are classified
+        smtp = new Smtp ();
+        smtp->transport (Transport::NATIVE);
+        smtp->host ("127.0.0.1");
+        smtp->port ("1");
+        zsock_send (worker, "sp", "SMTP", smtp);
+
+        job = new EmailJob ();
+        job->type = EmailJob::Type::SENDMAIL_ALERT;
+        job->to = "joe@example.com";
+        job->subject = "Subject";
+        job->body = "body";
+        zsock_send (worker, "sp", "JOB", job);
+        assert (s_wait_done (worker) == job);
+        assert (!job->ok);
+        assert (job->code == static_cast <uint32_t> (SmtpError::ServerUnreachable));
+        delete job;
+
+        zactor_destroy (&worker);
+    }
+
+    {
+        // test case 05 - pool delivers slow emails in parallel
+        auto slow_fn = [] (const std::string& data) {
+            zclock_sleep (500);
+        };
+        Smtp smtp;
+        smtp.sendmail_set_test_fn (slow_fn);
+
+        zpoller_t *poller = zpoller_new (NULL);
+        EmailWorkerPool *pool = new EmailWorkerPool (poller);
+        pool->resize (2);
+        pool->configure (smtp);
+        assert (pool->size () == 2);
+
+        int64_t start = zclock_mono ();
+        for (int i = 0; i != 3; i++) {
+            EmailJob *job = new EmailJob ();
+            job->type = EmailJob::Type::SENDMAIL_ALERT;
+            job->priority = 1;
+            job->uuid = std::to_string (i);
+            job->to = "joe@example.com";
+            job->subject = "Subject";
+            job->body = "body";
+            pool->submit (job);
+        }
+        assert (pool->busy () == 2);
+        assert (pool->queued () == 1);
+
+        for (int i = 0; i != 2; i++) {
+            void *which = zpoller_wait (poller, 5000);
+            assert (pool->owns (which));
+            EmailJob *job = pool->recv (which);
+            assert (job);
+            assert (job->ok);
+            delete job;
+        }
+        assert (zclock_mono () - start < 1000);
+        assert (pool->busy () == 1);
+        assert (pool->queued () == 0);
+
+        // test case 06 - busy worker is stopped after its job is done
+        pool->resize (1);
+        assert (pool->busy () == 1);
+        void *which = zpoller_wait (poller, 5000);
+        assert (pool->owns (which));
+        EmailJob *job = pool->recv (which);
+        assert (job);
+        assert (job->uuid == "2");
+        delete job;
+        assert (pool->busy () == 0);
+
+        // test case 07 - refused job is not given to worker
+        std::vector <EmailJob*> refused;
+        pool->admission ([&refused] (EmailJob *job) {
+            if (job->uuid != "REFUSED")
+                return true;
+            refused.push_back (job);
+            return false;
+        });
+        job = new EmailJob ();
+        job->type = EmailJob::Type::SENDMAIL_ALERT;
+        job->uuid = "REFUSED";
+        pool->submit (job);
+        assert (refused.size () == 1);
+        assert (refused [0] == job);
+        assert (pool->busy () == 0);
+        assert (pool->queued () == 0);
+        delete job;
+
+        // test case 08 - unfinished jobs are dropped with the pool
+        job = new EmailJob ();
+        job->type = EmailJob::Type::SENDMAIL_ALERT;
+        pool->submit (job);
+        delete pool;
+        zpoller_destroy (&poller);
+    }
+
+    {
+        // test case 09 - one worker is kept for alerts
+        auto slow_fn = [] (const std::string& data) {
+            zclock_sleep (200);
+        };
+        Smtp smtp;
+        smtp.sendmail_set_test_fn (slow_fn);
+
+        zpoller_t *poller = zpoller_new (NULL);
+        EmailWorkerPool *pool = new EmailWorkerPool (poller);
+        pool->resize (2);
+        pool->configure (smtp);
+
+        for (int i = 0; i != 2; i++) {
+            EmailJob *job = new EmailJob ();
+            job->type = EmailJob::Type::SENDMAIL;
+            job->uuid = "bulk" + std::to_string (i);
+            job->body = "To: joe@example.com\nSubject: report\n\nbody";
+            pool->submit (job);
+        }
+        assert (pool->busy () == 1);
+        assert (pool->queued () == 1);
+
+        EmailJob *job = new EmailJob ();
+        job->type = EmailJob::Type::SENDMAIL_ALERT;
+        job->priority = 1;
+        job->uuid = "alert";
+        job->to = "joe@example.com";
+        job->subject = "Subject";
+        job->body = "body";
+        pool->submit (job);
+        assert (pool->busy () == 2);
+        assert (pool->queued () == 1);
+
+        for (int i = 0; i != 3; i++) {
+            void *which = zpoller_wait (poller, 5000);
+            assert (pool->owns (which));
+            job = pool->recv (which);
+            assert (job);
+            assert (job->ok);
+            delete job;
+        }
+        assert (pool->busy () == 0);
+        assert (pool->queue ().stats (0).dequeued == 1);
+        assert (pool->queue ().stats (EmailQueue::BULK).dequeued == 2);
+        delete pool;
+        zpoller_destroy (&poller);
+    }
+
+    {
+        // test case 10 - discarded job is answered without sending
+        Smtp smtp;
+        smtp.sendmail_set_test_fn ([] (const std::string& data) {
+            assert (false);
+        });
+        EmailJob job;
+        job.type = EmailJob::Type::SENDMAIL_ALERT;
+        job.discard = true;
+        emailjob_deliver (smtp, job);
+        assert (job.ok);
+        assert (job.code == static_cast <uint32_t> (SmtpError::Succeeded));
+    }
+
+    {
+        // test case 11 - delivery to server which does not answer is aborted with the pool
+        int listener = socket (AF_INET, SOCK_STREAM, 0);
+        assert (listener != -1);
+        struct sockaddr_in addr;
+        memset (&addr, 0, sizeof (addr));
+        addr.sin_family = AF_INET;
+        addr.sin_addr.s_addr = htonl (INADDR_LOOPBACK);
+        socklen_t len = sizeof (addr);
+        assert (bind (listener, reinterpret_cast <struct sockaddr*> (&addr), len) == 0);
+        assert (listen (listener, 1) == 0);
+        assert (getsockname (listener, reinterpret_cast <struct sockaddr*> (&addr), &len) == 0);
+
+        Smtp smtp;
+        smtp.transport (Transport::NATIVE);
+        smtp.host ("127.0.0.1");
+        smtp.port (std::to_string (ntohs (addr.sin_port)));
+
+        zpoller_t *poller = zpoller_new (NULL);
+        EmailWorkerPool *pool = new EmailWorkerPool (poller);
+        pool->resize (1);
+        pool->configure (smtp);
+        EmailJob *job = new EmailJob ();
+        job->type = EmailJob::Type::SENDMAIL_ALERT;
+        job->to = "joe@example.com";
+        job->subject = "Subject";
+        job->body = "body";
+        pool->submit (job);
+        assert (pool->busy () == 1);
+        // greeting never comes
+        zclock_sleep (200);
+
+        int64_t start = zclock_mono ();
+        delete pool;
+        assert (zclock_mono () - start < 5000);
+        zpoller_destroy (&poller);
+
+        // test case 12 - connect to server which drops SYN is aborted with the pool
+        // listener never accepts, so its queue gets full and kernel drops next SYNs
+        std::vector<int> fillers;
+        for (int i = 0; i != 4; i++) {
+            int fd = socket (AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0);
+            assert (fd != -1);
+            connect (fd, reinterpret_cast <struct sockaddr*> (&addr), len);
+            fillers.push_back (fd);
+        }
+        zclock_sleep (100);
+
+        poller = zpoller_new (NULL);
+        pool = new EmailWorkerPool (poller);
+        pool->resize (1);
+        pool->configure (smtp);
+        job = new EmailJob ();
+        job->type = EmailJob::Type::SENDMAIL_ALERT;
+        job->to = "joe@example.com";
+        job->subject = "Subject";
+        job->body = "body";
+        pool->submit (job);
+        zclock_sleep (200);
+
+        start = zclock_mono ();
+        delete pool;
+        assert (zclock_mono () - start < 5000);
+        zpoller_destroy (&poller);
+        for (int fd : fillers)
+            close (fd);
+        close (listener);
+    }
+    //  @end
+
+    printf ("OK\n");
+}
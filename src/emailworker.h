@@ -0,0 +1,201 @@
+/*  =========================================================================
+    emailworker - Delivery worker for fty_email_server
+
+    Copyright (C) 2014 - 2020 Eaton
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License along
+    with this program; if not, write to the Free Software Foundation, Inc.,
+    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+    =========================================================================
+*/
+
+#ifndef EMAILWORKER_H_INCLUDED
+#define EMAILWORKER_H_INCLUDED
+
+#include <string>
+#include <functional>
+#include <map>
+#include <memory>
+#include <vector>
+
+/**
+ * \class EmailJob
+ *
+ * One email accepted by fty_email_server and waiting for delivery. The server
+ * prepares everything what needs the server state (translations, templates),
+ * the worker does the rest (MIME encoding and the SMTP transaction) and fills
+ * the result.
+ */
+struct EmailJob {
+    enum class Type {
+        SENDMAIL,       // email from SENDMAIL request
+        SENDMAIL_ALERT, // alert notification via email
+        SENDSMS_ALERT   // alert notification via SMS gateway
+    };
+
+    EmailJob ();
+    ~EmailJob ();
+
+    Type type;
+    std::string sender;     // malamute address of the requester
+    std::string uuid;       // uuid of the request, sent back in the reply
+    uint64_t batch;         // SENDMAIL: id of SENDMAIL_BATCH request, 0 if sent alone, not spooled
+    size_t batch_item;      // SENDMAIL: index of the email in the batch
+    uint64_t spool_id;      // id in EmailSpool, 0 if not spooled
+    int64_t created;        // when the request was accepted, ms since epoch
+    int attempts;           // number of finished delivery attempts
+    std::string server;     // host:port of smtp server for the next or of the last attempt
+    int64_t latency;        // duration of the last attempt (ms)
+    int failovers;          // attempts on other relays since the last retry
+    int priority;           // *_ALERT: 1 (highest) .. 5, 0 for SENDMAIL
+    std::string alert;      // *_ALERT: rule, asset and contact identifying the alert, empty for digest
+    std::string state;      // *_ALERT: state of the alert (ACTIVE, RESOLVED, ...)
+    std::string language;   // *_ALERT: language of the email, empty for server/language
+    bool discard;           // nothing to send, just answer the request(s)
+
+    zmsg_t *mail;           // SENDMAIL: message as encoded by fty_email_encode without uuid frame
+    std::string to;         // *_ALERT: recipient
+    std::string subject;    // *_ALERT: subject
+    std::string body;       // SENDMAIL: raw email if sent in one frame, *_ALERT: body
+    std::vector<EmailJob*> merged;  // other requests answered by this job (digest, superseded alerts), owned
+
+    // result of the delivery
+    bool ok;
+    uint32_t code;          // SmtpError
+    std::string reason;     // error message
+
+    private:
+        EmailJob (const EmailJob&) = delete;
+        EmailJob& operator= (const EmailJob&) = delete;
+};
+
+/**
+ * \brief deliver the job and store the result in it
+ */
+void
+emailjob_deliver (const Smtp& smtp, EmailJob& job);
+
+//  Delivery worker actor
+//
+//  Accepts following commands on the pipe
+//
+//      SMTP/Smtp*      - use this Smtp configuration, worker takes the ownership
+//      JOB/EmailJob*   - deliver the job, worker replies with DONE/EmailJob*
+//                        when finished, job stays owned by the caller
+//      $TERM           - terminate
+//
+//  Idle pooled SMTP sessions are closed by the worker itself.
+//
+//  args may point to file descriptor (int), delivery in progress is aborted
+//  when it becomes readable.
+void
+emailworker_actor (zsock_t *pipe, void *args);
+
+/**
+ * \class EmailWorkerPool
+ *
+ * Queue of jobs and pool of emailworker actors delivering them. Workers are
+ * added to the poller of the owner, which must call recv () when any of them
+ * is readable.
+ *
+ * If there are more workers, one of them never takes SENDMAIL jobs, so
+ * alerts can be delivered while others are busy with big emails.
+ */
+class EmailWorkerPool
+{
+    public:
+        explicit EmailWorkerPool (zpoller_t *poller);
+
+        /**
+         * \brief stop all workers, deliveries in progress are aborted,
+         *        unfinished jobs are dropped
+         */
+        ~EmailWorkerPool ();
+
+        /**
+         * \brief start or stop workers to have count of them
+         *
+         * Busy workers are stopped once they finish their job.
+         */
+        void resize (size_t count);
+
+        /**
+         * \brief send copy of the smtp configuration to all workers
+         */
+        void configure (const Smtp& smtp);
+
+        /**
+         * \brief queue the job, pool takes the ownership
+         */
+        void submit (EmailJob *job);
+
+        /**
+         * \brief set the function called before the job is given to worker
+         *
+         * If it returns false, the job is not delivered and pool forgets it,
+         * so the function must take care of it. Must not call the pool.
+         */
+        void admission (std::function<bool (EmailJob*)> fn) { _admission = fn; };
+
+        /**
+         * \brief true if which is one of the workers
+         */
+        bool owns (void *which) const;
+
+        /**
+         * \brief read the finished job from the worker and dispatch next one
+         *
+         * \return finished job owned by the caller or NULL
+         */
+        EmailJob *recv (void *which);
+
+        size_t size () const { return _size; };
+        size_t queued () const { return _queue.size (); };
+        size_t busy () const { return _busy.size (); };
+
+        const EmailQueue& queue () const { return _queue; };
+
+        /**
+         * \brief promote waiting job by one priority lane after (ms)
+         */
+        void aging (int64_t aging) { _queue.aging (aging); };
+
+        /**
+         * \brief what to do with waiting alert resolved before it was sent
+         */
+        void supersede (EmailQueue::Supersede policy) { _queue.supersede (policy); };
+
+    protected:
+        void dispatch ();
+        void start_worker ();
+        void stop_worker (zactor_t *worker);
+
+        zpoller_t *_poller;
+        size_t _size;
+        std::unique_ptr<Smtp> _smtp;
+        std::vector<zactor_t*> _workers;
+        std::map<zactor_t*, EmailJob*> _busy;
+        EmailQueue _queue;
+        std::function<bool (EmailJob*)> _admission;
+        int _cancel [2];    // pipe, written on destruction to abort deliveries
+
+    private:
+        EmailWorkerPool (const EmailWorkerPool&) = delete;
+        EmailWorkerPool& operator= (const EmailWorkerPool&) = delete;
+};
+
+//  Self test of this class
+void
+emailworker_test (bool verbose);
+
+#endif // EMAILWORKER_H_INCLUDED
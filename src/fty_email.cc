@@ -193,7 +193,7 @@ int main (int argc, char** argv)
         }
         else {
             language = zconfig_get (config, "server/language", DEFAULT_LANGUAGE);
-            int rv = translation_change_language (language);
+            int rv = change_language (language);
             if (rv != TE_OK)
                 log_warning ("Language not changed to %s, continuing in %s", language, DEFAULT_LANGUAGE);
         }
@@ -37,17 +37,87 @@
 typedef struct _emailconfiguration_t emailconfiguration_t;
 #define EMAILCONFIGURATION_T_DEFINED
 #endif
+#ifndef EMAILMIME_T_DEFINED
+typedef struct _emailmime_t emailmime_t;
+#define EMAILMIME_T_DEFINED
+#endif
+#ifndef EMAILPARTS_T_DEFINED
+typedef struct _emailparts_t emailparts_t;
+#define EMAILPARTS_T_DEFINED
+#endif
+#ifndef EMAILMAGIC_T_DEFINED
+typedef struct _emailmagic_t emailmagic_t;
+#define EMAILMAGIC_T_DEFINED
+#endif
 #ifndef EMAIL_T_DEFINED
 typedef struct _email_t email_t;
 #define EMAIL_T_DEFINED
 #endif
+#ifndef EMAILQUEUE_T_DEFINED
+typedef struct _emailqueue_t emailqueue_t;
+#define EMAILQUEUE_T_DEFINED
+#endif
+#ifndef EMAILWORKER_T_DEFINED
+typedef struct _emailworker_t emailworker_t;
+#define EMAILWORKER_T_DEFINED
+#endif
+#ifndef EMAILSPOOL_T_DEFINED
+typedef struct _emailspool_t emailspool_t;
+#define EMAILSPOOL_T_DEFINED
+#endif
+#ifndef EMAILRETRY_T_DEFINED
+typedef struct _emailretry_t emailretry_t;
+#define EMAILRETRY_T_DEFINED
+#endif
+#ifndef EMAILBREAKER_T_DEFINED
+typedef struct _emailbreaker_t emailbreaker_t;
+#define EMAILBREAKER_T_DEFINED
+#endif
+#ifndef EMAILDIGEST_T_DEFINED
+typedef struct _emaildigest_t emaildigest_t;
+#define EMAILDIGEST_T_DEFINED
+#endif
+#ifndef EMAILDEDUP_T_DEFINED
+typedef struct _emaildedup_t emaildedup_t;
+#define EMAILDEDUP_T_DEFINED
+#endif
+#ifndef EMAILRATELIMIT_T_DEFINED
+typedef struct _emailratelimit_t emailratelimit_t;
+#define EMAILRATELIMIT_T_DEFINED
+#endif
+#ifndef EMAILRELAYS_T_DEFINED
+typedef struct _emailrelays_t emailrelays_t;
+#define EMAILRELAYS_T_DEFINED
+#endif
+#ifndef EMAILRENDER_T_DEFINED
+typedef struct _emailrender_t emailrender_t;
+#define EMAILRENDER_T_DEFINED
+#endif
+#ifndef EMAILIPADDR_T_DEFINED
+typedef struct _emailipaddr_t emailipaddr_t;
+#define EMAILIPADDR_T_DEFINED
+#endif
 
 //  Extra headers
 
 //  Internal API
 
 #include "emailconfiguration.h"
+#include "emailmime.h"
+#include "emailparts.h"
+#include "emailmagic.h"
 #include "email.h"
+#include "emailqueue.h"
+#include "emailworker.h"
+#include "emailspool.h"
+#include "emailretry.h"
+#include "emailbreaker.h"
+#include "emaildigest.h"
+#include "emaildedup.h"
+#include "emailratelimit.h"
+#include "emailrelays.h"
+#include "emailrender.h"
+#include "emailipaddr.h"
 
 //  *** To avoid double-definitions, only define if building without draft ***
 #ifndef FTY_EMAIL_BUILD_DRAFT_API
@@ -57,11 +127,81 @@ typedef struct _email_t email_t;
 FTY_EMAIL_PRIVATE void
     emailconfiguration_test (bool verbose);
 
+//  *** Draft method, defined for internal use only ***
+//  Self test of this class.
+FTY_EMAIL_PRIVATE void
+    emailmime_test (bool verbose);
+
+//  *** Draft method, defined for internal use only ***
+//  Self test of this class.
+FTY_EMAIL_PRIVATE void
+    emailparts_test (bool verbose);
+
+//  *** Draft method, defined for internal use only ***
+//  Self test of this class.
+FTY_EMAIL_PRIVATE void
+    emailmagic_test (bool verbose);
+
 //  *** Draft method, defined for internal use only ***
 //  Self test of this class.
 FTY_EMAIL_PRIVATE void
     email_test (bool verbose);
 
+//  *** Draft method, defined for internal use only ***
+//  Self test of this class.
+FTY_EMAIL_PRIVATE void
+    emailqueue_test (bool verbose);
+
+//  *** Draft method, defined for internal use only ***
+//  Self test of this class.
+FTY_EMAIL_PRIVATE void
+    emailworker_test (bool verbose);
+
+//  *** Draft method, defined for internal use only ***
+//  Self test of this class.
+FTY_EMAIL_PRIVATE void
+    emailspool_test (bool verbose);
+
+//  *** Draft method, defined for internal use only ***
+//  Self test of this class.
+FTY_EMAIL_PRIVATE void
+    emailretry_test (bool verbose);
+
+//  *** Draft method, defined for internal use only ***
+//  Self test of this class.
+FTY_EMAIL_PRIVATE void
+    emailbreaker_test (bool verbose);
+
+//  *** Draft method, defined for internal use only ***
+//  Self test of this class.
+FTY_EMAIL_PRIVATE void
+    emaildigest_test (bool verbose);
+
+//  *** Draft method, defined for internal use only ***
+//  Self test of this class.
+FTY_EMAIL_PRIVATE void
+    emaildedup_test (bool verbose);
+
+//  *** Draft method, defined for internal use only ***
+//  Self test of this class.
+FTY_EMAIL_PRIVATE void
+    emailratelimit_test (bool verbose);
+
+//  *** Draft method, defined for internal use only ***
+//  Self test of this class.
+FTY_EMAIL_PRIVATE void
+    emailrelays_test (bool verbose);
+
+//  *** Draft method, defined for internal use only ***
+//  Self test of this class.
+FTY_EMAIL_PRIVATE void
+    emailrender_test (bool verbose);
+
+//  *** Draft method, defined for internal use only ***
+//  Self test of this class.
+FTY_EMAIL_PRIVATE void
+    emailipaddr_test (bool verbose);
+
 //  Self test for private classes
 FTY_EMAIL_PRIVATE void
     fty_email_private_selftest (bool verbose, const char *subtest);
@@ -40,8 +40,36 @@ fty_email_private_selftest (bool verbose, const char *subtest)
 // Tests for stable private classes:
     if (streq (subtest, "$ALL") || streq (subtest, "emailconfiguration_test"))
         emailconfiguration_test (verbose);
+    if (streq (subtest, "$ALL") || streq (subtest, "emailmime_test"))
+        emailmime_test (verbose);
+    if (streq (subtest, "$ALL") || streq (subtest, "emailparts_test"))
+        emailparts_test (verbose);
+    if (streq (subtest, "$ALL") || streq (subtest, "emailmagic_test"))
+        emailmagic_test (verbose);
     if (streq (subtest, "$ALL") || streq (subtest, "email_test"))
         email_test (verbose);
+    if (streq (subtest, "$ALL") || streq (subtest, "emailqueue_test"))
+        emailqueue_test (verbose);
+    if (streq (subtest, "$ALL") || streq (subtest, "emailworker_test"))
+        emailworker_test (verbose);
+    if (streq (subtest, "$ALL") || streq (subtest, "emailspool_test"))
+        emailspool_test (verbose);
+    if (streq (subtest, "$ALL") || streq (subtest, "emailretry_test"))
+        emailretry_test (verbose);
+    if (streq (subtest, "$ALL") || streq (subtest, "emailbreaker_test"))
+        emailbreaker_test (verbose);
+    if (streq (subtest, "$ALL") || streq (subtest, "emaildigest_test"))
+        emaildigest_test (verbose);
+    if (streq (subtest, "$ALL") || streq (subtest, "emaildedup_test"))
+        emaildedup_test (verbose);
+    if (streq (subtest, "$ALL") || streq (subtest, "emailratelimit_test"))
+        emailratelimit_test (verbose);
+    if (streq (subtest, "$ALL") || streq (subtest, "emailrelays_test"))
+        emailrelays_test (verbose);
+    if (streq (subtest, "$ALL") || streq (subtest, "emailrender_test"))
+        emailrender_test (verbose);
+    if (streq (subtest, "$ALL") || streq (subtest, "emailipaddr_test"))
+        emailipaddr_test (verbose);
 }
 /*
 ################################################################################
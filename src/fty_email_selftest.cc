@@ -43,7 +43,21 @@ all_tests [] = {
 // Tests for stable/draft private classes:
 // Now built only with --enable-drafts, so even stable builds are hidden behind the flag
     { "emailconfiguration", NULL, true, false, "emailconfiguration_test" },
+    { "emailmime", NULL, true, false, "emailmime_test" },
+    { "emailparts", NULL, true, false, "emailparts_test" },
+    { "emailmagic", NULL, true, false, "emailmagic_test" },
     { "email", NULL, true, false, "email_test" },
+    { "emailqueue", NULL, true, false, "emailqueue_test" },
+    { "emailworker", NULL, true, false, "emailworker_test" },
+    { "emailspool", NULL, true, false, "emailspool_test" },
+    { "emailretry", NULL, true, false, "emailretry_test" },
+    { "emailbreaker", NULL, true, false, "emailbreaker_test" },
+    { "emaildigest", NULL, true, false, "emaildigest_test" },
+    { "emaildedup", NULL, true, false, "emaildedup_test" },
+    { "emailratelimit", NULL, true, false, "emailratelimit_test" },
+    { "emailrelays", NULL, true, false, "emailrelays_test" },
+    { "emailrender", NULL, true, false, "emailrender_test" },
+    { "emailipaddr", NULL, true, false, "emailipaddr_test" },
     { "private_classes", NULL, false, false, "$ALL" }, // compat option for older projects
 #endif // FTY_EMAIL_BUILD_DRAFT_API
 // Tests for stable public classes:
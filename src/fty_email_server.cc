@@ -28,19 +28,28 @@
 
 #include "fty_email_classes.h"
 
+#include <map>
 #include <set>
 #include <tuple>
 #include <string>
 #include <functional>
 #include <algorithm>
+#include <memory>
+#include <mutex>
 #include <fty_common_macros.h>
 
 #include "email.h"
 #include "emailconfiguration.h"
+#include "emailworker.h"
+#include "emailrender.h"
 
+// prepare the alert email, it's sent later by emailworker
+// subject and body are rendered once for all contacts of the alert
 static void
 s_notify (
-          Smtp& smtp,
+          EmailJob& job,
+          EmailRenders& renders,
+          const std::string& language,
           const std::string& priority,
           const std::string& extname,
           const std::string& contact,
@@ -52,12 +61,209 @@ s_notify (
         throw std::runtime_error ("Empty asset name");
     else if (contact.empty ())
         throw std::runtime_error ("Empty contact");
-    else
-        smtp.sendmail(
-                contact,
-                generate_subject (alert, priority, extname),
-                generate_body (alert, priority, extname)
-                );
+
+    job.to = contact;
+    EmailRenders::Render render = renders.get (
+            EmailRenders::key (alert, priority, extname, language),
+            zclock_mono (),
+            [&] () {
+                return EmailRenders::Render {
+                    generate_subject (alert, priority, extname, language),
+                    generate_body (alert, priority, extname, language)};
+            });
+    job.subject = render.subject;
+    job.body = render.body;
+}
+
+// group commit: accepted jobs are spooled without sync while there are more
+// requests to read, then synced at once and handed to workers
+#define SPOOL_GROUP_COMMIT_MAX 64
+
+static void
+s_commit (
+        EmailSpool *spool,
+        EmailWorkerPool *workers,
+        std::vector <EmailJob*>& uncommitted)
+{
+    if (spool) {
+        try {
+            spool->commit ();
+        }
+        catch (const std::exception &e) {
+            log_error ("%s", e.what ());
+        }
+    }
+    for (auto job : uncommitted)
+        workers->submit (job);
+    uncommitted.clear ();
+}
+
+// spool the job and queue it for delivery
+static void
+s_accept (
+        EmailSpool *spool,
+        EmailWorkerPool *workers,
+        std::vector <EmailJob*>& uncommitted,
+        EmailJob *job)
+{
+    if (!spool) {
+        workers->submit (job);
+        return;
+    }
+
+    try {
+        spool->append (*job);
+        uncommitted.push_back (job);
+        if (uncommitted.size () >= SPOOL_GROUP_COMMIT_MAX)
+            s_commit (spool, workers, uncommitted);
+    }
+    catch (const std::exception &e) {
+        log_error ("%s, email %s is not spooled", e.what (), job->uuid.c_str ());
+        workers->submit (job);
+    }
+}
+
+// spool the alert and keep it in digest until its window closes
+static void
+s_accept_digest (
+        EmailSpool *spool,
+        EmailDigest& digest,
+        const std::string& key,
+        EmailJob *job)
+{
+    if (spool) {
+        try {
+            spool->append (*job);
+        }
+        catch (const std::exception &e) {
+            log_error ("%s, email %s is not spooled", e.what (), job->uuid.c_str ());
+        }
+    }
+    digest.add (key, job, zclock_mono ());
+}
+
+// reply to the sender of the delivered (or refused) email
+static void
+s_reply (
+        mlm_client_t *client,
+        const EmailJob& job)
+{
+    zmsg_t *reply = zmsg_new ();
+    zmsg_addstr (reply, job.uuid.c_str ());
+
+    const char *subject = NULL;
+    if (job.type == EmailJob::Type::SENDMAIL) {
+        zmsg_addstrf (reply, "%" PRIu32, job.code);
+        zmsg_addstr (reply, job.ok ? "OK" : UTF8::escape (job.reason).c_str ());
+        subject = job.ok ? "SENDMAIL-OK" : "SENDMAIL-ERR";
+    }
+    else {
+        if (job.ok)
+            zmsg_addstr (reply, "OK");
+        else {
+            log_error ("Sending of e-mail/SMS alert failed : %s", job.reason.c_str ());
+            zmsg_addstr (reply, "ERROR");
+            zmsg_addstr (reply, job.reason.c_str ());
+        }
+        subject = job.type == EmailJob::Type::SENDMAIL_ALERT ? "SENDMAIL_ALERT" : "SENDSMS_ALERT";
+    }
+
+    int r = mlm_client_sendto (
+            client,
+            job.sender.c_str (),
+            subject,
+            NULL,
+            1000,
+            &reply);
+    if (r == -1)
+        log_error ("Can't send a reply for %s to %s", subject, job.sender.c_str ());
+    zmsg_destroy (&reply);
+}
+
+// SENDMAIL_BATCH request waiting for delivery of its emails
+struct SendmailBatch {
+    struct Item {
+        std::string uuid;
+        uint32_t code;
+        std::string reason;
+    };
+
+    std::string sender;
+    std::string uuid;
+    std::vector<Item> items;
+    size_t pending;         // emails not finished yet
+};
+
+// reply to the sender of the batch once all its emails are finished
+static void
+s_reply_batch (
+        mlm_client_t *client,
+        const SendmailBatch& batch)
+{
+    zmsg_t *reply = zmsg_new ();
+    zmsg_addstr (reply, batch.uuid.c_str ());
+    for (const auto& item : batch.items) {
+        zmsg_addstr (reply, item.uuid.c_str ());
+        zmsg_addstrf (reply, "%" PRIu32, item.code);
+        zmsg_addstr (reply, item.code == static_cast <uint32_t> (SmtpError::Succeeded) ? "OK" : UTF8::escape (item.reason).c_str ());
+    }
+
+    int r = mlm_client_sendto (
+            client,
+            batch.sender.c_str (),
+            "SENDMAIL_BATCH-OK",
+            NULL,
+            1000,
+            &reply);
+    if (r == -1)
+        log_error ("Can't send a reply for SENDMAIL_BATCH to %s", batch.sender.c_str ());
+    zmsg_destroy (&reply);
+}
+
+// split SENDMAIL_BATCH request (without batch uuid) to SENDMAIL jobs
+// return error message, jobs are not created if the request is malformed
+static std::string
+s_batch_decode (
+        zmsg_t *msg,
+        const std::string& sender,
+        std::vector <EmailJob*>& jobs)
+{
+    if (zmsg_size (msg) == 0)
+        return "empty batch";
+
+    while (zmsg_size (msg) > 0) {
+        ZstrGuard count_str (zmsg_popstr (msg));
+        char *end = NULL;
+        long count = strtol (count_str.get (), &end, 10);
+        // uuid and at least the body
+        if (*end != '\0' || count < 2 || static_cast <size_t> (count) > zmsg_size (msg)) {
+            std::string error = "malformed email " + std::to_string (jobs.size () + 1) + " of the batch";
+            for (auto job : jobs)
+                delete job;
+            jobs.clear ();
+            return error;
+        }
+
+        EmailJob *job = new EmailJob ();
+        job->type = EmailJob::Type::SENDMAIL;
+        job->sender = sender;
+        ZstrGuard uuid (zmsg_popstr (msg));
+        job->uuid = uuid.get ();
+        if (count == 2) {
+            ZstrGuard body (zmsg_popstr (msg));
+            job->body = body.get ();
+        }
+        else {
+            job->mail = zmsg_new ();
+            for (long i = 1; i != count; i++) {
+                zframe_t *frame = zmsg_pop (msg);
+                zmsg_append (job->mail, &frame);
+            }
+        }
+        job->batch_item = jobs.size ();
+        jobs.push_back (job);
+    }
+    return "";
 }
 
 // return dfl is item is NULL or empty string!!
@@ -125,6 +331,40 @@ fty_email_encode (
     return msg;
 }
 
+zmsg_t *
+fty_email_batch_new (const char *uuid)
+{
+    assert (uuid);
+
+    zmsg_t *msg = zmsg_new ();
+    if (!msg)
+        return NULL;
+    zmsg_addstr (msg, uuid);
+    return msg;
+}
+
+int
+fty_email_batch_add (zmsg_t *batch, zmsg_t **email_p)
+{
+    assert (batch);
+    assert (email_p);
+
+    zmsg_t *email = *email_p;
+    if (!email || zmsg_size (email) < 2) {
+        zmsg_destroy (email_p);
+        return -1;
+    }
+
+    zmsg_addstrf (batch, "%zu", zmsg_size (email));
+    zframe_t *frame = zmsg_pop (email);
+    while (frame) {
+        zmsg_append (batch, &frame);
+        frame = zmsg_pop (email);
+    }
+    zmsg_destroy (email_p);
+    return 0;
+}
+
 void
 fty_email_server (zsock_t *pipe, void* args)
 {
@@ -143,6 +383,108 @@ fty_email_server (zsock_t *pipe, void* args)
     zpoller_t *poller = zpoller_new (pipe, mlm_client_msgpipe (client), NULL);
 
     Smtp smtp;
+    EmailWorkerPool *workers = new EmailWorkerPool (poller);
+    EmailSpool *spool = NULL;
+    std::vector <EmailJob*> uncommitted;
+    EmailRetry retry;
+    EmailBreaker breaker;
+    EmailDigest digest;
+    EmailDedup dedup;
+    EmailRateLimit ratelimit;
+    EmailRelays relays;
+    EmailRenders renders;
+    std::map <uint64_t, SendmailBatch> batches;
+    uint64_t last_batch = 0;
+
+    // language of alert email
+    auto job_language = [&] (const EmailJob& job) {
+        return job.language.empty () ? std::string (language ? language : DEFAULT_LANGUAGE) : job.language;
+    };
+
+    // alerts for one contact and language are merged to one digest
+    auto digest_key = [&] (const EmailJob& job) {
+        return job.to + "\n" + job_language (job);
+    };
+
+    // emails of a batch are answered together when the last one is finished
+    auto reply = [&] (const EmailJob& job) {
+        if (job.batch == 0) {
+            s_reply (client, job);
+            return;
+        }
+        auto it = batches.find (job.batch);
+        if (it == batches.end ())
+            return;
+        SendmailBatch& batch = it->second;
+        SendmailBatch::Item& item = batch.items [job.batch_item];
+        item.code = job.ok ? static_cast <uint32_t> (SmtpError::Succeeded) : job.code;
+        item.reason = job.reason;
+        if (--batch.pending == 0) {
+            s_reply_batch (client, batch);
+            batches.erase (it);
+        }
+    };
+
+    // delivery of the job is over, unless it can be retried
+    auto finish = [&] (EmailJob *job) {
+        if (!job->ok && retry.schedule (job, zclock_mono ())) {
+            log_info ("%s:\tdelivery of %s failed (%s), will try again", name, job->uuid.c_str (), job->reason.c_str ());
+            return;
+        }
+        log_debug ("%s:\tdelivery of %s finished: %s", name, job->uuid.c_str (), job->reason.c_str ());
+        if (spool)
+            spool->done (*job);
+        reply (*job);
+        for (auto other : job->merged) {
+            other->ok = job->ok;
+            other->code = job->code;
+            other->reason = job->reason;
+            if (spool)
+                spool->done (*other);
+            reply (*other);
+        }
+        delete job;
+    };
+
+    // send to the healthiest relay, fail fast while breakers of all are
+    // open, hold alerts over the rate limit
+    workers->admission ([&] (EmailJob *job) {
+        // nothing is sent, so no relay is needed
+        if (job->discard)
+            return true;
+        int64_t now = zclock_mono ();
+        std::string server;
+        if (relays.size () == 0) {
+            if (breaker.allow (smtp.address (), now))
+                server = smtp.address ();
+        }
+        else
+            // avoid relay which has just failed
+            server = relays.select (now, job->failovers > 0 ? job->server : "",
+                [&] (const std::string& relay) { return breaker.allow (relay, now); });
+        if (server.empty ()) {
+            job->ok = false;
+            job->attempts++;
+            job->code = static_cast <uint32_t> (SmtpError::ServerUnreachable);
+            job->reason = "smtp: circuit breaker is open for " + (relays.size () == 0 ? smtp.address () : "all relays");
+            finish (job);
+            return false;
+        }
+        job->server = server;
+        if (job->type == EmailJob::Type::SENDMAIL)
+            return true;
+        int64_t wait = ratelimit.take (job->to, now);
+        if (wait == 0)
+            return true;
+        log_debug ("%s:\t%s to %s is over the rate limit", name, job->uuid.c_str (), job->to.c_str ());
+        // job is not sent now, let other one probe the relay
+        breaker.release (server, now);
+        if (job->type == EmailJob::Type::SENDMAIL_ALERT && digest.window () > 0)
+            digest.add (digest_key (*job), job, now);
+        else
+            retry.defer (job, wait, now);
+        return false;
+    });
 
     std::set <std::tuple <std::string, std::string>> streams;
     bool producer = false;
@@ -150,7 +492,58 @@ fty_email_server (zsock_t *pipe, void* args)
     zsock_signal (pipe, 0);
     while ( !zsys_interrupted ) {
 
-        void *which = zpoller_wait (poller, -1);
+        for (auto job : retry.expired (zclock_mono ())) {
+            log_debug ("%s:\tretrying delivery of %s", name, job->uuid.c_str ());
+            workers->submit (job);
+        }
+
+        // digest alerts are spooled already, commit them before delivery
+        for (auto job : digest.expired (zclock_mono ())) {
+            if (spool)
+                uncommitted.push_back (job);
+            else
+                workers->submit (job);
+        }
+
+        // don't wait if there are jobs to commit
+        int timeout = 0;
+        if (uncommitted.empty ()) {
+            int64_t now = zclock_mono ();
+            timeout = retry.timeout (now);
+            int digest_timeout = digest.timeout (now);
+            if (timeout == -1 || (digest_timeout != -1 && digest_timeout < timeout))
+                timeout = digest_timeout;
+        }
+        void *which = zpoller_wait (poller, timeout);
+
+        if (which == NULL) {
+            if (zpoller_terminated (poller))
+                break;
+            s_commit (spool, workers, uncommitted);
+            continue;
+        }
+
+        if (workers->owns (which)) {
+            EmailJob *job = workers->recv (which);
+            if (!job)
+                continue;
+            int64_t now = zclock_mono ();
+            SmtpError error = static_cast <SmtpError> (job->code);
+            if (!job->discard) {
+                breaker.result (job->server, error, now);
+                relays.result (job->server, error, job->latency, now);
+            }
+            // connection failed, try other relay at once
+            if (!job->ok && smtp_error_is_transient (error) && static_cast <size_t> (job->failovers) + 1 < relays.size ()) {
+                log_info ("%s:\tdelivery of %s via %s failed (%s), failing over", name, job->uuid.c_str (), job->server.c_str (), job->reason.c_str ());
+                job->failovers++;
+                workers->submit (job);
+                continue;
+            }
+            job->failovers = 0;
+            finish (job);
+            continue;
+        }
 
         if (which == pipe) {
             zmsg_t *msg = zmsg_recv (pipe);
@@ -178,10 +571,13 @@ fty_email_server (zsock_t *pipe, void* args)
 
                 if (s_get (config, "server/language", DEFAULT_LANGUAGE)) {
                     language = strdup (s_get (config, "server/language", DEFAULT_LANGUAGE));
-                    int rv = translation_change_language (language);
+                    int rv = change_language (language);
                     if (rv != TE_OK)
                         log_warning ("Language not changed to %s, continuing in %s", language, DEFAULT_LANGUAGE);
+                    // translations may have changed even for the same language
+                    renders.clear ();
                 }
+                sender_interfaces (s_get (config, "server/interfaces", "eth0, LAN1"));
                 // SMS_GATEWAY
                 if (s_get (config, "smtp/smsgateway", NULL)) {
                     sms_gateway = strdup (s_get (config, "smtp/smsgateway", NULL));
@@ -194,14 +590,20 @@ fty_email_server (zsock_t *pipe, void* args)
                 if (s_get (config, "smtp/msmtppath", NULL)) {
                     smtp.msmtp_path (s_get (config, "smtp/msmtppath", NULL));
                 }
+                smtp.msmtp_timeout (atoi (s_get (config, "smtp/msmtp_timeout", "60")));
 
                 // smtp
-                if (s_get (config, "smtp/server", NULL)) {
-                    smtp.host (s_get (config, "smtp/server", NULL));
-                }
+                smtp.transport (s_get (config, "smtp/transport", "msmtp"));
+                smtp.pool_size (atoi (s_get (config, "smtp/pool_size", "2")));
+                smtp.idle_timeout (atoi (s_get (config, "smtp/idle_timeout", "60")));
+                smtp.attachment_cache (static_cast <size_t> (atoi (s_get (config, "smtp/attachment_cache", "16"))) * 1024 * 1024);
                 if (s_get (config, "smtp/port", NULL)) {
                     smtp.port (s_get (config, "smtp/port", NULL));
                 }
+                // list of relays in order of preference, the first one is the default
+                relays.configure (s_get (config, "smtp/server", ""), s_get (config, "smtp/port", "25"));
+                if (relays.size () > 0)
+                    smtp.address (relays.relays () [0].address);
 
                 const char* encryption = zconfig_get (config, "smtp/encryption", "NONE");
                 if (   strcasecmp (encryption, "none") == 0
@@ -227,6 +629,68 @@ fty_email_server (zsock_t *pipe, void* args)
                 // turn on verify_ca only if smtp/verify_ca is true
                 smtp.verify_ca (streq (zconfig_get (config, "smtp/verify_ca", "false"), "true"));
 
+                int count = atoi (s_get (config, "server/workers", "2"));
+                if (count < 1) {
+                    log_warning ("(agent-smtp): server/workers must be at least 1, got %d", count);
+                    count = 1;
+                }
+                workers->resize (count);
+                workers->configure (smtp);
+                workers->aging (atoi (s_get (config, "server/aging", "30")) * 1000);
+
+                // duplicate and superseded alerts
+                dedup.window (atoi (s_get (config, "smtp/dedup_window", "0")) * 1000);
+                const char *supersede = s_get (config, "smtp/supersede", "merge");
+                if (strcasecmp (supersede, "drop") == 0)
+                    workers->supersede (EmailQueue::Supersede::DROP);
+                else {
+                    if (strcasecmp (supersede, "merge") != 0)
+                        log_warning ("(agent-smtp): smtp/supersede has unknown value, got %s, expected (merge|drop)", supersede);
+                    workers->supersede (EmailQueue::Supersede::MERGE);
+                }
+
+                // rate limits
+                ratelimit.recipient (
+                    atoi (s_get (config, "smtp/recipient_rate", "0")),
+                    atoi (s_get (config, "smtp/recipient_burst", "1")));
+                ratelimit.domain (
+                    atoi (s_get (config, "smtp/domain_rate", "0")),
+                    atoi (s_get (config, "smtp/domain_burst", "1")));
+
+                // digest of alerts
+                digest.policy (atoi (s_get (config, "smtp/digest_window", "0")) * 1000);
+
+                // circuit breaker
+                breaker.policy (
+                    atoi (s_get (config, "smtp/breaker_threshold", "5")),
+                    atoi (s_get (config, "smtp/breaker_cooldown", "60")) * 1000);
+
+                // retries of transient failures
+                retry.policy (
+                    atoi (s_get (config, "server/retry_initial", "30")) * 1000,
+                    atoi (s_get (config, "server/retry_max_interval", "600")) * 1000,
+                    atoi (s_get (config, "server/retry_max_age", "3600")) * 1000);
+
+                // spool
+                const char *spool_dir = s_get (config, "server/spool", NULL);
+                if (spool && (!spool_dir || spool->directory () != spool_dir))
+                    log_warning ("(agent-smtp): server/spool changed, restart needed to apply it");
+                else
+                if (!spool && spool_dir) {
+                    try {
+                        spool = new EmailSpool (spool_dir);
+                        for (auto job : spool->replay ()) {
+                            log_info ("(agent-smtp): replaying undelivered email %s", job->uuid.c_str ());
+                            workers->submit (job);
+                        }
+                    }
+                    catch (const std::exception &e) {
+                        log_error ("(agent-smtp): %s, emails are not spooled", e.what ());
+                        delete spool;
+                        spool = NULL;
+                    }
+                }
+
                 // malamute
                 if (zconfig_get (config, "malamute/verbose", NULL)) {
                     const char* foo = zconfig_get (config, "malamute/verbose", "false");
@@ -321,11 +785,90 @@ fty_email_server (zsock_t *pipe, void* args)
                 if (rv == -1) {
                     log_error ("%s\t:can't connect on test_client, endpoint=%s", name, endpoint);
                 }
+                // called from emailworker threads
+                std::shared_ptr <std::mutex> test_mutex = std::make_shared <std::mutex> ();
                 std::function <void (const std::string &)> cb = \
-                    [test_client, test_reader_name] (const std::string &data) {
+                    [test_client, test_reader_name, test_mutex] (const std::string &data) {
+                        std::lock_guard <std::mutex> lock (*test_mutex);
                         mlm_client_sendtox (test_client, test_reader_name, "btest", data.c_str (), NULL);
                     };
                 smtp.sendmail_set_test_fn (cb);
+                workers->configure (smtp);
+            }
+            else
+            if (streq (cmd, "STATS")) {
+                zmsg_t *reply = zmsg_new ();
+                for (int lane = 0; lane != EmailQueue::LANES; lane++) {
+                    const EmailQueue::LaneStats& stats = workers->queue ().stats (lane);
+                    std::string prefix = lane == EmailQueue::BULK ? "lane.bulk." : "lane.P" + std::to_string (lane + 1) + ".";
+                    int64_t wait_avg = stats.dequeued ? stats.wait_total / static_cast <int64_t> (stats.dequeued) : 0;
+                    zmsg_addstr (reply, (prefix + "depth").c_str ());
+                    zmsg_addstr (reply, std::to_string (stats.depth).c_str ());
+                    zmsg_addstr (reply, (prefix + "enqueued").c_str ());
+                    zmsg_addstr (reply, std::to_string (stats.enqueued).c_str ());
+                    zmsg_addstr (reply, (prefix + "dequeued").c_str ());
+                    zmsg_addstr (reply, std::to_string (stats.dequeued).c_str ());
+                    zmsg_addstr (reply, (prefix + "wait_avg").c_str ());
+                    zmsg_addstr (reply, std::to_string (wait_avg).c_str ());
+                    zmsg_addstr (reply, (prefix + "wait_max").c_str ());
+                    zmsg_addstr (reply, std::to_string (stats.wait_max).c_str ());
+                }
+                zmsg_addstr (reply, "queue.superseded");
+                zmsg_addstr (reply, std::to_string (workers->queue ().superseded ()).c_str ());
+                zmsg_addstr (reply, "dedup.suppressed");
+                zmsg_addstr (reply, std::to_string (dedup.suppressed ()).c_str ());
+                for (auto family : {std::make_pair ("limit.recipient.", &ratelimit.recipients ()), std::make_pair ("limit.domain.", &ratelimit.domains ())}) {
+                    for (const auto& it : *family.second) {
+                        std::string prefix = family.first + it.first + ".";
+                        zmsg_addstr (reply, (prefix + "tokens").c_str ());
+                        zmsg_addstrf (reply, "%.2f", it.second.tokens);
+                        zmsg_addstr (reply, (prefix + "allowed").c_str ());
+                        zmsg_addstr (reply, std::to_string (it.second.allowed).c_str ());
+                        zmsg_addstr (reply, (prefix + "deferred").c_str ());
+                        zmsg_addstr (reply, std::to_string (it.second.deferred).c_str ());
+                    }
+                }
+                for (const auto& relay : relays.relays ()) {
+                    std::string prefix = "relay." + relay.address + ".";
+                    zmsg_addstr (reply, (prefix + "latency").c_str ());
+                    zmsg_addstrf (reply, "%.0f", relay.latency);
+                    zmsg_addstr (reply, (prefix + "failures").c_str ());
+                    zmsg_addstrf (reply, "%.3f", relay.failures);
+                    zmsg_addstr (reply, (prefix + "sent").c_str ());
+                    zmsg_addstr (reply, std::to_string (relay.sent).c_str ());
+                    zmsg_addstr (reply, (prefix + "failed").c_str ());
+                    zmsg_addstr (reply, std::to_string (relay.failed).c_str ());
+                }
+                zmsg_addstr (reply, "digest.alerts");
+                zmsg_addstr (reply, std::to_string (digest.alerts ()).c_str ());
+                zmsg_addstr (reply, "digest.emails");
+                zmsg_addstr (reply, std::to_string (digest.emails ()).c_str ());
+                const EmailMagic& types = smtp.mime_types ();
+                zmsg_addstr (reply, "mime.extensions");
+                zmsg_addstr (reply, std::to_string (types.extensions ()).c_str ());
+                zmsg_addstr (reply, "mime.hits");
+                zmsg_addstr (reply, std::to_string (types.hits ()).c_str ());
+                zmsg_addstr (reply, "mime.misses");
+                zmsg_addstr (reply, std::to_string (types.misses ()).c_str ());
+                const EmailParts& parts = smtp.attachments ();
+                zmsg_addstr (reply, "parts.hits");
+                zmsg_addstr (reply, std::to_string (parts.hits ()).c_str ());
+                zmsg_addstr (reply, "parts.misses");
+                zmsg_addstr (reply, std::to_string (parts.misses ()).c_str ());
+                zmsg_addstr (reply, "parts.evictions");
+                zmsg_addstr (reply, std::to_string (parts.evictions ()).c_str ());
+                zmsg_addstr (reply, "parts.bytes");
+                zmsg_addstr (reply, std::to_string (parts.bytes ()).c_str ());
+                const DescriptionCache& descriptions = translated_descriptions ();
+                zmsg_addstr (reply, "translation.hits");
+                zmsg_addstr (reply, std::to_string (descriptions.hits ()).c_str ());
+                zmsg_addstr (reply, "translation.misses");
+                zmsg_addstr (reply, std::to_string (descriptions.misses ()).c_str ());
+                zmsg_addstr (reply, "render.hits");
+                zmsg_addstr (reply, std::to_string (renders.hits ()).c_str ());
+                zmsg_addstr (reply, "render.misses");
+                zmsg_addstr (reply, std::to_string (renders.misses ()).c_str ());
+                zmsg_send (&reply, pipe);
             }
             else
             {
@@ -355,53 +898,72 @@ fty_email_server (zsock_t *pipe, void* args)
                 continue;
             }
 
-            zmsg_t *reply = zmsg_new ();
-            zmsg_addstr (reply, uuid);
+            EmailJob *job = new EmailJob ();
+            job->sender = mlm_client_sender (client);
+            job->uuid = uuid;
             zstr_free (&uuid);
 
             if (topic == "SENDMAIL") {
-                bool sent_ok = false;
-                try {
-                    if (zmsg_size (zmessage) == 1) {
-                        std::string body = getIpAddr();
-                        ZstrGuard bodyTemp (zmsg_popstr (zmessage));
-                        body += bodyTemp.get();
-                        log_debug ("%s:\tsmtp.sendmail (%s)", name, body.c_str());
-                        smtp.sendmail (body);
-                    }
-                    else {
-                        zmsg_print (zmessage);
-                        auto mail = smtp.msg2email (&zmessage);
-                        log_debug (mail.c_str ());
-                        smtp.sendmail (mail);
-                    }
-                    zmsg_addstr (reply, "0");
-                    zmsg_addstr (reply, "OK");
-                    sent_ok = true;
+                job->type = EmailJob::Type::SENDMAIL;
+                if (zmsg_size (zmessage) == 1) {
+                    ZstrGuard body (zmsg_popstr (zmessage));
+                    job->body = body.get ();
                 }
-                catch (const std::runtime_error &re) {
-                    log_debug ("%s:\tgot std::runtime_error, e.what ()=%s", name, re.what ());
-                    sent_ok = false;
-                    uint32_t code = static_cast <uint32_t> (msmtp_stderr2code (re.what ()));
-                    zmsg_addstrf (reply, "%" PRIu32, code);
-                    zmsg_addstr (reply, UTF8::escape (re.what ()).c_str ());
+                else {
+                    zmsg_print (zmessage);
+                    job->mail = zmessage;
+                    zmessage = NULL;
                 }
-
-                int r = mlm_client_sendto (
-                        client,
-                        mlm_client_sender (client),
-                        sent_ok ? "SENDMAIL-OK" : "SENDMAIL-ERR",
-                        NULL,
-                        1000,
-                        &reply);
-                if (r == -1)
-                    log_error ("Can't send a reply for SENDMAIL to %s", mlm_client_sender (client));
+                s_accept (spool, workers, uncommitted, job);
+            }
+            else if (topic == "SENDMAIL_BATCH") {
+                std::vector <EmailJob*> jobs;
+                std::string error = s_batch_decode (zmessage, job->sender, jobs);
+                if (!error.empty ()) {
+                    log_error ("%s:\tSENDMAIL_BATCH %s: %s", name, job->uuid.c_str (), error.c_str ());
+                    zmsg_t *reply = zmsg_new ();
+                    zmsg_addstr (reply, job->uuid.c_str ());
+                    zmsg_addstrf (reply, "%" PRIu32, static_cast <uint32_t> (SmtpError::Unknown));
+                    zmsg_addstr (reply, error.c_str ());
+                    if (mlm_client_sendto (client, job->sender.c_str (), "SENDMAIL_BATCH-ERR", NULL, 1000, &reply) == -1)
+                        log_error ("Can't send a reply for SENDMAIL_BATCH to %s", job->sender.c_str ());
+                    zmsg_destroy (&reply);
+                }
+                else {
+                    // the batch must be known before any of its jobs can finish
+                    uint64_t id = ++last_batch;
+                    SendmailBatch& batch = batches [id];
+                    batch.sender = job->sender;
+                    batch.uuid = job->uuid;
+                    batch.pending = jobs.size ();
+                    for (auto batch_job : jobs) {
+                        batch.items.push_back (SendmailBatch::Item {batch_job->uuid, static_cast <uint32_t> (SmtpError::Unknown), ""});
+                        batch_job->batch = id;
+                    }
+                    log_debug ("%s:\tSENDMAIL_BATCH %s with %zu emails", name, job->uuid.c_str (), jobs.size ());
+                    for (auto batch_job : jobs)
+                        s_accept (spool, workers, uncommitted, batch_job);
+                }
+                delete job;
             }
             else if (topic == "SENDMAIL_ALERT" || topic == "SENDSMS_ALERT") {
+                job->type = (topic == "SENDMAIL_ALERT") ? EmailJob::Type::SENDMAIL_ALERT : EmailJob::Type::SENDSMS_ALERT;
                 char *priority = zmsg_popstr (zmessage);
                 char *extname = zmsg_popstr (zmessage);
                 char *contact = zmsg_popstr (zmessage);
+                // optional language frame follows the alert
+                if (zmsg_size (zmessage) > 1) {
+                    zframe_t *frame = zmsg_last (zmessage);
+                    std::string alert_language (reinterpret_cast <char*> (zframe_data (frame)), zframe_size (frame));
+                    zmsg_remove (zmessage, frame);
+                    zframe_destroy (&frame);
+                    if (valid_language (alert_language))
+                        job->language = alert_language;
+                    else
+                        log_warning ("%s:\tignoring invalid language of %s", name, job->uuid.c_str ());
+                }
                 fty_proto_t *alert = fty_proto_decode (&zmessage);
+                job->priority = priority ? atoi (priority) : 0;
                 std::string gateway = gw_template == NULL ? "" : gw_template;
                 std::string converted_contact = contact == NULL ? "" : contact;
 
@@ -410,36 +972,45 @@ fty_email_server (zsock_t *pipe, void* args)
                         log_debug ("gw_template = %s", gw_template);
                         log_debug ("contact = %s", contact);
                         std::string _contact = sms_email_address (gateway, converted_contact);
-                        s_notify (smtp, priority, extname, _contact, alert);
+                        s_notify (*job, renders, job_language (*job), priority, extname, _contact, alert);
                     }
                     else {
-                        s_notify (smtp, priority, extname, converted_contact, alert);
+                        s_notify (*job, renders, job_language (*job), priority, extname, converted_contact, alert);
+                    }
+                    job->alert = std::string (fty_proto_rule (alert)) + "@" + fty_proto_name (alert) + "\n" + job->to;
+                    job->state = fty_proto_state (alert);
+
+                    if (dedup.duplicate (job->alert, job->state + "/" + fty_proto_severity (alert), zclock_mono ())) {
+                        log_debug ("%s:\t%s is a duplicate, not sent", name, job->uuid.c_str ());
+                        job->ok = true;
+                        job->code = static_cast <uint32_t> (SmtpError::Succeeded);
+                        job->reason = "OK";
+                        s_reply (client, *job);
+                        delete job;
                     }
-                    zmsg_addstr (reply, "OK");
+                    else
+                    // P1 alerts are not delayed
+                    if (topic == "SENDMAIL_ALERT" && digest.window () > 0 && job->priority != 1)
+                        s_accept_digest (spool, digest, digest_key (*job), job);
+                    else
+                        s_accept (spool, workers, uncommitted, job);
                 }
                 catch (const std::exception &re) {
-                    log_error ("Sending of e-mail/SMS alert failed : %s", re.what ());
-                    zmsg_addstr (reply, "ERROR");
-                    zmsg_addstr (reply, re.what ());
+                    job->ok = false;
+                    job->reason = re.what ();
+                    s_reply (client, *job);
+                    delete job;
                 }
-                int r = mlm_client_sendto (
-                        client,
-                        mlm_client_sender (client),
-                        (topic == "SENDMAIL_ALERT") ? "SENDMAIL_ALERT" : "SENDSMS_ALERT",
-                        NULL,
-                        1000,
-                        &reply);
-                if (r == -1)
-                    log_error ("Can't send a reply for SENDMAIL_ALERT to %s", mlm_client_sender (client));
                 fty_proto_destroy (&alert);
                 zstr_free (&contact);
                 zstr_free (&extname);
                 zstr_free (&priority);
             }
-            else
+            else {
                 log_warning ("%s:\tUnknown subject %s", name, topic.c_str ());
+                delete job;
+            }
 
-            zmsg_destroy (&reply);
             zmsg_destroy (&zmessage);
             continue;
         }
@@ -451,6 +1022,21 @@ fty_email_server (zsock_t *pipe, void* args)
     zstr_free (&sms_gateway);
     zstr_free (&gw_template);
     zstr_free (&language);
+    // keep accepted emails in the spool, they are replayed on next start,
+    // so they are not given to workers now
+    if (spool) {
+        try {
+            spool->commit ();
+        }
+        catch (const std::exception &e) {
+            log_error ("%s", e.what ());
+        }
+    }
+    for (auto job : uncommitted)
+        delete job;
+    uncommitted.clear ();
+    delete workers;
+    delete spool;
     zpoller_destroy (&poller);
     mlm_client_destroy (&client);
     mlm_client_destroy (&test_client);
@@ -580,6 +1166,10 @@ fty_email_server_test (bool verbose)
 
     zconfig_t *config = zconfig_new ("root", NULL);
     zconfig_put (config, "smtp/gwtemplate", "0#####@hyper.mobile");
+    char *spool_dir = zsys_sprintf ("%s/server-spool", SELFTEST_DIR_RW);
+    assert (spool_dir);
+    zconfig_put (config, "server/spool", spool_dir);
+    zstr_free (&spool_dir);
     zconfig_put (config, "malamute/endpoint", endpoint);
     zconfig_put (config, "malamute/address", "agent-smtp");
     zconfig_save (config, smtpcfg_file);
@@ -849,9 +1439,53 @@ fty_email_server_test (bool verbose)
         zmsg_destroy (&msg);
         log_debug ("Test #6 OK");
     }
+    // test SENDMAIL_ALERT with language
+    {
+        log_debug ("Test #7 - send an alert in the language of the request");
+        // invalid language falls back to server/language
+        const char *languages [] = {"cs_CZ", "../cs_CZ", NULL};
+        const char *subjects [] = {"Subject: CRITICAL alarm na ASSET3 z pravidla", "Subject: CRITICAL alert on ASSET3 from the rule"};
+        for (int i = 0; languages [i]; i++) {
+            zlist_t *actions = zlist_new ();
+            zlist_append (actions, (void *) "EMAIL");
+            zmsg_t *msg = fty_proto_encode_alert (NULL, zclock_time ()/1000, 600, "NY_RULE", "ASSET3", \
+                                          "ACTIVE", "CRITICAL", "Device is offline", actions);
+            assert (msg);
+
+            zuuid_t *zuuid = zuuid_new ();
+            zmsg_pushstr (msg, "scenario1.email@eaton.com");
+            zmsg_pushstr (msg, "ASSET3");
+            zmsg_pushstr (msg, "1");
+            zmsg_pushstr (msg, zuuid_str_canonical (zuuid));
+            zmsg_addstr (msg, languages [i]);
+
+            mlm_client_sendto (alert_producer, "agent-smtp", "SENDMAIL_ALERT", NULL, 1000, &msg);
+            zmsg_t *reply = mlm_client_recv (alert_producer);
+            assert (streq (mlm_client_subject (alert_producer), "SENDMAIL_ALERT"));
+            char *str = zmsg_popstr (reply);
+            assert (streq (str, zuuid_str_canonical (zuuid)));
+            zstr_free (&str);
+            str = zmsg_popstr (reply);
+            assert (streq (str, "OK"));
+            zstr_free (&str);
+            zmsg_destroy (&reply);
+            zuuid_destroy (&zuuid);
+            zlist_destroy (&actions);
+
+            msg = mlm_client_recv (btest_reader);
+            assert (msg);
+            char *email = zmsg_popstr (msg);
+            assert (email);
+            log_debug ("%s", email);
+            assert (strstr (email, subjects [i]));
+            zstr_free (&email);
+            zmsg_destroy (&msg);
+        }
+        log_debug ("Test #7 OK");
+    }
     //test SENDMAIL
     {
-        log_debug ("Test #7 - test SENDMAIL");
+        log_debug ("Test #8 - test SENDMAIL");
         rv = mlm_client_sendtox (alert_producer, "agent-smtp", "SENDMAIL", "UUID", "foo@bar", "Subject", "body", NULL);
         assert (rv != -1);
         zmsg_t *msg = mlm_client_recv (alert_producer);
@@ -877,7 +1511,66 @@ fty_email_server_test (bool verbose)
 
         zmsg_print (msg);
         zmsg_destroy (&msg);
-        log_debug ("Test #7 OK");
+        log_debug ("Test #8 OK");
+    }
+    //test SENDMAIL_BATCH
+    {
+        log_debug ("Test #9 - test SENDMAIL_BATCH");
+        zmsg_t *msg = fty_email_batch_new ("BATCH");
+        zmsg_t *email = fty_email_encode ("UUID1", "foo@bar", "Subject", NULL, "body", NULL);
+        rv = fty_email_batch_add (msg, &email);
+        assert (rv == 0);
+        assert (!email);
+        email = zmsg_new ();
+        zmsg_addstr (email, "UUID2");
+        zmsg_addstr (email, "To: foo@bar\n\nbody");
+        rv = fty_email_batch_add (msg, &email);
+        assert (rv == 0);
+        email = zmsg_new ();
+        zmsg_addstr (email, "UUID3");
+        rv = fty_email_batch_add (msg, &email);
+        assert (rv == -1);
+        assert (!email);
+        assert (zmsg_size (msg) == 1 + 1 + 5 + 1 + 2);
+
+        rv = mlm_client_sendto (alert_producer, "agent-smtp", "SENDMAIL_BATCH", NULL, 1000, &msg);
+        assert (rv != -1);
+        msg = mlm_client_recv (alert_producer);
+        assert (streq (mlm_client_subject (alert_producer), "SENDMAIL_BATCH-OK"));
+        assert (zmsg_size (msg) == 7);
+
+        char *uuid = zmsg_popstr (msg);
+        assert (streq (uuid, "BATCH"));
+        zstr_free (&uuid);
+        for (const char *expected : {"UUID1", "UUID2"}) {
+            uuid = zmsg_popstr (msg);
+            assert (streq (uuid, expected));
+            zstr_free (&uuid);
+            char *code = zmsg_popstr (msg);
+            assert (streq (code, "0"));
+            zstr_free (&code);
+            char *reason = zmsg_popstr (msg);
+            assert (streq (reason, "OK"));
+            zstr_free (&reason);
+        }
+        zmsg_destroy (&msg);
+
+        for (int i = 0; i != 2; i++) {
+            msg = mlm_client_recv (btest_reader);
+            zmsg_destroy (&msg);
+        }
+
+        // malformed batch is refused as a whole
+        rv = mlm_client_sendtox (alert_producer, "agent-smtp", "SENDMAIL_BATCH", "BATCH2", "2", "UUID4", "body", "5", "UUID5", NULL);
+        assert (rv != -1);
+        msg = mlm_client_recv (alert_producer);
+        assert (streq (mlm_client_subject (alert_producer), "SENDMAIL_BATCH-ERR"));
+        assert (zmsg_size (msg) == 3);
+        uuid = zmsg_popstr (msg);
+        assert (streq (uuid, "BATCH2"));
+        zstr_free (&uuid);
+        zmsg_destroy (&msg);
+        log_debug ("Test #9 OK");
     }
 
     // clean up after the test